@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// MTP dataset encoder and decoder
+//
+// Datasets (ObjectInfo, handle arrays, property lists...) are a sequence of fields: fixed size
+// integers, strings (a u8 count of UTF-16 units including the terminating NUL, then the units) and
+// arrays (a u32 count, then the elements), all little endian. A dataset that doesn't fit into one
+// USB packet arrives, or has to be sent, in pieces that can end anywhere, even inside a field.
+//
+// A dataset is described by an array of dataset_field_t. The decoder takes the bytes of a dataset
+// in as many pieces as they come and stores each field where its description says: raw fields are
+// copied, strings are converted to UTF-8 into a buffer, array elements are handed to a callback one
+// by one. The encoder produces a dataset into as many buffers as it takes, converting strings from
+// UTF-8 and asking a callback for array elements as it goes. Both keep their place between calls
+// in their state structure and allocate nothing, so a dataset can go straight between the packet
+// buffer and where its fields live.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define DATASET_MAX_STRING      255             // UTF-16 units in a string, the NUL included
+
+typedef enum {
+    DATASET_RAW = 0,                            // len bytes, copied as they are (packed structs)
+    DATASET_U16,
+    DATASET_U32,
+    DATASET_STRING,
+    DATASET_ARRAY_U16,
+    DATASET_ARRAY_U32,
+} dataset_type_t;
+
+// Array elements. The decoder calls it with each element; the encoder calls it to get each one,
+// value is then where to put it. Elements come in order, index counts from 0.
+typedef void (*dataset_element_cb_t)(void *ctx, uint32_t index, uint32_t *value);
+
+typedef struct {
+    dataset_type_t type;
+    void *data;                                 // RAW, U16, U32: the value. STRING: UTF-8 text.
+                                                // nullptr: decoded and dropped, encoded as 0 / "".
+    uint32_t len;                               // RAW: size. STRING: size of the buffer when
+                                                // decoding, text is cut at a character boundary.
+                                                // ARRAY: element count when encoding.
+    dataset_element_cb_t element;               // ARRAY
+    void *ctx;                                  // For element
+} dataset_field_t;
+
+typedef struct {
+    const dataset_field_t *fields;
+    size_t field_count;
+    size_t field;                               // Being worked on
+    uint32_t pos;                               // Bytes of it done, count prefix included
+    uint32_t count;                             // STRING, ARRAY: units / elements, once known
+    uint32_t value;                             // Element or count being put together or taken apart
+    uint32_t text_pos;                          // STRING: bytes of UTF-8 done
+    uint32_t pending;                           // STRING: a high surrogate, or the low one to send
+    bool cut;                                   // STRING: the rest of the text doesn't fit
+    bool truncated;                             // Decoding: some string didn't fit its buffer
+} dataset_state_t;
+
+// Decode a dataset described by fields, count of them. fields must stay valid until done.
+void datasetDecodeBegin(dataset_state_t *state, const dataset_field_t *fields, size_t count);
+
+// Take the next len bytes of the dataset. Returns the number used, less than len only when the
+// dataset is complete and more bytes followed.
+size_t datasetDecode(dataset_state_t *state, const void *data, size_t len);
+
+// Encode a dataset described by fields, count of them. fields and what they point to must stay
+// valid until done.
+void datasetEncodeBegin(dataset_state_t *state, const dataset_field_t *fields, size_t count);
+
+// Size of the whole dataset, known before encoding it
+uint32_t datasetEncodedLength(const dataset_field_t *fields, size_t count);
+
+// Put the next bytes of the dataset into buf, up to len. Returns the number put, 0 when done.
+size_t datasetEncode(dataset_state_t *state, void *buf, size_t len);
+
+// All fields are done
+bool datasetDone(const dataset_state_t *state);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// File buffer pool
+//
+// stdio gives every stream a buffer from the heap on its first read or write, and frees it again
+// in fclose. Streams opened here get one of FILEPOOL_SLOTS fixed buffers in internal, DMA-capable
+// RAM instead. filepoolInit also has newlib allocate the FILE structures for that many streams up
+// front, which it reuses from then on. Opening and transferring a file this way doesn't touch the
+// heap for stdio state; when all slots are taken, streams fall back to a heap buffer.
+//
+// The LittleFS VFS still allocates its own per-file state and cache in fopen, esp_littlefs has no
+// way to hand those in.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define FILEPOOL_SLOTS          4               // Transfer, thumbnail and two kept open (CFG_EXAMPLE_MTP_FILE_CACHE)
+#define FILEPOOL_BUF_SIZE       4096
+
+void filepoolInit(void);
+
+// fopen / fclose with a pooled buffer. filepoolClose takes any stream.
+FILE *filepoolOpen(const char *path, const char *mode);
+int filepoolClose(FILE *f);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Flash I/O scheduler
+//
+// LittleFS serialises access to the flash by itself, but in no particular order: a task writing a
+// burst of log data holds up a host download for as long as the burst takes. Tasks sharing the
+// flash register as clients with a priority and bracket their file I/O with flashioAcquire and
+// flashioRelease, or use flashioRead / flashioWrite. One client does I/O at a time; when it's done,
+// the waiting client with the highest priority goes next. A client that has waited for longer than
+// FLASHIO_STARVATION_MS goes ahead of everyone, so background work still makes progress under
+// constant interactive load.
+//
+// A client keeps the flash across a series of operations (flashioYield between them) unless
+// someone more important is waiting, which batches them without a hand-over each time. Large
+// reads and writes are split into FLASHIO_CHUNK pieces with a yield in between.
+//
+// For each client, requests, waiting times and the queue found on arrival are counted.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define FLASHIO_MAX_CLIENTS     4
+#define FLASHIO_CHUNK           4096            // One flash sector
+#define FLASHIO_STARVATION_MS   200
+
+typedef enum {
+    FLASHIO_PRIO_BACKGROUND = 0,    // Logging, housekeeping
+    FLASHIO_PRIO_NORMAL,
+    FLASHIO_PRIO_INTERACTIVE,       // Someone is waiting for it, like a host transfer
+} flashio_prio_t;
+
+typedef struct flashio_client flashio_client_t;
+
+typedef struct {
+    uint32_t requests;              // Times the flash was acquired
+    uint32_t waits;                 // Of those, times the client had to queue
+    uint64_t wait_us_total;
+    uint32_t wait_us_max;
+    uint32_t queue_depth_max;       // Most clients found ahead (owner and queued) on arrival
+    uint64_t bytes;                 // Moved through flashioRead / flashioWrite
+} flashio_stats_t;
+
+// Register a client. A client belongs to one task. Returns nullptr when all FLASHIO_MAX_CLIENTS
+// are taken; all functions accept nullptr and then do unscheduled I/O.
+flashio_client_t *flashioRegister(const char *name, flashio_prio_t priority);
+
+// Wait for the flash, and give it back. Calls nest.
+void flashioAcquire(flashio_client_t *client);
+void flashioRelease(flashio_client_t *client);
+
+// Between operations of a batch: hand the flash over if a more important client is waiting
+void flashioYield(flashio_client_t *client);
+
+// fread / fwrite through the scheduler
+size_t flashioRead(flashio_client_t *client, FILE *f, void *buf, size_t len);
+size_t flashioWrite(flashio_client_t *client, FILE *f, const void *buf, size_t len);
+
+void flashioGetStats(const flashio_client_t *client, flashio_stats_t *stats);
+
+// Log the statistics of all clients
+void flashioLogStats(void);
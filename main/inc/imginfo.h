@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Image metadata
+//
+// Detects the format of a stored object from its name and leading bytes, and for PNG, JPEG, BMP
+// and GIF reads the pixel dimensions and bit depth from the headers. Also works out where a
+// thumbnail can come from: the EXIF thumbnail embedded in a JPEG, the image itself when it's small
+// enough, or a downscaled copy that is generated once for uncompressed BMPs.
+//
+// Content is pulled through a read callback, so objects that aren't plain files on disk work too.
+// Only headers are read, never the pixel data (except when generating a thumbnail).
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define IMGINFO_THUMB_SIDE      160             // Longer side of generated thumbnails
+#define IMGINFO_SELF_THUMB_MAX  (16 * 1024)     // Images up to this size serve as their own thumbnail
+
+typedef enum {
+    IMGINFO_FORMAT_UNKNOWN = 0,
+    IMGINFO_FORMAT_TEXT,
+    IMGINFO_FORMAT_PNG,
+    IMGINFO_FORMAT_JPEG_EXIF,
+    IMGINFO_FORMAT_JPEG_JFIF,
+    IMGINFO_FORMAT_BMP,
+    IMGINFO_FORMAT_GIF,
+} imginfo_format_t;
+
+typedef enum {
+    IMGINFO_THUMB_NONE = 0,
+    IMGINFO_THUMB_EMBEDDED,     // Byte range thumb_offset/thumb_size of the object
+    IMGINFO_THUMB_SELF,         // The whole object
+    IMGINFO_THUMB_GENERATED,    // Made with imginfoBmpThumbnail, thumb_size bytes long
+} imginfo_thumb_t;
+
+typedef struct {
+    uint16_t format;            // imginfo_format_t
+    uint8_t bit_depth;          // Bits per pixel
+    uint8_t thumb_source;       // imginfo_thumb_t
+    uint32_t width;
+    uint32_t height;
+    uint16_t thumb_format;      // imginfo_format_t
+    uint16_t thumb_width;
+    uint16_t thumb_height;
+    uint32_t thumb_offset;
+    uint32_t thumb_size;
+} imginfo_t;
+
+// Read up to len bytes of object content at offset, returns the number of bytes read
+typedef size_t (*imginfo_read_t)(void *ctx, uint32_t offset, void *buf, size_t len);
+
+// Fill info for an object called name, size bytes long. Objects that aren't recognised come out
+// as IMGINFO_FORMAT_UNKNOWN (or TEXT, going by the name) without a thumbnail.
+void imginfoParse(imginfo_read_t read, void *ctx, const char *name, uint32_t size, imginfo_t *info);
+
+// Write the downscaled copy of a BMP that imginfoParse marked as IMGINFO_THUMB_GENERATED to out
+bool imginfoBmpThumbnail(imginfo_read_t read, void *ctx, const imginfo_t *info, FILE *out);
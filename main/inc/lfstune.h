@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// LittleFS configuration tuner
+//
+// The CONFIG_LITTLEFS_* sizes are a trade between RAM and flash traffic that depends on the flash
+// chip and on what is stored. The tuner measures the chip, on a scratch partition whose content
+// it destroys: erase time, and read and program time for every power-of-two size from 16 bytes to
+// a block. It also times a traversal of the mounted LittleFS, which is what an allocator lookahead
+// refill costs.
+//
+// It then works out what a workload would cost under every valid combination of read, program,
+// cache and lookahead size. It follows how LittleFS splits file data into cache-sized programs,
+// fills metadata logs in program-sized commits and compacts them, reads metadata in cache-sized
+// pieces, and rescans for free blocks every 8 * lookahead blocks. The cheapest combination that
+// fits the RAM budget wins.
+//
+// The workload is the trace of file operations recorded with lfstuneRecord, so tuning after a
+// session of typical use tunes for that use. With an empty trace a synthetic mix of small and
+// large files is used.
+//
+// block_cycles trades wear leveling against relocation overhead over the device's lifetime, which
+// a short measurement can't see. It is passed through unchanged.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define LFSTUNE_TRACE_LEN       128             // Most recent operations recorded
+#define LFSTUNE_RAM_BUDGET      (16 * 1024)     // For caches and lookahead buffer
+#define LFSTUNE_OPEN_FILES      4               // Files open at once, each has its own cache
+
+typedef enum {
+    LFSTUNE_OP_CREATE = 0,
+    LFSTUNE_OP_WRITE,                           // size bytes written to a new file, then closed
+    LFSTUNE_OP_READ,                            // A file of size bytes opened and read
+    LFSTUNE_OP_DELETE,
+} lfstune_op_t;
+
+typedef struct {
+    uint16_t read_size;
+    uint16_t prog_size;
+    uint16_t cache_size;
+    uint16_t lookahead_size;
+    uint32_t block_cycles;
+    uint32_t ram;                               // Bytes for caches and lookahead
+    uint64_t cost_us;                           // Of the workload, estimated
+} lfstune_config_t;
+
+// Add an operation to the trace
+void lfstuneRecord(lfstune_op_t op, uint32_t size);
+
+// Start tuning with the scratch partition of that label. Returns false if there is none.
+bool lfstuneBegin(const char *scratch_label);
+
+// Take one measurement, a few milliseconds of flash work. Returns true when all are taken and the
+// result is ready.
+bool lfstuneStep(void);
+
+// The best configuration, and the one built in for comparison
+bool lfstuneResult(lfstune_config_t *best, lfstune_config_t *current);
+
+// Write best as an sdkconfig fragment
+int lfstuneFormat(const lfstune_config_t *best, const lfstune_config_t *current, char *buf, size_t len);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Small LZ77 block codec (LZF bitstream)
+//
+// Fast and tiny rather than tight: it's meant for squeezing text and logs on the way to flash,
+// with a few KiB of state. Blocks are at most 64 KiB.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Compress in_len bytes into out. Returns the compressed length, or 0 when the result would not
+// fit into out_cap bytes (callers typically pass in_len - 1 and store incompressible data raw).
+size_t lzblockCompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap);
+
+// Decompress a block. Returns the decompressed length, or 0 on corrupted input or overflow.
+size_t lzblockDecompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap);
@@ -0,0 +1,81 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// MTP responder
+//
+// Entry points of the responder (src/monolith) for the rest of the firmware. The TinyUSB callbacks
+// are found by the stack itself and aren't listed here.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Set up the responder. Call once before the TinyUSB task starts.
+void mtpInit(void);
+
+// Build the object index once LittleFS is mounted. Until this returns, USB enumerates and the host
+// may ask for DeviceInfo, but operations that need the storage get DeviceBusy. Call once, from any
+// task.
+void mtpLoadStorage(void);
+
+// How often the TinyUSB task stops waiting for USB events to call mtpPoll, when there's no
+// background work
+#define MTP_POLL_INTERVAL_MS    1000
+
+// Housekeeping that isn't triggered by the host, such as expiring abandoned uploads, and a time
+// slice of the background operation in progress. Must be called from the TinyUSB task, between
+// tud_task_ext calls. Returns how long tud_task_ext may wait for USB events before the next call,
+// in milliseconds.
+uint32_t mtpPoll(void);
+
+// Body of the upload writer task (TaskMtpWriter), called in a loop: waits for buffered upload data
+// and writes it to flash.
+void mtpWriterWork(void);
+
+// Changes the firmware makes under /littlefs while a host is connected. The host sees them right
+// away, instead of at the next session. Paths are absolute (/littlefs/...). May be called from any
+// task; the handle table is updated in the TinyUSB task.
+void mtpNotifyWritten(const char *path);    // File or folder created, or file content changed
+void mtpNotifyRemoved(const char *path);
+void mtpNotifyRenamed(const char *old_path, const char *new_path);
+
+// mkdir / unlink / rename that also notify the responder
+int mtpMkdir(const char *path);
+int mtpUnlink(const char *path);
+int mtpRename(const char *old_path, const char *new_path);
+
+// Where a file at path (/littlefs/folder/name) is stored. New files in sharded folders go to a
+// hidden subfolder, which is created if needed; an existing file directly in the folder stays
+// where it is. Open and notify with the path returned. Returns 0, or
+// -ENAMETOOLONG if it doesn't fit into path_out.
+int mtpResolvePath(const char *path, char *path_out, size_t buf_len);
+
+// Objects the host sees, for other tasks to look at. Copies are consistent (taken while the
+// responder wasn't changing its index) and taking them never holds up the TinyUSB task.
+typedef struct {
+    uint32_t handle;
+    uint32_t parent_handle;     // 0 for objects in the root
+    bool is_dir;
+    char name[64];
+} mtp_object_t;
+
+// Changes whenever objects are added, removed or renamed. Cheap, for polling.
+uint32_t mtpIndexVersion(void);
+
+// Copy up to max_objects objects, all from the same moment. Returns how many there are in total,
+// which may be more than max_objects. version (optional) receives the mtpIndexVersion of the copy.
+size_t mtpListObjects(mtp_object_t *objects, size_t max_objects, uint32_t *version);
+
+bool mtpGetObject(uint32_t handle, mtp_object_t *object);
+
+// Object content kept in PSRAM for repeated reads (CFG_EXAMPLE_MTP_BLOCK_CACHE_*). Counts are of
+// cache blocks looked up since boot.
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint64_t bytes_saved;       // Served from the cache instead of the flash
+    size_t size;                // Cache size in bytes, 0 without PSRAM
+} mtp_block_cache_stats_t;
+
+void mtpGetBlockCacheStats(mtp_block_cache_stats_t *stats);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "imginfo.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Object metadata store
+//
+// Keeps facts about stored objects that are expensive to recompute (content digests and the like)
+// across sessions and reboots. Records are keyed by path. Whoever changes a file's content drops its
+// record (objmetaRemove); file times are no help there, they have a resolution of a second and the
+// clock starts at 0 on every boot. As a backstop, a record also remembers the size the file had
+// and is treated as stale when the file no longer has it.
+//
+// Changes are kept in RAM until objmetaSave, which rewrites the whole store: callers batch them.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define OBJMETA_PATH_LEN        128
+#define OBJMETA_MAX_RECORDS     40
+#define OBJMETA_SHA256_LEN      32
+
+// Record flags, describing which optional fields hold valid data
+#define OBJMETA_HAS_SHA256      (1u << 0)
+#define OBJMETA_COMPRESSED      (1u << 1)   // Stored as a zfile, logical_size holds the real size
+#define OBJMETA_REFERENCE       (1u << 2)   // Stub pointing at shared content, logical_size holds the real size
+#define OBJMETA_HAS_IMAGE       (1u << 4)   // image holds the format detected from content (also for non-images)
+
+typedef struct {
+    char path[OBJMETA_PATH_LEN];    // Relative to the mount point. Empty when the slot is unused
+    uint32_t size;                  // Size on disk
+    uint32_t flags;
+    uint8_t sha256[OBJMETA_SHA256_LEN];
+    uint32_t logical_size;
+    imginfo_t image;
+} objmeta_t;
+
+// Load the store from <base_path>/.mtp. Missing or corrupted store files result in an empty store.
+void objmetaLoad(const char *base_path);
+
+// Write the store back to flash if anything changed since the last save
+void objmetaSave(void);
+
+// Returns true when there are changes objmetaSave would write
+bool objmetaPending(void);
+
+// Find the record for path. Returns nullptr when there is none or when it no longer matches the
+// file on disk. The pointer stays valid until the next call that modifies the store.
+objmeta_t *objmetaLookup(const char *path);
+
+// Find or create the record for path, and bring its size in line with the file on disk.
+// Any optional fields of a stale record are dropped. Returns nullptr when the store is full.
+objmeta_t *objmetaUpdate(const char *path);
+
+// Mark a record (obtained with objmetaUpdate) as modified so it gets saved
+void objmetaMarkDirty(void);
+
+// Forget path, e.g. because it was deleted or its content was written
+void objmetaRemove(const char *path);
+void objmetaRename(const char *old_path, const char *new_path);
+
+// Drop records of files that no longer exist, a few at a time: checks up to count records from
+// *cursor on and advances it, until it reaches OBJMETA_MAX_RECORDS. Returns the number dropped.
+int objmetaPrune(int *cursor, int count);
@@ -8,9 +8,24 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 extern TaskHandle_t hTaskTinyusb;
+extern TaskHandle_t hTaskMtpWriter;
+extern TaskHandle_t hTaskStorage;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Task Entrypoints
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 void TaskTinyusb(void *pvParameters);
+void TaskMtpWriter(void *pvParameters);
+void TaskStorage(void *pvParameters);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Boot
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Time a boot phase: start = init_phase_begin(), then init_phase_end("Name", start) logs it
+int64_t init_phase_begin(void);
+void init_phase_end(const char *phase, int64_t start);
+
+// Mount the storage and build the object index, in TaskStorage
+int init_storage(void);
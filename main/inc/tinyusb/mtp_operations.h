@@ -0,0 +1,49 @@
+#pragma once
+
+// The operations the responder implements, and their handlers. This is the only list: DeviceInfo
+// advertises exactly these (CFG_TUD_MTP_DEVICEINFO_SUPPORTED_OPERATIONS in tusb_config.h), and
+// the dispatch table in usb_mtp_impl.c.h is generated from it too, so an operation is either
+// listed here with a handler or not supported at all.
+//
+// This header is included from tusb_config.h, keep it free of anything but macros. The handlers
+// are only named here; they are declared and defined in src/monolith.
+
+#include "mtp_vendor.h"
+
+#define MTP_OPERATIONS(X) \
+  X(MTP_OP_GET_DEVICE_INFO,               fs_get_device_info)       \
+  X(MTP_OP_OPEN_SESSION,                  fs_open_close_session)    \
+  X(MTP_OP_CLOSE_SESSION,                 fs_open_close_session)    \
+  X(MTP_OP_GET_STORAGE_IDS,               fs_get_storage_ids)       \
+  X(MTP_OP_GET_STORAGE_INFO,              fs_get_storage_info)      \
+  X(MTP_OP_GET_OBJECT_HANDLES,            fs_get_object_handles)    \
+  X(MTP_OP_GET_OBJECT_INFO,               fs_get_object_info)       \
+  X(MTP_OP_GET_OBJECT,                    fs_get_object)            \
+  X(MTP_OP_GET_THUMB,                     fs_get_thumb)             \
+  X(MTP_OP_DELETE_OBJECT,                 fs_delete_object)         \
+  X(MTP_OP_SEND_OBJECT_INFO,              fs_send_object_info)      \
+  X(MTP_OP_SEND_OBJECT,                   fs_send_object)           \
+  X(MTP_OP_GET_DEVICE_PROP_DESC,          fs_get_device_properties) \
+  X(MTP_OP_GET_DEVICE_PROP_VALUE,         fs_get_device_properties) \
+  X(MTP_OP_VENDOR_GET_BLOCK_CHECKSUMS,    fs_get_block_checksums)   \
+  X(MTP_OP_VENDOR_APPLY_DELTA,            fs_apply_delta)           \
+  X(MTP_OP_VENDOR_GET_OBJECT_DIGEST,      fs_get_object_digest)     \
+  X(MTP_OP_VENDOR_GET_UPLOAD_STATE,       fs_get_upload_state)      \
+  X(MTP_OP_VENDOR_TUNE_STORAGE,           fs_tune_storage)          \
+  X(MTP_OP_ANDROID_SEND_PARTIAL_OBJECT,   fs_send_partial_object)
+
+// The operation codes, separated by commas. Each comes with a leading comma, and the first one is
+// dropped: the list is counted as macro arguments, where a trailing comma would count as one more.
+#define MTP_OPERATION_CODE_(code, handler)  , code
+#define MTP_OPERATION_DROP_FIRST_(first, ...) __VA_ARGS__
+#define MTP_OPERATION_DROP_FIRST(...)       MTP_OPERATION_DROP_FIRST_(__VA_ARGS__)
+#define MTP_OPERATION_CODES                 MTP_OPERATION_DROP_FIRST(MTP_OPERATIONS(MTP_OPERATION_CODE_))
+
+// Operation codes come in a few small ranges. Their slot in the dispatch table is the offset into
+// the range plus the size of the ranges before it; MTP_OPERATION_SLOTS for codes outside them.
+#define MTP_OPERATION_SLOT(code) \
+  ((code) >= 0x1000u && (code) < 0x1040u ? (code) - 0x1000u :         /* Standard */        \
+   (code) >= 0x9100u && (code) < 0x9110u ? (code) - 0x9100u + 0x40u : /* Our vendor ones */ \
+   (code) >= 0x95C0u && (code) < 0x95D0u ? (code) - 0x95C0u + 0x50u : /* Android */         \
+   MTP_OPERATION_SLOTS)
+#define MTP_OPERATION_SLOTS                 0x60u
@@ -0,0 +1,47 @@
+#pragma once
+
+// Vendor extension operation codes. MTP reserves 0x9000-0x97FF for vendor extensions; our own stay
+// clear of the 0x95xx block that Android uses for its extensions, of which we implement a few.
+//
+// This header is included from tusb_config.h so the codes can be listed in DeviceInfo, keep it
+// free of anything but plain constants.
+
+//------------- Block-delta sync -------------//
+// GetBlockChecksums(handle, block_size)
+//   Data (device to host): u32 block_size, u32 block_count, u32 file_size, then for each block a
+//   u32 rolling checksum followed by a 16 byte MD5 digest of the block.
+#define MTP_OP_VENDOR_GET_BLOCK_CHECKSUMS   0x9101u
+// ApplyDelta(handle, block_size, new_size, delta_len)
+//   Data (host to device): a stream of delta instructions, delta_len bytes in total.
+#define MTP_OP_VENDOR_APPLY_DELTA           0x9102u
+
+// Delta stream instructions, all integers are little endian
+//   COPY    u8 0x01, u32 src_block, u32 block_count
+//   LITERAL u8 0x02, u32 len, followed by len bytes of data
+#define MTP_DELTA_INSN_COPY     0x01u
+#define MTP_DELTA_INSN_LITERAL  0x02u
+
+//------------- Integrity -------------//
+// GetObjectDigest(handle)
+//   Data (device to host): u32 algorithm (1 = SHA-256), followed by the 32 byte digest. Uploads
+//   are hashed on the fly; other objects are hashed when first asked for.
+#define MTP_OP_VENDOR_GET_OBJECT_DIGEST     0x9103u
+
+//------------- Resumable uploads -------------//
+// GetUploadState(handle)
+//   Data (device to host): u32 expected_size, u32 committed_size. For an interrupted upload,
+//   committed_size is how much of it is safely stored; continue from there with SendPartialObject.
+//   Complete objects report their size for both.
+#define MTP_OP_VENDOR_GET_UPLOAD_STATE      0x9104u
+
+//------------- Storage tuning -------------//
+// TuneStorage()
+//   No data. Measures the flash and writes the LittleFS configuration that suits it and the
+//   operations seen since boot to lfstune.sdkconfig in the storage root. Takes a few seconds.
+#define MTP_OP_VENDOR_TUNE_STORAGE          0x9105u
+
+//------------- Android extensions -------------//
+// SendPartialObject(handle, offset_low, offset_high, size)
+//   Data (host to device): size bytes to store at offset. Only accepted for interrupted uploads,
+//   with offset no further than their committed size.
+#define MTP_OP_ANDROID_SEND_PARTIAL_OBJECT  0x95C2u
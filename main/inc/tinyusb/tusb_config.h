@@ -99,26 +99,16 @@
 #define CFG_TUD_MTP_EP_CONTROL_BUFSIZE  16 // should be enough to hold data in MTP control request
 
 //------------- MTP device info -------------//
-#define CFG_TUD_MTP_DEVICEINFO_EXTENSIONS   "microsoft.com: 1.0; "
-#define CFG_TUD_MTP_DEVICEINFO_SUPPORTED_OPERATIONS \
-   MTP_OP_GET_DEVICE_INFO, \
-   MTP_OP_OPEN_SESSION, \
-   MTP_OP_CLOSE_SESSION, \
-   MTP_OP_GET_STORAGE_IDS, \
-   MTP_OP_GET_STORAGE_INFO, \
-   MTP_OP_GET_OBJECT_HANDLES, \
-   MTP_OP_GET_OBJECT_INFO, \
-   MTP_OP_GET_OBJECT, \
-   MTP_OP_DELETE_OBJECT, \
-   MTP_OP_SEND_OBJECT_INFO, \
-   MTP_OP_SEND_OBJECT, \
-   MTP_OP_RESET_DEVICE, \
-   MTP_OP_GET_DEVICE_PROP_DESC, \
-   MTP_OP_GET_DEVICE_PROP_VALUE, \
-   MTP_OP_SET_DEVICE_PROP_VALUE
+#include "mtp_operations.h"
+
+#define CFG_TUD_MTP_DEVICEINFO_EXTENSIONS   "microsoft.com: 1.0; android.com: 1.0; "
+#define CFG_TUD_MTP_DEVICEINFO_SUPPORTED_OPERATIONS MTP_OPERATION_CODES
 
 #define CFG_TUD_MTP_DEVICEINFO_SUPPORTED_EVENTS \
-    MTP_EVENT_OBJECT_ADDED
+    MTP_EVENT_OBJECT_ADDED, \
+    MTP_EVENT_OBJECT_REMOVED, \
+    MTP_EVENT_OBJECT_INFO_CHANGED, \
+    MTP_EVENT_STORAGE_INFO_CHANGED
 
 #define CFG_TUD_MTP_DEVICEINFO_SUPPORTED_DEVICE_PROPERTIES  \
     MTP_DEV_PROP_DEVICE_FRIENDLY_NAME
@@ -133,7 +123,11 @@
     MTP_OBJ_FORMAT_UNDEFINED, \
     MTP_OBJ_FORMAT_ASSOCIATION, \
     MTP_OBJ_FORMAT_TEXT, \
-    MTP_OBJ_FORMAT_PNG
+    MTP_OBJ_FORMAT_PNG, \
+    MTP_OBJ_FORMAT_EXIF_JPEG, \
+    MTP_OBJ_FORMAT_JFIF, \
+    MTP_OBJ_FORMAT_BMP, \
+    MTP_OBJ_FORMAT_GIF
 
 #ifdef __cplusplus
  }
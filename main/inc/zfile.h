@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Block-framed compressed files
+//
+// A compressed file starts with a small header carrying the logical (uncompressed) size, followed
+// by one frame per ZFILE_BLOCK_SIZE bytes of content. Each frame is a u16 length, with the top bit
+// set when the block is stored raw because it didn't compress, followed by the block data.
+// Frames are independent, so reading from an arbitrary offset only decompresses the block that
+// holds it. Finding that block doesn't mean walking the frames from the start either: the file
+// ends with a frame index, the file offset of every stride-th frame (up to ZFILE_INDEX_MAX of
+// them), followed by a footer. A seek reads one index entry and walks fewer than stride frames.
+// Files written by version 1, without an index, are still read by walking.
+//
+// Application code reading objects uploaded over MTP should go through zfileProbe/zfileRead,
+// since files in compressed folders are not plain data on disk.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define ZFILE_BLOCK_SHIFT   12
+#define ZFILE_BLOCK_SIZE    (1u << ZFILE_BLOCK_SHIFT)
+#define ZFILE_INDEX_MAX     256         // Index entries; every frame has one up to 1 MiB of content
+
+typedef struct {
+    FILE *f;
+    uint32_t logical_size;
+    uint32_t pos;               // Logical position of the next byte read or written
+    uint32_t block_index;       // Block held in raw, UINT32_MAX if none
+    uint32_t block_len;         // Valid bytes in raw
+    uint32_t next_frame_index;  // Block index of the frame at next_frame_offset
+    long next_frame_offset;     // File offset of the frame after the current one
+    uint32_t index_stride;      // Blocks per index entry
+    long index_offset;          // File offset of the frame index, 0 if there is none
+    uint32_t index[ZFILE_INDEX_MAX];    // Writing: frame offsets collected for the index
+    uint8_t raw[ZFILE_BLOCK_SIZE];
+    uint8_t packed[ZFILE_BLOCK_SIZE];
+} zfile_t;
+
+// Check whether f holds a compressed file. On success the logical size is stored in logical_size
+// (may be nullptr). The file position is left undefined.
+bool zfileProbe(FILE *f, uint32_t *logical_size);
+
+// Attach a reader to a file that passed zfileProbe
+bool zfileOpenRead(zfile_t *z, FILE *f);
+size_t zfileRead(zfile_t *z, void *buf, size_t len);
+bool zfileSeek(zfile_t *z, uint32_t offset);
+
+// Start writing a compressed file into the empty file f
+bool zfileOpenWrite(zfile_t *z, FILE *f, uint32_t logical_size);
+size_t zfileWrite(zfile_t *z, const void *buf, size_t len);
+// Flush the last partial block and append the frame index. Does not close f.
+bool zfileFinish(zfile_t *z);
@@ -0,0 +1,352 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "dataset.h"
+
+#define REPLACEMENT_CHAR    0xFFFDu
+
+static uint32_t element_size(dataset_type_t type)
+{
+    return type == DATASET_U16 || type == DATASET_ARRAY_U16 ? 2 : 4;
+}
+
+static void next_field(dataset_state_t *state)
+{
+    state->field++;
+    state->pos = 0;
+    state->count = 0;
+    state->value = 0;
+    state->text_pos = 0;
+    state->pending = 0;
+    state->cut = false;
+}
+
+bool datasetDone(const dataset_state_t *state)
+{
+    return state->field >= state->field_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decoding
+
+void datasetDecodeBegin(dataset_state_t *state, const dataset_field_t *fields, size_t count)
+{
+    memset(state, 0, sizeof(*state));
+    state->fields = fields;
+    state->field_count = count;
+}
+
+// Append code point cp to the text of field as UTF-8, if there's room for it and the NUL
+static void put_utf8(dataset_state_t *state, const dataset_field_t *field, uint32_t cp)
+{
+    uint8_t utf8[4];
+    uint32_t n;
+    if (cp < 0x80) {
+        utf8[0] = cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        utf8[0] = 0xC0 | (cp >> 6);
+        utf8[1] = 0x80 | (cp & 0x3F);
+        n = 2;
+    } else if (cp < 0x10000) {
+        utf8[0] = 0xE0 | (cp >> 12);
+        utf8[1] = 0x80 | ((cp >> 6) & 0x3F);
+        utf8[2] = 0x80 | (cp & 0x3F);
+        n = 3;
+    } else {
+        utf8[0] = 0xF0 | (cp >> 18);
+        utf8[1] = 0x80 | ((cp >> 12) & 0x3F);
+        utf8[2] = 0x80 | ((cp >> 6) & 0x3F);
+        utf8[3] = 0x80 | (cp & 0x3F);
+        n = 4;
+    }
+    if (field->data == nullptr || state->cut) {
+        return;
+    }
+    if (state->text_pos + n + 1 > field->len) {
+        state->cut = true;
+        state->truncated = true;
+        return;
+    }
+    memcpy((uint8_t *)field->data + state->text_pos, utf8, n);
+    state->text_pos += n;
+}
+
+// A UTF-16 unit of a string arrived
+static void decode_unit(dataset_state_t *state, const dataset_field_t *field, uint32_t unit)
+{
+    if (unit >= 0xD800 && unit < 0xDC00) {
+        if (state->pending != 0) {
+            put_utf8(state, field, REPLACEMENT_CHAR);
+        }
+        state->pending = unit;
+        return;
+    }
+    if (unit >= 0xDC00 && unit < 0xE000) {
+        put_utf8(state, field, state->pending != 0 ?
+                 0x10000 + ((state->pending - 0xD800) << 10) + (unit - 0xDC00) : REPLACEMENT_CHAR);
+        state->pending = 0;
+        return;
+    }
+    if (state->pending != 0) {
+        put_utf8(state, field, REPLACEMENT_CHAR);
+        state->pending = 0;
+    }
+    if (unit != 0) {
+        put_utf8(state, field, unit);
+    }
+}
+
+// Take one byte of a field that isn't RAW. Returns true when the field is complete.
+static bool decode_byte(dataset_state_t *state, const dataset_field_t *field, uint8_t byte)
+{
+    const uint32_t pos = state->pos++;
+    switch (field->type) {
+    case DATASET_U16:
+    case DATASET_U32: {
+        const uint32_t size = element_size(field->type);
+        state->value |= (uint32_t)byte << (8 * pos);
+        if (state->pos < size) {
+            return false;
+        }
+        if (field->data != nullptr) {
+            if (size == 2) {
+                *(uint16_t *)field->data = state->value;
+            } else {
+                *(uint32_t *)field->data = state->value;
+            }
+        }
+        return true;
+    }
+
+    case DATASET_STRING:
+        if (pos == 0) {
+            state->count = byte;
+        } else if ((pos & 1) == 1) {
+            state->value = byte;
+        } else {
+            decode_unit(state, field, state->value | (uint32_t)byte << 8);
+        }
+        if (state->pos < 1 + 2 * state->count) {
+            return false;
+        }
+        if (state->pending != 0) {
+            put_utf8(state, field, REPLACEMENT_CHAR);
+        }
+        if (field->data != nullptr && field->len > 0) {
+            ((char *)field->data)[state->text_pos] = '\0';
+        }
+        return true;
+
+    case DATASET_ARRAY_U16:
+    case DATASET_ARRAY_U32: {
+        const uint32_t size = element_size(field->type);
+        if (pos < 4) {
+            state->count |= (uint32_t)byte << (8 * pos);
+        } else {
+            const uint32_t in_element = (pos - 4) % size;
+            state->value = in_element == 0 ? byte : state->value | (uint32_t)byte << (8 * in_element);
+            if (in_element == size - 1 && field->element != nullptr) {
+                field->element(field->ctx, (pos - 4) / size, &state->value);
+            }
+        }
+        return state->pos >= 4 && state->pos == 4 + state->count * size;
+    }
+
+    default:
+        return true;
+    }
+}
+
+size_t datasetDecode(dataset_state_t *state, const void *data, size_t len)
+{
+    const uint8_t *in = data;
+    size_t done = 0;
+    while (done < len && !datasetDone(state)) {
+        const dataset_field_t *field = &state->fields[state->field];
+        if (field->type == DATASET_RAW) {
+            const size_t n = len - done < field->len - state->pos ? len - done : field->len - state->pos;
+            if (field->data != nullptr) {
+                memcpy((uint8_t *)field->data + state->pos, in + done, n);
+            }
+            state->pos += n;
+            done += n;
+            if (state->pos == field->len) {
+                next_field(state);
+            }
+        } else if (decode_byte(state, field, in[done++])) {
+            next_field(state);
+        }
+    }
+    return done;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Encoding
+
+// The code point at text[*pos], moving *pos past it. Invalid sequences give a replacement
+// character per byte.
+static uint32_t utf8_next(const char *text, uint32_t *pos)
+{
+    const uint8_t *s = (const uint8_t *)text + *pos;
+    uint32_t cp, n;
+    if (s[0] < 0x80) {
+        cp = s[0];
+        n = 1;
+    } else if ((s[0] & 0xE0) == 0xC0) {
+        cp = s[0] & 0x1F;
+        n = 2;
+    } else if ((s[0] & 0xF0) == 0xE0) {
+        cp = s[0] & 0x0F;
+        n = 3;
+    } else if ((s[0] & 0xF8) == 0xF0) {
+        cp = s[0] & 0x07;
+        n = 4;
+    } else {
+        (*pos)++;
+        return REPLACEMENT_CHAR;
+    }
+    for (uint32_t ii = 1; ii < n; ii++) {
+        if ((s[ii] & 0xC0) != 0x80) {
+            (*pos)++;
+            return REPLACEMENT_CHAR;
+        }
+        cp = cp << 6 | (s[ii] & 0x3F);
+    }
+    *pos += n;
+    return cp > 0x10FFFF ? REPLACEMENT_CHAR : cp;
+}
+
+// UTF-16 units of text, the NUL included, at most DATASET_MAX_STRING. 0 for an empty string.
+static uint32_t string_units(const char *text)
+{
+    if (text == nullptr || text[0] == '\0') {
+        return 0;
+    }
+    uint32_t units = 0, pos = 0;
+    while (text[pos] != '\0') {
+        const uint32_t n = utf8_next(text, &pos) > 0xFFFF ? 2 : 1;
+        if (units + n + 1 > DATASET_MAX_STRING) {
+            break;
+        }
+        units += n;
+    }
+    return units + 1;
+}
+
+static uint32_t field_length(const dataset_field_t *field)
+{
+    switch (field->type) {
+    case DATASET_RAW:       return field->len;
+    case DATASET_STRING:    return 1 + 2 * string_units(field->data);
+    case DATASET_ARRAY_U16:
+    case DATASET_ARRAY_U32: return 4 + field->len * element_size(field->type);
+    default:                return element_size(field->type);
+    }
+}
+
+uint32_t datasetEncodedLength(const dataset_field_t *fields, size_t count)
+{
+    uint32_t len = 0;
+    for (size_t ii = 0; ii < count; ii++) {
+        len += field_length(&fields[ii]);
+    }
+    return len;
+}
+
+void datasetEncodeBegin(dataset_state_t *state, const dataset_field_t *fields, size_t count)
+{
+    datasetDecodeBegin(state, fields, count);
+}
+
+// The next UTF-16 unit of a string, the NUL after the last one
+static uint32_t encode_unit(dataset_state_t *state, const dataset_field_t *field, uint32_t index)
+{
+    if (state->pending != 0) {
+        const uint32_t unit = state->pending;
+        state->pending = 0;
+        return unit;
+    }
+    if (index == state->count - 1) {
+        return 0;
+    }
+    const uint32_t cp = utf8_next(field->data, &state->text_pos);
+    if (cp > 0xFFFF) {
+        state->pending = 0xDC00 + ((cp - 0x10000) & 0x3FF);
+        return 0xD800 + ((cp - 0x10000) >> 10);
+    }
+    return cp;
+}
+
+// Produce one byte of a field that isn't RAW
+static uint8_t encode_byte(dataset_state_t *state, const dataset_field_t *field)
+{
+    const uint32_t pos = state->pos++;
+    switch (field->type) {
+    case DATASET_U16:
+    case DATASET_U32:
+        if (pos == 0 && field->data != nullptr) {
+            state->value = element_size(field->type) == 2 ? *(const uint16_t *)field->data
+                                                          : *(const uint32_t *)field->data;
+        }
+        return state->value >> (8 * pos);
+
+    case DATASET_STRING:
+        if (pos == 0) {
+            state->count = string_units(field->data);
+            return state->count;
+        }
+        if ((pos & 1) == 1) {
+            state->value = encode_unit(state, field, (pos - 1) / 2);
+            return state->value;
+        }
+        return state->value >> 8;
+
+    case DATASET_ARRAY_U16:
+    case DATASET_ARRAY_U32: {
+        if (pos < 4) {
+            return field->len >> (8 * pos);
+        }
+        const uint32_t size = element_size(field->type);
+        const uint32_t in_element = (pos - 4) % size;
+        if (in_element == 0) {
+            state->value = 0;
+            if (field->element != nullptr) {
+                field->element(field->ctx, (pos - 4) / size, &state->value);
+            }
+        }
+        return state->value >> (8 * in_element);
+    }
+
+    default:
+        return 0;
+    }
+}
+
+size_t datasetEncode(dataset_state_t *state, void *buf, size_t len)
+{
+    uint8_t *out = buf;
+    size_t done = 0;
+    while (done < len && !datasetDone(state)) {
+        const dataset_field_t *field = &state->fields[state->field];
+        // A string's length is known once its count is out
+        const uint32_t field_len = field->type == DATASET_STRING && state->pos > 0 ? 1 + 2 * state->count
+                                                                                   : field_length(field);
+        if (field->type == DATASET_RAW) {
+            const size_t n = len - done < field_len - state->pos ? len - done : field_len - state->pos;
+            if (field->data != nullptr) {
+                memcpy(out + done, (const uint8_t *)field->data + state->pos, n);
+            } else {
+                memset(out + done, 0, n);
+            }
+            state->pos += n;
+            done += n;
+        } else if (state->pos < field_len) {
+            out[done++] = encode_byte(state, field);
+        }
+        if (state->pos >= field_len) {
+            next_field(state);
+        }
+    }
+    return done;
+}
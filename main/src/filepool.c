@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_log.h>
+#include <esp_attr.h>
+#include "freertos/FreeRTOS.h"
+#include "filepool.h"
+
+#define TAG "filepool"
+
+static DMA_ATTR uint8_t buffers[FILEPOOL_SLOTS][FILEPOOL_BUF_SIZE];
+static FILE *owners[FILEPOOL_SLOTS];
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+void filepoolInit(void)
+{
+    // newlib allocates FILE structures when it runs out and never frees them. Have it allocate
+    // enough for the pool now, rather than on some transfer later.
+    FILE *streams[FILEPOOL_SLOTS] = { 0 };
+    for (int ii = 0; ii < FILEPOOL_SLOTS; ii++) {
+        streams[ii] = fopen("/dev/null", "r");
+    }
+    for (int ii = 0; ii < FILEPOOL_SLOTS; ii++) {
+        if (streams[ii] == nullptr) {
+            ESP_LOGW(TAG, "Cannot open /dev/null, FILE structures are allocated on first use");
+            break;
+        }
+        fclose(streams[ii]);
+    }
+}
+
+FILE *filepoolOpen(const char *path, const char *mode)
+{
+    FILE *f = fopen(path, mode);
+    if (f == nullptr) {
+        return nullptr;
+    }
+
+    int slot = -1;
+    portENTER_CRITICAL(&lock);
+    for (int ii = 0; ii < FILEPOOL_SLOTS && slot < 0; ii++) {
+        if (owners[ii] == nullptr) {
+            owners[ii] = f;
+            slot = ii;
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (slot < 0) {
+        ESP_LOGW(TAG, "Pool exhausted, %s gets a heap buffer", path);
+    } else if (setvbuf(f, (char *)buffers[slot], _IOFBF, FILEPOOL_BUF_SIZE) != 0) {
+        ESP_LOGE(TAG, "setvbuf failed for %s", path);
+    }
+    return f;
+}
+
+int filepoolClose(FILE *f)
+{
+    // Flush into the buffer's owner before handing the buffer to someone else
+    const int ret = fclose(f);
+    portENTER_CRITICAL(&lock);
+    for (int ii = 0; ii < FILEPOOL_SLOTS; ii++) {
+        if (owners[ii] == f) {
+            owners[ii] = nullptr;
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+    return ret;
+}
@@ -0,0 +1,220 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "flashio.h"
+
+#define TAG "flashio"
+
+struct flashio_client {
+    const char *name;
+    flashio_prio_t priority;
+    bool waiting;
+    uint32_t depth;                 // Nesting of flashioAcquire while owning the flash
+    int64_t wait_since;
+    SemaphoreHandle_t grant;        // Given when the flash is handed over
+    StaticSemaphore_t grant_buf;
+    flashio_stats_t stats;
+};
+
+static flashio_client_t clients[FLASHIO_MAX_CLIENTS];
+static int client_count;
+static flashio_client_t *owner;
+static int waiting_count;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Priority a waiting client competes with. Starved clients beat everyone.
+static int flashioRank(const flashio_client_t *client, int64_t now)
+{
+    if (now - client->wait_since >= FLASHIO_STARVATION_MS * 1000LL) {
+        return FLASHIO_PRIO_INTERACTIVE + 1;
+    }
+    return client->priority;
+}
+
+// The client to go next: highest rank, longest waiting among equals. Called with the lock held.
+static flashio_client_t *flashioPickNext(int64_t now)
+{
+    flashio_client_t *best = nullptr;
+    int best_rank = -1;
+    for (int ii = 0; ii < client_count; ii++) {
+        flashio_client_t *client = &clients[ii];
+        if (!client->waiting) {
+            continue;
+        }
+        const int rank = flashioRank(client, now);
+        if (rank > best_rank || (rank == best_rank && client->wait_since < best->wait_since)) {
+            best = client;
+            best_rank = rank;
+        }
+    }
+    return best;
+}
+
+flashio_client_t *flashioRegister(const char *name, flashio_prio_t priority)
+{
+    flashio_client_t *client = nullptr;
+    portENTER_CRITICAL(&lock);
+    if (client_count < FLASHIO_MAX_CLIENTS) {
+        client = &clients[client_count];
+        memset(client, 0, sizeof(*client));
+        client->name = name;
+        client->priority = priority;
+        client->grant = xSemaphoreCreateBinaryStatic(&client->grant_buf);
+        client_count++;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (client == nullptr) {
+        ESP_LOGE(TAG, "No room for client %s, its I/O is not scheduled", name);
+    }
+    return client;
+}
+
+void flashioAcquire(flashio_client_t *client)
+{
+    if (client == nullptr) {
+        return;
+    }
+    const int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock);
+    if (owner == client) {
+        client->depth++;
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+    client->stats.requests++;
+    if (owner == nullptr && waiting_count == 0) {
+        owner = client;
+        client->depth = 1;
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+    const uint32_t ahead = waiting_count + (owner != nullptr ? 1 : 0);
+    if (ahead > client->stats.queue_depth_max) {
+        client->stats.queue_depth_max = ahead;
+    }
+    client->waiting = true;
+    client->wait_since = now;
+    waiting_count++;
+    portEXIT_CRITICAL(&lock);
+
+    // flashioRelease makes us the owner before giving the semaphore
+    xSemaphoreTake(client->grant, portMAX_DELAY);
+
+    const int64_t waited = esp_timer_get_time() - now;
+    portENTER_CRITICAL(&lock);
+    client->stats.waits++;
+    client->stats.wait_us_total += waited;
+    if (waited > client->stats.wait_us_max) {
+        client->stats.wait_us_max = waited;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+void flashioRelease(flashio_client_t *client)
+{
+    if (client == nullptr) {
+        return;
+    }
+    portENTER_CRITICAL(&lock);
+    if (owner != client || --client->depth > 0) {
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+    flashio_client_t *next = flashioPickNext(esp_timer_get_time());
+    if (next != nullptr) {
+        next->waiting = false;
+        next->depth = 1;
+        waiting_count--;
+    }
+    owner = next;
+    portEXIT_CRITICAL(&lock);
+
+    if (next != nullptr) {
+        xSemaphoreGive(next->grant);
+    }
+}
+
+void flashioYield(flashio_client_t *client)
+{
+    if (client == nullptr) {
+        return;
+    }
+    const int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock);
+    const flashio_client_t *next = flashioPickNext(now);
+    const bool hand_over = owner == client && next != nullptr && flashioRank(next, now) > (int)client->priority;
+    const uint32_t depth = client->depth;
+    portEXIT_CRITICAL(&lock);
+    if (!hand_over) {
+        return;
+    }
+
+    // Let them go first, then carry on at the same nesting depth
+    client->depth = 1;
+    flashioRelease(client);
+    flashioAcquire(client);
+    client->depth = depth;
+}
+
+size_t flashioRead(flashio_client_t *client, FILE *f, void *buf, size_t len)
+{
+    size_t done = 0;
+    flashioAcquire(client);
+    while (done < len) {
+        const size_t chunk = len - done < FLASHIO_CHUNK ? len - done : FLASHIO_CHUNK;
+        const size_t n = fread((uint8_t *)buf + done, 1, chunk, f);
+        done += n;
+        if (n < chunk) {
+            break;
+        }
+        flashioYield(client);
+    }
+    if (client != nullptr) {
+        client->stats.bytes += done;
+    }
+    flashioRelease(client);
+    return done;
+}
+
+size_t flashioWrite(flashio_client_t *client, FILE *f, const void *buf, size_t len)
+{
+    size_t done = 0;
+    flashioAcquire(client);
+    while (done < len) {
+        const size_t chunk = len - done < FLASHIO_CHUNK ? len - done : FLASHIO_CHUNK;
+        const size_t n = fwrite((const uint8_t *)buf + done, 1, chunk, f);
+        done += n;
+        if (n < chunk) {
+            break;
+        }
+        flashioYield(client);
+    }
+    if (client != nullptr) {
+        client->stats.bytes += done;
+    }
+    flashioRelease(client);
+    return done;
+}
+
+void flashioGetStats(const flashio_client_t *client, flashio_stats_t *stats)
+{
+    portENTER_CRITICAL(&lock);
+    *stats = client->stats;
+    portEXIT_CRITICAL(&lock);
+}
+
+void flashioLogStats(void)
+{
+    for (int ii = 0; ii < client_count; ii++) {
+        flashio_stats_t stats;
+        flashioGetStats(&clients[ii], &stats);
+        ESP_LOGI(TAG, "%s: %lu requests, %lu waited (avg %llu us, max %lu us), queue depth max %lu, %llu bytes",
+                 clients[ii].name, (unsigned long)stats.requests, (unsigned long)stats.waits,
+                 (unsigned long long)(stats.waits ? stats.wait_us_total / stats.waits : 0),
+                 (unsigned long)stats.wait_us_max, (unsigned long)stats.queue_depth_max,
+                 (unsigned long long)stats.bytes);
+    }
+}
@@ -0,0 +1,345 @@
+#include <string.h>
+#include <strings.h>
+#include <esp_log.h>
+#include "imginfo.h"
+
+#define TAG "imginfo"
+
+#define JPEG_MAX_SEGMENTS   32      // Frame header not found after this many segments: give up
+#define EXIF_MAX_ENTRIES    32
+#define BMP_HEADER_LEN      54
+
+static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+typedef struct __attribute__((packed)) {
+    uint8_t magic[2];
+    uint32_t file_size;
+    uint32_t reserved;
+    uint32_t data_offset;
+    uint32_t header_size;
+    int32_t width;
+    int32_t height;
+    uint16_t planes;
+    uint16_t bit_count;
+    uint32_t compression;
+    uint32_t image_size;
+    int32_t x_ppm;
+    int32_t y_ppm;
+    uint32_t colors_used;
+    uint32_t colors_important;
+} bmp_header_t;
+
+static uint16_t imginfoBe16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+static uint32_t imginfoBe32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static uint16_t imginfoLe16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t imginfoLe32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+static imginfo_format_t imginfoFormatFromName(const char *name)
+{
+    static const struct {
+        const char *ext;
+        imginfo_format_t format;
+    } extensions[] = {
+        { ".png", IMGINFO_FORMAT_PNG },
+        { ".jpg", IMGINFO_FORMAT_JPEG_JFIF },
+        { ".jpeg", IMGINFO_FORMAT_JPEG_JFIF },
+        { ".bmp", IMGINFO_FORMAT_BMP },
+        { ".gif", IMGINFO_FORMAT_GIF },
+        { ".txt", IMGINFO_FORMAT_TEXT },
+        { ".log", IMGINFO_FORMAT_TEXT },
+        { ".csv", IMGINFO_FORMAT_TEXT },
+        { ".md", IMGINFO_FORMAT_TEXT },
+    };
+
+    const char *ext = strrchr(name, '.');
+    for (size_t ii = 0; ext != nullptr && ii < sizeof(extensions) / sizeof(extensions[0]); ii++) {
+        if (strcasecmp(ext, extensions[ii].ext) == 0) {
+            return extensions[ii].format;
+        }
+    }
+    return IMGINFO_FORMAT_UNKNOWN;
+}
+
+// Walk the segments of the JPEG stream at [pos, end) up to the frame header. Reports where the
+// EXIF block (the TIFF structure inside APP1) is, if exif_offset is given.
+static bool imginfoJpegFrame(imginfo_read_t read, void *ctx, uint32_t pos, uint32_t end, imginfo_t *info,
+                             uint32_t *exif_offset, uint32_t *exif_len)
+{
+    uint8_t seg[8];
+    if (read(ctx, pos, seg, 2) != 2 || seg[0] != 0xFF || seg[1] != 0xD8) {
+        return false;
+    }
+    pos += 2;
+
+    for (int ii = 0; ii < JPEG_MAX_SEGMENTS && pos + 4 <= end; ii++) {
+        if (read(ctx, pos, seg, 4) != 4 || seg[0] != 0xFF) {
+            return false;
+        }
+        const uint8_t marker = seg[1];
+        if (marker == 0xFF) {
+            // Fill byte before the marker
+            pos++;
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9) {
+            // Scan data or end of image before any frame header
+            return false;
+        }
+        const uint16_t seg_len = imginfoBe16(seg + 2);
+        if (seg_len < 2) {
+            return false;
+        }
+
+        const bool is_sof = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if (is_sof) {
+            if (read(ctx, pos + 4, seg, 6) != 6) {
+                return false;
+            }
+            info->height = imginfoBe16(seg + 1);
+            info->width = imginfoBe16(seg + 3);
+            info->bit_depth = seg[0] * seg[5];
+            return true;
+        }
+        if (marker == 0xE1 && exif_offset != nullptr && seg_len >= 8) {
+            if (read(ctx, pos + 4, seg, 6) == 6 && memcmp(seg, "Exif\0\0", 6) == 0) {
+                *exif_offset = pos + 10;
+                *exif_len = seg_len - 8;
+            }
+        }
+        pos += 2 + seg_len;
+    }
+    return false;
+}
+
+// Find the JPEG thumbnail in IFD1 of an EXIF block. Offsets in the block are relative to its start.
+static bool imginfoExifThumb(imginfo_read_t read, void *ctx, uint32_t base, uint32_t len,
+                             uint32_t *thumb_offset, uint32_t *thumb_size)
+{
+    uint8_t buf[12];
+    if (len < 8 || read(ctx, base, buf, 8) != 8) {
+        return false;
+    }
+    const bool le = buf[0] == 'I' && buf[1] == 'I';
+    if (!le && !(buf[0] == 'M' && buf[1] == 'M')) {
+        return false;
+    }
+    #define EXIF16(p) (le ? imginfoLe16(p) : imginfoBe16(p))
+    #define EXIF32(p) (le ? imginfoLe32(p) : imginfoBe32(p))
+
+    // Skip over IFD0 to get the offset of IFD1
+    const uint32_t ifd0 = EXIF32(buf + 4);
+    if (ifd0 + 2 > len || read(ctx, base + ifd0, buf, 2) != 2) {
+        return false;
+    }
+    const uint32_t next_ptr = ifd0 + 2 + EXIF16(buf) * 12;
+    if (next_ptr + 4 > len || read(ctx, base + next_ptr, buf, 4) != 4) {
+        return false;
+    }
+    const uint32_t ifd1 = EXIF32(buf);
+    if (ifd1 == 0 || ifd1 + 2 > len || read(ctx, base + ifd1, buf, 2) != 2) {
+        return false;
+    }
+
+    uint32_t offset = 0, size = 0;
+    const uint32_t count = EXIF16(buf);
+    for (uint32_t ii = 0; ii < count && ii < EXIF_MAX_ENTRIES; ii++) {
+        const uint32_t entry = ifd1 + 2 + ii * 12;
+        if (entry + 12 > len || read(ctx, base + entry, buf, 12) != 12) {
+            return false;
+        }
+        const uint16_t tag = EXIF16(buf);
+        const uint32_t value = EXIF16(buf + 2) == 3 ? EXIF16(buf + 8) : EXIF32(buf + 8);
+        if (tag == 0x0201) {        // JPEGInterchangeFormat
+            offset = value;
+        } else if (tag == 0x0202) { // JPEGInterchangeFormatLength
+            size = value;
+        }
+    }
+    #undef EXIF16
+    #undef EXIF32
+
+    if (offset == 0 || size == 0 || offset + size > len) {
+        return false;
+    }
+    *thumb_offset = base + offset;
+    *thumb_size = size;
+    return true;
+}
+
+static bool imginfoParsePng(const uint8_t *hdr, size_t hdr_len, imginfo_t *info)
+{
+    if (hdr_len < 26 || memcmp(hdr, png_signature, sizeof(png_signature)) != 0 || memcmp(hdr + 12, "IHDR", 4) != 0) {
+        return false;
+    }
+    static const uint8_t channels[] = { 1, 0, 3, 1, 2, 0, 4 };
+    const uint8_t color_type = hdr[25];
+    info->format = IMGINFO_FORMAT_PNG;
+    info->width = imginfoBe32(hdr + 16);
+    info->height = imginfoBe32(hdr + 20);
+    info->bit_depth = color_type < sizeof(channels) ? hdr[24] * channels[color_type] : 0;
+    return true;
+}
+
+static bool imginfoParseBmp(const uint8_t *hdr, size_t hdr_len, imginfo_t *info)
+{
+    bmp_header_t bmp;
+    if (hdr_len < sizeof(bmp) || hdr[0] != 'B' || hdr[1] != 'M') {
+        return false;
+    }
+    memcpy(&bmp, hdr, sizeof(bmp));
+    if (bmp.header_size < 40 || bmp.width <= 0 || bmp.height == 0) {
+        return false;
+    }
+    info->format = IMGINFO_FORMAT_BMP;
+    info->width = bmp.width;
+    info->height = bmp.height < 0 ? -bmp.height : bmp.height;
+    info->bit_depth = bmp.bit_count;
+    return true;
+}
+
+static bool imginfoParseGif(const uint8_t *hdr, size_t hdr_len, imginfo_t *info)
+{
+    if (hdr_len < 11 || (memcmp(hdr, "GIF87a", 6) != 0 && memcmp(hdr, "GIF89a", 6) != 0)) {
+        return false;
+    }
+    info->format = IMGINFO_FORMAT_GIF;
+    info->width = imginfoLe16(hdr + 6);
+    info->height = imginfoLe16(hdr + 8);
+    info->bit_depth = ((hdr[10] >> 4) & 7) + 1;
+    return true;
+}
+
+// Uncompressed 24 and 32 bit BMPs can be scaled down without decoding anything
+static bool imginfoBmpScalable(const uint8_t *hdr, size_t hdr_len)
+{
+    bmp_header_t bmp;
+    if (hdr_len < sizeof(bmp)) {
+        return false;
+    }
+    memcpy(&bmp, hdr, sizeof(bmp));
+    return bmp.compression == 0 && (bmp.bit_count == 24 || bmp.bit_count == 32);
+}
+
+void imginfoParse(imginfo_read_t read, void *ctx, const char *name, uint32_t size, imginfo_t *info)
+{
+    uint8_t hdr[BMP_HEADER_LEN];
+
+    memset(info, 0, sizeof(*info));
+    info->format = imginfoFormatFromName(name);
+
+    const size_t hdr_len = read(ctx, 0, hdr, sizeof(hdr));
+    uint32_t exif_offset = 0, exif_len = 0;
+    imginfo_t jpeg = { 0 };
+    if (hdr_len >= 3 && hdr[0] == 0xFF && hdr[1] == 0xD8 && hdr[2] == 0xFF) {
+        if (imginfoJpegFrame(read, ctx, 0, size, &jpeg, &exif_offset, &exif_len)) {
+            info->format = exif_len ? IMGINFO_FORMAT_JPEG_EXIF : IMGINFO_FORMAT_JPEG_JFIF;
+            info->width = jpeg.width;
+            info->height = jpeg.height;
+            info->bit_depth = jpeg.bit_depth;
+        }
+    } else if (!imginfoParsePng(hdr, hdr_len, info) &&
+               !imginfoParseBmp(hdr, hdr_len, info) &&
+               !imginfoParseGif(hdr, hdr_len, info)) {
+        // Not an image we can read, the name is all we have. Never claim an image format then.
+        if (info->format != IMGINFO_FORMAT_TEXT) {
+            info->format = IMGINFO_FORMAT_UNKNOWN;
+        }
+    }
+    if (info->width == 0 || info->height == 0) {
+        return;
+    }
+
+    // Where to get a thumbnail from, cheapest source first
+    imginfo_t thumb = { 0 };
+    if (exif_len && imginfoExifThumb(read, ctx, exif_offset, exif_len, &info->thumb_offset, &info->thumb_size) &&
+        imginfoJpegFrame(read, ctx, info->thumb_offset, info->thumb_offset + info->thumb_size, &thumb, nullptr, nullptr)) {
+        info->thumb_source = IMGINFO_THUMB_EMBEDDED;
+        info->thumb_format = IMGINFO_FORMAT_JPEG_JFIF;
+        info->thumb_width = thumb.width;
+        info->thumb_height = thumb.height;
+    } else if (size <= IMGINFO_SELF_THUMB_MAX && info->width <= IMGINFO_THUMB_SIDE && info->height <= IMGINFO_THUMB_SIDE) {
+        info->thumb_source = IMGINFO_THUMB_SELF;
+        info->thumb_format = info->format;
+        info->thumb_width = info->width;
+        info->thumb_height = info->height;
+        info->thumb_offset = 0;
+        info->thumb_size = size;
+    } else if (info->format == IMGINFO_FORMAT_BMP && imginfoBmpScalable(hdr, hdr_len)) {
+        if (info->width >= info->height) {
+            info->thumb_width = info->width < IMGINFO_THUMB_SIDE ? info->width : IMGINFO_THUMB_SIDE;
+            info->thumb_height = (uint64_t)info->height * info->thumb_width / info->width;
+        } else {
+            info->thumb_height = info->height < IMGINFO_THUMB_SIDE ? info->height : IMGINFO_THUMB_SIDE;
+            info->thumb_width = (uint64_t)info->width * info->thumb_height / info->height;
+        }
+        info->thumb_width = info->thumb_width ? info->thumb_width : 1;
+        info->thumb_height = info->thumb_height ? info->thumb_height : 1;
+        info->thumb_source = IMGINFO_THUMB_GENERATED;
+        info->thumb_format = IMGINFO_FORMAT_BMP;
+        info->thumb_offset = 0;
+        info->thumb_size = BMP_HEADER_LEN + ((info->thumb_width * 3 + 3) & ~3u) * info->thumb_height;
+    } else {
+        info->thumb_offset = 0;
+        info->thumb_size = 0;
+    }
+}
+
+bool imginfoBmpThumbnail(imginfo_read_t read, void *ctx, const imginfo_t *info, FILE *out)
+{
+    static uint8_t window[512];
+    static uint8_t row[IMGINFO_THUMB_SIDE * 3 + 3];
+    bmp_header_t bmp;
+
+    if (info->thumb_source != IMGINFO_THUMB_GENERATED || read(ctx, 0, &bmp, sizeof(bmp)) != sizeof(bmp)) {
+        return false;
+    }
+    const bool top_down = bmp.height < 0;
+    const uint32_t src_pixel = bmp.bit_count / 8;
+    const uint32_t src_stride = ((info->width * bmp.bit_count + 31) / 32) * 4;
+    const uint32_t tw = info->thumb_width, th = info->thumb_height;
+    const uint32_t out_stride = (tw * 3 + 3) & ~3u;
+
+    const bmp_header_t out_header = {
+        .magic = { 'B', 'M' },
+        .file_size = info->thumb_size,
+        .data_offset = BMP_HEADER_LEN,
+        .header_size = 40,
+        .width = tw,
+        .height = th,
+        .planes = 1,
+        .bit_count = 24,
+        .image_size = out_stride * th,
+        .x_ppm = 2835,
+        .y_ppm = 2835,
+    };
+    if (fwrite(&out_header, sizeof(out_header), 1, out) != 1) {
+        return false;
+    }
+
+    // Nearest neighbour, written bottom-up. Source pixels of one row are read through a small window
+    // since they're close together.
+    for (uint32_t r = 0; r < th; r++) {
+        const uint32_t src_y = (uint64_t)(th - 1 - r) * info->height / th;
+        const uint32_t file_row = top_down ? src_y : info->height - 1 - src_y;
+        const uint32_t row_offset = bmp.data_offset + file_row * src_stride;
+        uint32_t window_start = 0, window_len = 0;
+
+        memset(row, 0, out_stride);
+        for (uint32_t x = 0; x < tw; x++) {
+            const uint32_t offset = row_offset + (uint64_t)x * info->width / tw * src_pixel;
+            if (window_len == 0 || offset < window_start || offset + 3 > window_start + window_len) {
+                window_start = offset;
+                window_len = read(ctx, offset, window, sizeof(window));
+                if (window_len < 3) {
+                    ESP_LOGE(TAG, "Short read at %d", offset);
+                    return false;
+                }
+            }
+            memcpy(row + x * 3, window + (offset - window_start), 3);
+        }
+        if (fwrite(row, 1, out_stride, out) != out_stride) {
+            return false;
+        }
+    }
+    return true;
+}
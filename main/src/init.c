@@ -1,12 +1,27 @@
 
 #include "esp_littlefs.h"
 #include "tasks.h"
+#include "mtp.h"
+#include "filepool.h"
 #include "tusb.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_private/usb_phy.h"
 
 #define TAG "init"
 
+// Boot phases run on both cores at once, each is timed from its own start
+int64_t init_phase_begin(void)
+{
+    return esp_timer_get_time();
+}
+
+void init_phase_end(const char *phase, int64_t start)
+{
+    const int64_t now = esp_timer_get_time();
+    ESP_LOGI(TAG, "%s took %lld ms, done %lld ms after boot", phase, (now - start) / 1000, now / 1000);
+}
+
 int init_hardware_usb_phy(void)
 {
     static usb_phy_handle_t handle;
@@ -69,10 +84,26 @@ int init_littlefs(void)
     return ESP_OK;
 }
 
+// Everything USB enumeration needs. The storage is mounted by TaskStorage (init_storage) meanwhile.
 int init_software(void)
 {
     ESP_ERROR_CHECK(init_tinyusb());
+    filepoolInit();
+    mtpInit();
+
+    return ESP_OK;
+}
+
+// Runs in TaskStorage, on the other core than TinyUSB. MTP operations get DeviceBusy until done.
+int init_storage(void)
+{
+    int64_t start = init_phase_begin();
     ESP_ERROR_CHECK(init_littlefs());
+    init_phase_end("LittleFS mount", start);
+
+    start = init_phase_begin();
+    mtpLoadStorage();
+    init_phase_end("Object index", start);
 
     return ESP_OK;
 }
@@ -80,14 +111,37 @@ int init_software(void)
 int init_tasks(void)
 {
     BaseType_t ret;
-    ret = xTaskCreate(
+    // TinyUSB and storage get a core each, so mounting doesn't hold up enumeration
+    ret = xTaskCreatePinnedToCore(
         TaskTinyusb,
         "tinyusb",
         1024 * 8,
         NULL,
         5,
-        &hTaskTinyusb);
+        &hTaskTinyusb,
+        0);
+    if (ret != pdPASS) return ESP_FAIL;
+
+    // Below TinyUSB, which only waits for it when the flash can't keep up with an upload
+    ret = xTaskCreate(
+        TaskMtpWriter,
+        "mtp_writer",
+        1024 * 6,
+        NULL,
+        4,
+        &hTaskMtpWriter);
     if (ret != pdPASS) return ESP_FAIL;
-    
+
+    // Mounting (or formatting) may take seconds, USB enumerates meanwhile
+    ret = xTaskCreatePinnedToCore(
+        TaskStorage,
+        "storage",
+        1024 * 6,
+        NULL,
+        3,
+        &hTaskStorage,
+        portNUM_PROCESSORS - 1);
+    if (ret != pdPASS) return ESP_FAIL;
+
     return ESP_OK;
 }
@@ -0,0 +1,295 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_partition.h>
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+#include "esp_littlefs.h"
+#include "lfstune.h"
+
+#define TAG "lfstune"
+
+#define FS_LABEL        "littlefs"      // The partition being tuned for, as mounted in init.c
+#define BLOCK           4096
+#define SIZES           9               // 16 .. 4096 bytes
+#define MIN_SIZE        16
+#define REPEAT          4               // Per size, the average is kept
+
+// How LittleFS lays out metadata, roughly: what a commit adds to a metadata log, how much of a
+// compacted metadata block is live, and the largest file it keeps inline
+#define META_COMMIT     64
+#define META_LIVE       1024
+#define INLINE_MAX      (BLOCK / 8)
+
+typedef struct {
+    uint8_t op;
+    uint32_t size;
+} trace_entry_t;
+
+static trace_entry_t trace[LFSTUNE_TRACE_LEN];
+static uint32_t trace_count;            // Recorded in total, the ring holds the last ones
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Measurements, in microseconds
+static struct {
+    const esp_partition_t *scratch;
+    int step;
+    bool done;
+    uint32_t erase_us;
+    uint32_t prog_us[SIZES];
+    uint32_t read_us[SIZES];
+    uint32_t scan_us;                   // Traversal of the mounted file system
+    uint32_t blocks;                    // In the mounted file system
+    uint32_t blocks_used;
+} m;
+
+static uint8_t pattern[BLOCK];
+
+void lfstuneRecord(lfstune_op_t op, uint32_t size)
+{
+    portENTER_CRITICAL(&lock);
+    trace[trace_count % LFSTUNE_TRACE_LEN] = (trace_entry_t) { .op = op, .size = size };
+    trace_count++;
+    portEXIT_CRITICAL(&lock);
+}
+
+bool lfstuneBegin(const char *scratch_label)
+{
+    memset(&m, 0, sizeof(m));
+    m.scratch = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, scratch_label);
+    if (m.scratch == nullptr || m.scratch->size < SIZES * BLOCK) {
+        ESP_LOGE(TAG, "No scratch partition \"%s\" of %u bytes", scratch_label, SIZES * BLOCK);
+        m.scratch = nullptr;
+        return false;
+    }
+    for (int ii = 0; ii < BLOCK; ii++) {
+        pattern[ii] = ii * 7 + 1;
+    }
+    return true;
+}
+
+// Erase block index of the scratch partition, then time REPEAT programs and reads of size bytes
+static void measure_size(int index)
+{
+    const uint32_t size = MIN_SIZE << index;
+    const uint32_t base = index * BLOCK;
+    const int count = size * REPEAT <= BLOCK ? REPEAT : 1;
+    static uint8_t buf[BLOCK];
+
+    int64_t t = esp_timer_get_time();
+    esp_partition_erase_range(m.scratch, base, BLOCK);
+    const uint32_t erase_us = esp_timer_get_time() - t;
+    m.erase_us = m.erase_us > erase_us || m.erase_us == 0 ? erase_us : m.erase_us;
+
+    t = esp_timer_get_time();
+    for (int ii = 0; ii < count; ii++) {
+        esp_partition_write(m.scratch, base + ii * size, pattern, size);
+    }
+    m.prog_us[index] = (esp_timer_get_time() - t) / count;
+
+    t = esp_timer_get_time();
+    for (int ii = 0; ii < count; ii++) {
+        esp_partition_read(m.scratch, base + ii * size, buf, size);
+    }
+    m.read_us[index] = (esp_timer_get_time() - t) / count;
+}
+
+static void measure_scan(void)
+{
+    size_t total = 0, used = 0;
+    const int64_t t = esp_timer_get_time();
+    if (esp_littlefs_info(FS_LABEL, &total, &used) != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot get %s usage, assuming an empty file system", FS_LABEL);
+    }
+    m.scan_us = esp_timer_get_time() - t;
+    m.blocks = total / BLOCK;
+    m.blocks_used = used / BLOCK;
+}
+
+bool lfstuneStep(void)
+{
+    if (m.scratch == nullptr || m.done) {
+        return true;
+    }
+    if (m.step < SIZES) {
+        measure_size(m.step);
+    } else if (m.step == SIZES) {
+        measure_scan();
+    } else {
+        // Leave the scratch partition erased, as it would be if never used
+        esp_partition_erase_range(m.scratch, 0, SIZES * BLOCK);
+        m.done = true;
+        ESP_LOGI(TAG, "Erase %lu us, 16 B program %lu us, 4 KiB program %lu us, 4 KiB read %lu us, "
+                 "scan of %lu blocks %lu us", (unsigned long)m.erase_us, (unsigned long)m.prog_us[0],
+                 (unsigned long)m.prog_us[SIZES - 1], (unsigned long)m.read_us[SIZES - 1],
+                 (unsigned long)m.blocks, (unsigned long)m.scan_us);
+        return true;
+    }
+    m.step++;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Cost model
+
+static uint32_t div_up(uint32_t a, uint32_t b)
+{
+    return (a + b - 1) / b;
+}
+
+// Cost of one access of size bytes, from the measurement of the next power of two
+static uint32_t access_us(const uint32_t *table, uint32_t size)
+{
+    int index = 0;
+    while (index < SIZES - 1 && (uint32_t)(MIN_SIZE << index) < size) {
+        index++;
+    }
+    return table[index];
+}
+
+// One commit to a metadata log, with its share of compacting the log when it fills up
+static uint64_t commit_us(const lfstune_config_t *c, uint32_t bytes)
+{
+    const uint32_t padded = div_up(bytes, c->prog_size) * c->prog_size;
+    const uint32_t commits_per_block = (BLOCK - META_LIVE) / padded;
+    const uint64_t compact_us = m.erase_us + div_up(META_LIVE, c->cache_size) *
+                                (uint64_t)access_us(m.prog_us, c->cache_size);
+    return access_us(m.prog_us, padded) + compact_us / (commits_per_block ? commits_per_block : 1);
+}
+
+// Looking a name up in a half full metadata log, read through the cache
+static uint64_t fetch_us(const lfstune_config_t *c)
+{
+    return div_up(BLOCK / 2, c->cache_size) * (uint64_t)access_us(m.read_us, c->cache_size);
+}
+
+// Finding n free blocks: the allocator scans the file system each time it has been through a
+// lookahead window of 8 * lookahead_size blocks, of which some are in use
+static uint64_t alloc_us(const lfstune_config_t *c, uint32_t n)
+{
+    const uint32_t window = m.blocks ? (8 * c->lookahead_size < m.blocks ? 8 * c->lookahead_size : m.blocks)
+                                     : 8 * c->lookahead_size;
+    const uint32_t free_percent = m.blocks ? 100 - 100 * m.blocks_used / m.blocks : 100;
+    const uint32_t free_per_window = window * (free_percent ? free_percent : 1) / 100;
+    return (uint64_t)m.scan_us * n / (free_per_window ? free_per_window : 1);
+}
+
+static uint64_t op_us(const lfstune_config_t *c, lfstune_op_t op, uint32_t size)
+{
+    const bool inlined = size <= c->cache_size && size <= INLINE_MAX;
+    const uint32_t blocks = div_up(size, BLOCK);
+    switch (op) {
+    case LFSTUNE_OP_CREATE:
+    case LFSTUNE_OP_DELETE:
+        return fetch_us(c) + commit_us(c, META_COMMIT);
+    case LFSTUNE_OP_WRITE:
+        if (inlined) {
+            return fetch_us(c) + commit_us(c, META_COMMIT + size);
+        }
+        // Data in cache sized programs, the tail padded to the program size
+        return fetch_us(c) + commit_us(c, META_COMMIT) + alloc_us(c, blocks) +
+               (uint64_t)blocks * m.erase_us +
+               (uint64_t)(size / c->cache_size) * access_us(m.prog_us, c->cache_size) +
+               (size % c->cache_size ? access_us(m.prog_us, div_up(size % c->cache_size, c->prog_size) * c->prog_size) : 0);
+    case LFSTUNE_OP_READ:
+        if (inlined) {
+            return fetch_us(c);
+        }
+        // Data through the cache, and a skip-list pointer per block
+        return fetch_us(c) + (uint64_t)div_up(size, c->cache_size) * access_us(m.read_us, c->cache_size) +
+               (uint64_t)blocks * access_us(m.read_us, c->read_size);
+    }
+    return 0;
+}
+
+// Workload cost of c: the trace, or a synthetic mix without one
+static uint64_t workload_us(const lfstune_config_t *c)
+{
+    static const trace_entry_t synthetic[] = {
+        { LFSTUNE_OP_CREATE, 0 }, { LFSTUNE_OP_WRITE, 300 }, { LFSTUNE_OP_READ, 300 },
+        { LFSTUNE_OP_CREATE, 0 }, { LFSTUNE_OP_WRITE, 2000 }, { LFSTUNE_OP_READ, 2000 },
+        { LFSTUNE_OP_CREATE, 0 }, { LFSTUNE_OP_WRITE, 100000 }, { LFSTUNE_OP_READ, 100000 },
+        { LFSTUNE_OP_READ, 300 }, { LFSTUNE_OP_READ, 2000 }, { LFSTUNE_OP_DELETE, 0 },
+    };
+    uint64_t total = 0;
+    portENTER_CRITICAL(&lock);
+    const uint32_t count = trace_count < LFSTUNE_TRACE_LEN ? trace_count : LFSTUNE_TRACE_LEN;
+    portEXIT_CRITICAL(&lock);
+    if (count == 0) {
+        for (size_t ii = 0; ii < sizeof(synthetic) / sizeof(synthetic[0]); ii++) {
+            total += op_us(c, synthetic[ii].op, synthetic[ii].size);
+        }
+        return total;
+    }
+    for (uint32_t ii = 0; ii < count; ii++) {
+        total += op_us(c, trace[ii].op, trace[ii].size);
+    }
+    return total;
+}
+
+static void evaluate(lfstune_config_t *c)
+{
+    c->block_cycles = CONFIG_LITTLEFS_BLOCK_CYCLES;
+    c->ram = c->cache_size * (2 + LFSTUNE_OPEN_FILES) + c->lookahead_size;
+    c->cost_us = workload_us(c);
+}
+
+bool lfstuneResult(lfstune_config_t *best, lfstune_config_t *current)
+{
+    if (!m.done) {
+        return false;
+    }
+    *current = (lfstune_config_t) {
+        .read_size = CONFIG_LITTLEFS_READ_SIZE,
+        .prog_size = CONFIG_LITTLEFS_WRITE_SIZE,
+        .cache_size = CONFIG_LITTLEFS_CACHE_SIZE,
+        .lookahead_size = CONFIG_LITTLEFS_LOOKAHEAD_SIZE,
+    };
+    evaluate(current);
+    *best = *current;
+
+    // Smallest sizes first, so a tie goes to the one using less RAM
+    for (uint32_t cache = 256; cache <= BLOCK; cache *= 2) {
+        for (uint32_t read = 16; read <= 256; read *= 2) {
+            for (uint32_t prog = 16; prog <= 256; prog *= 2) {
+                for (uint32_t lookahead = 16; lookahead <= 256; lookahead *= 2) {
+                    lfstune_config_t c = {
+                        .read_size = read,
+                        .prog_size = prog,
+                        .cache_size = cache,
+                        .lookahead_size = lookahead,
+                    };
+                    evaluate(&c);
+                    if (c.ram <= LFSTUNE_RAM_BUDGET && c.cost_us < best->cost_us) {
+                        *best = c;
+                    }
+                }
+            }
+        }
+    }
+    // Not worth a rebuild and a reformat for less than 2%
+    if (best->cost_us * 100 > current->cost_us * 98) {
+        *best = *current;
+    }
+    return true;
+}
+
+int lfstuneFormat(const lfstune_config_t *best, const lfstune_config_t *current, char *buf, size_t len)
+{
+    return snprintf(buf, len,
+                    "# LittleFS configuration tuned for this flash and workload\n"
+                    "# Estimated workload cost %llu us, was %llu us; RAM %lu bytes, was %lu\n"
+                    "# Changing the geometry needs the partition to be reformatted\n"
+                    "CONFIG_LITTLEFS_READ_SIZE=%u\n"
+                    "CONFIG_LITTLEFS_WRITE_SIZE=%u\n"
+                    "CONFIG_LITTLEFS_CACHE_SIZE=%u\n"
+                    "CONFIG_LITTLEFS_LOOKAHEAD_SIZE=%u\n"
+                    "CONFIG_LITTLEFS_BLOCK_CYCLES=%lu\n",
+                    (unsigned long long)best->cost_us, (unsigned long long)current->cost_us,
+                    (unsigned long)best->ram, (unsigned long)current->ram,
+                    best->read_size, best->prog_size, best->cache_size, best->lookahead_size,
+                    (unsigned long)best->block_cycles);
+}
@@ -0,0 +1,142 @@
+#include <string.h>
+#include "lzblock.h"
+
+// Bitstream, one control byte per token:
+//   000LLLLL                    literal run of L + 1 bytes follows
+//   LLLOOOOO [EEEEEEEE] OOOOOOOO back reference: length L + 2 (L == 7 adds the extra byte E),
+//                               distance O + 1, up to 8 KiB back
+#define LZ_HASH_LOG     11
+#define LZ_MAX_LITERAL  32
+#define LZ_MAX_DISTANCE 8192
+#define LZ_MAX_MATCH    (2 + 7 + 255)
+
+static uint16_t lz_hash_table[1 << LZ_HASH_LOG]; // Position + 1 of the last occurrence, 0 if none
+
+static inline uint32_t lzHash(const uint8_t *p)
+{
+    const uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+size_t lzblockCompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap)
+{
+    if (in_len == 0 || in_len > UINT16_MAX - 1 || out_cap == 0) {
+        return 0;
+    }
+    memset(lz_hash_table, 0, sizeof(lz_hash_table));
+
+    size_t ip = 0;
+    size_t op = 1; // Room for the control byte of the first literal run
+    size_t lit = 0;
+
+    while (ip < in_len) {
+        size_t match_len = 0;
+        size_t distance = 0;
+
+        if (ip + 2 < in_len) {
+            const uint32_t h = lzHash(in + ip);
+            const size_t ref = lz_hash_table[h];
+            lz_hash_table[h] = ip + 1;
+            if (ref != 0 && ip - (ref - 1) <= LZ_MAX_DISTANCE &&
+                memcmp(in + ref - 1, in + ip, 3) == 0) {
+                const size_t max_len = (in_len - ip < LZ_MAX_MATCH) ? in_len - ip : LZ_MAX_MATCH;
+                match_len = 3;
+                while (match_len < max_len && in[ref - 1 + match_len] == in[ip + match_len]) {
+                    match_len++;
+                }
+                distance = ip - (ref - 1);
+            }
+        }
+
+        if (match_len == 0) {
+            if (op >= out_cap) {
+                return 0;
+            }
+            out[op++] = in[ip++];
+            if (++lit == LZ_MAX_LITERAL) {
+                out[op - lit - 1] = lit - 1;
+                lit = 0;
+                op++;
+            }
+            continue;
+        }
+
+        // Close the pending literal run, or take back its unused control byte
+        if (lit) {
+            out[op - lit - 1] = lit - 1;
+            lit = 0;
+        } else {
+            op--;
+        }
+
+        if (op + 3 >= out_cap) {
+            return 0;
+        }
+        const size_t len_code = match_len - 2;
+        const size_t off = distance - 1;
+        if (len_code < 7) {
+            out[op++] = (off >> 8) | (len_code << 5);
+        } else {
+            out[op++] = (off >> 8) | (7 << 5);
+            out[op++] = len_code - 7;
+        }
+        out[op++] = off & 0xFF;
+        op++; // Control byte of the next literal run
+
+        // Seed the table with the last position of the match so runs keep chaining
+        ip += match_len;
+        if (ip + 2 < in_len && ip >= 1) {
+            lz_hash_table[lzHash(in + ip - 1)] = ip;
+        }
+    }
+
+    if (lit) {
+        out[op - lit - 1] = lit - 1;
+    } else {
+        op--;
+    }
+    return op;
+}
+
+size_t lzblockDecompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap)
+{
+    size_t ip = 0, op = 0;
+
+    while (ip < in_len) {
+        size_t ctrl = in[ip++];
+
+        if (ctrl < LZ_MAX_LITERAL) {
+            ctrl++;
+            if (ip + ctrl > in_len || op + ctrl > out_cap) {
+                return 0;
+            }
+            memcpy(out + op, in + ip, ctrl);
+            ip += ctrl;
+            op += ctrl;
+            continue;
+        }
+
+        size_t len = ctrl >> 5;
+        if (len == 7) {
+            if (ip >= in_len) {
+                return 0;
+            }
+            len += in[ip++];
+        }
+        if (ip >= in_len) {
+            return 0;
+        }
+        const size_t distance = (((ctrl & 0x1F) << 8) | in[ip++]) + 1;
+        len += 2;
+        if (distance > op || op + len > out_cap) {
+            return 0;
+        }
+        // Byte by byte: source and destination overlap for runs
+        const uint8_t *ref = out + op - distance;
+        for (size_t ii = 0; ii < len; ii++) {
+            out[op + ii] = ref[ii];
+        }
+        op += len;
+    }
+    return op;
+}
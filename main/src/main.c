@@ -12,6 +12,7 @@
 #include "esp_chip_info.h"
 #include "esp_flash.h"
 #include "esp_system.h"
+#include "tasks.h"
 
 int init_hardware(void);
 int init_software(void);
@@ -19,9 +20,17 @@ int init_tasks(void);
 
 void app_main(void)
 {
+    int64_t start = init_phase_begin();
     init_hardware();
+    init_phase_end("Hardware", start);
+
+    start = init_phase_begin();
     init_software();
+    init_phase_end("USB stack", start);
+
+    start = init_phase_begin();
     init_tasks();
+    init_phase_end("Tasks", start);
 }
 
 #include "monolith/usb_mtp_impl.c.h"
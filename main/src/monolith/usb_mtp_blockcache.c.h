@@ -0,0 +1,216 @@
+// Block cache for object content, in PSRAM.
+//
+// Some objects are read over and over: configuration files, small assets, whatever the host
+// looks at after every connect. Object content read through fs_read_current is kept here in
+// BLOCK_CACHE_BLOCK sized blocks, so reading them again costs a memcpy from PSRAM instead of
+// LittleFS walking its metadata and reading the flash.
+//
+// esp_littlefs doesn't let us get between LittleFS and the partition, and a cache under
+// esp_flash_read would run with the flash cache (and with it PSRAM) disabled. So blocks hold
+// object content as the host sees it, decompressed and with dedup references resolved. That also
+// means keys can't be flash addresses: a block belongs to an object path (crc32), a generation
+// (crc32 of size and mtime, so a file changed behind our back isn't served stale) and a block
+// number. Blocks of a path are dropped when the object is opened for writing, replaced, deleted or
+// reported changed by the application.
+//
+// Slots are evicted with CLOCK. The cache takes CFG_EXAMPLE_MTP_BLOCK_CACHE_PERCENT of the free
+// PSRAM at startup, at most CFG_EXAMPLE_MTP_BLOCK_CACHE_MAX bytes; without PSRAM it stays off.
+
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+
+constexpr size_t BLOCK_CACHE_BLOCK = 4096;
+
+typedef struct {
+  uint32_t path;                  // crc32 of the object path, 0 when free
+  uint32_t gen;
+  uint32_t block;
+  uint16_t len;                   // Less than a block at the end of an object
+  bool referenced;                // Used since the clock hand last passed
+} block_cache_slot_t;
+
+static struct {
+  block_cache_slot_t *slots;
+  uint8_t *data;                  // count blocks, in PSRAM
+  size_t count;
+  size_t hand;
+  size_t last;                    // Slot of the last hit, checked first
+  mtp_block_cache_stats_t stats;
+} block_cache;
+static portMUX_TYPE block_cache_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Key of the object in current_file, worked out on its first read
+static struct {
+  bool valid;
+  uint32_t path;
+  uint32_t gen;
+} block_cache_key;
+
+static void fs_block_cache_init(void)
+{
+  const size_t free_bytes = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+  const size_t budget = TU_MIN(free_bytes / 100 * CFG_EXAMPLE_MTP_BLOCK_CACHE_PERCENT,
+                               (size_t)CFG_EXAMPLE_MTP_BLOCK_CACHE_MAX);
+  const size_t count = budget / (BLOCK_CACHE_BLOCK + sizeof(block_cache_slot_t));
+  if (count == 0) {
+    ESP_LOGI("MtpBlockCache", "No PSRAM, block cache off");
+    return;
+  }
+  block_cache.slots = heap_caps_calloc(count, sizeof(block_cache_slot_t), MALLOC_CAP_SPIRAM);
+  block_cache.data = heap_caps_malloc(count * BLOCK_CACHE_BLOCK, MALLOC_CAP_SPIRAM);
+  if (block_cache.slots == nullptr || block_cache.data == nullptr) {
+    ESP_LOGE("MtpBlockCache", "Cannot allocate %u blocks", (unsigned)count);
+    heap_caps_free(block_cache.slots);
+    heap_caps_free(block_cache.data);
+    block_cache.slots = nullptr;
+    block_cache.data = nullptr;
+    return;
+  }
+  block_cache.count = count;
+  block_cache.stats.size = count * BLOCK_CACHE_BLOCK;
+  ESP_LOGI("MtpBlockCache", "%u blocks (%u KiB)", (unsigned)count, (unsigned)(block_cache.stats.size / 1024));
+}
+
+static uint32_t fs_block_cache_path_key(const char *path)
+{
+  // 0 marks free slots
+  const uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)path, strlen(path));
+  return crc != 0 ? crc : 1;
+}
+
+// current_file is closed or changes
+static void fs_block_cache_release(void)
+{
+  block_cache_key.valid = false;
+}
+
+static bool fs_block_cache_current_key(void)
+{
+  if (block_cache_key.valid) {
+    return true;
+  }
+  char path_buf[200];
+  struct stat st;
+  if (!fs_path_from_handle(&handle_table, current_handle, path_buf, sizeof(path_buf)) ||
+      fstat(fileno(current_file), &st) != 0) {
+    return false;
+  }
+  const uint32_t gen[2] = { (uint32_t)st.st_size, (uint32_t)st.st_mtime };
+  block_cache_key.path = fs_block_cache_path_key(path_buf);
+  block_cache_key.gen = esp_rom_crc32_le(0, (const uint8_t *)gen, sizeof(gen));
+  block_cache_key.valid = true;
+  return true;
+}
+
+static bool fs_block_cache_match(size_t slot, uint32_t block)
+{
+  const block_cache_slot_t *s = &block_cache.slots[slot];
+  return s->path == block_cache_key.path && s->gen == block_cache_key.gen && s->block == block;
+}
+
+static size_t fs_block_cache_find(uint32_t block)
+{
+  if (fs_block_cache_match(block_cache.last, block)) {
+    return block_cache.last;
+  }
+  for (size_t ii = 0; ii < block_cache.count; ii++) {
+    if (fs_block_cache_match(ii, block)) {
+      return ii;
+    }
+  }
+  return block_cache.count;
+}
+
+// Next slot to reuse: the first one the clock hand finds unreferenced
+static size_t fs_block_cache_victim(void)
+{
+  for (;;) {
+    block_cache_slot_t *s = &block_cache.slots[block_cache.hand];
+    const size_t slot = block_cache.hand;
+    block_cache.hand = (block_cache.hand + 1) % block_cache.count;
+    if (s->path == 0 || !s->referenced) {
+      return slot;
+    }
+    s->referenced = false;
+  }
+}
+
+static size_t fs_read_current_direct(uint32_t offset, void *buf, size_t len);
+
+// Read [offset, offset + len) of current_file through the cache. Returns the number of bytes read,
+// or 0 if the cache can't be used and the caller should read directly.
+static size_t fs_block_cache_read(uint32_t offset, void *buf, size_t len)
+{
+  if (block_cache.count == 0 || !current_reading || offset >= current_file_size ||
+      !fs_block_cache_current_key()) {
+    return 0;
+  }
+  len = TU_MIN(len, current_file_size - offset);
+  size_t done = 0, saved = 0;
+  uint32_t hits = 0, misses = 0;
+  while (done < len) {
+    const uint32_t pos = offset + done;
+    const uint32_t block = pos / BLOCK_CACHE_BLOCK;
+    const uint32_t block_start = block * BLOCK_CACHE_BLOCK;
+    size_t slot = fs_block_cache_find(block);
+    const bool hit = slot < block_cache.count;
+    if (!hit) {
+      slot = fs_block_cache_victim();
+      block_cache_slot_t *s = &block_cache.slots[slot];
+      s->path = 0;
+      const size_t want = TU_MIN(BLOCK_CACHE_BLOCK, current_file_size - block_start);
+      if (fs_read_current_direct(block_start, block_cache.data + slot * BLOCK_CACHE_BLOCK, want) != want) {
+        break;
+      }
+      s->path = block_cache_key.path;
+      s->gen = block_cache_key.gen;
+      s->block = block;
+      s->len = want;
+    }
+    block_cache_slot_t *s = &block_cache.slots[slot];
+    s->referenced = true;
+    block_cache.last = slot;
+    const size_t in_block = pos - block_start;
+    const size_t chunk = TU_MIN(len - done, (size_t)s->len - in_block);
+    memcpy((uint8_t *)buf + done, block_cache.data + slot * BLOCK_CACHE_BLOCK + in_block, chunk);
+    if (hit) {
+      hits++;
+      saved += chunk;
+    } else {
+      misses++;
+    }
+    done += chunk;
+  }
+
+  portENTER_CRITICAL(&block_cache_lock);
+  block_cache.stats.hits += hits;
+  block_cache.stats.misses += misses;
+  block_cache.stats.bytes_saved += saved;
+  portEXIT_CRITICAL(&block_cache_lock);
+  return done;
+}
+
+// The object at path changed. nullptr for all objects.
+static void fs_block_cache_invalidate(const char *path)
+{
+  const uint32_t key = path != nullptr ? fs_block_cache_path_key(path) : 0;
+  for (size_t ii = 0; ii < block_cache.count; ii++) {
+    if (path == nullptr || block_cache.slots[ii].path == key) {
+      block_cache.slots[ii].path = 0;
+    }
+  }
+}
+
+void mtpGetBlockCacheStats(mtp_block_cache_stats_t *stats) {
+  portENTER_CRITICAL(&block_cache_lock);
+  *stats = block_cache.stats;
+  portEXIT_CRITICAL(&block_cache_lock);
+}
+
+static void fs_block_cache_log_stats(void)
+{
+  mtp_block_cache_stats_t stats;
+  mtpGetBlockCacheStats(&stats);
+  ESP_LOGI("MtpBlockCache", "%lu hits, %lu misses, %llu bytes saved", (unsigned long)stats.hits,
+           (unsigned long)stats.misses, (unsigned long long)stats.bytes_saved);
+}
@@ -0,0 +1,101 @@
+// Cancellation.
+//
+// A Cancel request arrives on the control endpoint and must be answered right away, but tidying up
+// after the cancelled transaction touches flash: the upload gets checkpointed or removed, files
+// are closed, metadata saved. Each of those can take tens of milliseconds on LittleFS.
+//
+// So the cancel callback only does what is RAM-only: it stops accepting data, drops buffered
+// upload data and marks whatever was in progress as cancelled. The flash work is split into steps
+// that run afterwards, a time budget at a time, whenever the host polls GetDeviceStatus. Until the
+// last step is done the status is DeviceBusy, as the spec asks; the next command finishes any
+// remaining steps before it runs. The time from Cancel to idle is measured and logged.
+
+typedef enum {
+  CANCEL_STEP_READERS = 0,   // Downloads and thumbnails: just close the file
+  CANCEL_STEP_UPLOAD,        // Checkpoint or remove the partial upload
+  CANCEL_STEP_METADATA,      // Persist what changed
+  CANCEL_STEP_DONE,
+} cancel_step_t;
+
+static struct {
+  bool pending;
+  cancel_step_t step;
+  int64_t requested_at;       // esp_timer time of the Cancel request
+  int64_t last_us;            // Cancel-to-idle time of the last cancellation
+  int64_t max_us;             // Worst seen since boot
+} cancel_state;
+
+// Stop the transaction in progress without touching flash. Safe to call from the control request
+// callback.
+static void fs_cancel_begin(void)
+{
+  if (!cancel_state.pending) {
+    cancel_state.requested_at = esp_timer_get_time();
+  }
+  cancel_state.pending = true;
+  cancel_state.step = CANCEL_STEP_READERS;
+  fs_upload_drop_pending();
+  fs_digest_upload_abort();
+  fs_delta_cancel();
+  fs_exec_abort();
+}
+
+static void fs_cancel_step(cancel_step_t step)
+{
+  switch (step) {
+    case CANCEL_STEP_READERS:
+      fs_thumb_close(FS_INVALID_HANDLE);
+      if (current_file != nullptr && !(upload_state.active && current_handle == upload_state.handle)) {
+        fs_close_handle(current_handle, current_file);
+      }
+      break;
+
+    case CANCEL_STEP_UPLOAD:
+      // Keeps what was received of a resumable upload
+      fs_upload_interrupt();
+      fs_reserve_release(FS_INVALID_HANDLE);
+      fs_delta_discard();
+      if (current_file != nullptr) {
+        fs_close_handle(current_handle, current_file);
+      }
+      break;
+
+    case CANCEL_STEP_METADATA:
+      if (is_session_opened) {
+        objmetaSave();
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Run cleanup steps until done or budget_us is used up, 0 runs them all. Returns true when idle.
+static bool fs_cancel_run(int64_t budget_us)
+{
+  if (!cancel_state.pending) {
+    return true;
+  }
+  const int64_t start = esp_timer_get_time();
+  while (cancel_state.step < CANCEL_STEP_DONE) {
+    // Steps can't be interrupted, so at least one runs per call
+    fs_cancel_step(cancel_state.step);
+    cancel_state.step++;
+    if (budget_us > 0 && esp_timer_get_time() - start >= budget_us) {
+      break;
+    }
+  }
+  if (cancel_state.step < CANCEL_STEP_DONE) {
+    return false;
+  }
+
+  cancel_state.pending = false;
+  cancel_state.last_us = esp_timer_get_time() - cancel_state.requested_at;
+  if (cancel_state.last_us > cancel_state.max_us) {
+    cancel_state.max_us = cancel_state.last_us;
+  }
+  ESP_LOGI("MtpCancel", "Idle %lld us after cancel (max %lld us)",
+           (long long)cancel_state.last_us, (long long)cancel_state.max_us);
+  return true;
+}
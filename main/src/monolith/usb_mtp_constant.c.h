@@ -0,0 +1,86 @@
+// Pre-encoded constant responses.
+//
+// The DeviceInfo strings, the storage ID list and the FriendlyName property don't change while
+// the device runs, and some hosts ask for them over and over. They are encoded once: the storage
+// IDs at build time, the rest (the serial number comes from the MAC address) when first asked
+// for. Each response is then a single copy into the packet.
+
+// Encoded size of an ASCII string literal: count, UTF-16 units, NUL
+#define FS_CONST_STRING_LEN(s)  (1 + 2 * sizeof(s))
+#define FS_CONST_SERIAL_NCHARS  12 // MAC address in hex
+
+static const uint32_t fs_const_storage_ids[] = { 1, SUPPORTED_STORAGE_ID }; // count, IDs
+
+static struct {
+  bool ready;
+  uint16_t device_info_len;
+  uint16_t friendly_name_desc_len;
+  uint16_t friendly_name_len;
+  // What the handler adds to DeviceInfo: manufacturer, model, version, serial number
+  uint8_t device_info[FS_CONST_STRING_LEN(DEV_INFO_MANUFACTURER) + FS_CONST_STRING_LEN(DEV_INFO_MODEL) +
+                      FS_CONST_STRING_LEN(DEV_INFO_VERSION) + 1 + 2 * (FS_CONST_SERIAL_NCHARS + 1)];
+  uint8_t friendly_name_desc[sizeof(mtp_device_prop_desc_header_t) + 2 * FS_CONST_STRING_LEN(DEV_PROP_FRIENDLY_NAME) + 1];
+  uint8_t friendly_name[FS_CONST_STRING_LEN(DEV_PROP_FRIENDLY_NAME)];
+} const_resp;
+
+static uint16_t fs_const_encode(uint8_t *buf, size_t buf_len, const dataset_field_t *fields, size_t count)
+{
+  dataset_state_t state;
+  datasetEncodeBegin(&state, fields, count);
+  const size_t len = datasetEncode(&state, buf, buf_len);
+  if (!datasetDone(&state)) {
+    ESP_LOGE("MtpConst", "Constant response needs more than %d bytes", buf_len);
+  }
+  return len;
+}
+
+static void fs_const_prepare(void)
+{
+  if (const_resp.ready) {
+    return;
+  }
+
+  uint16_t serial_utf16[FS_CONST_SERIAL_NCHARS];
+  char serial[FS_CONST_SERIAL_NCHARS + 1];
+  utilGetMacAddressNoDelimiterUtf16le(serial_utf16);
+  for (size_t ii = 0; ii < FS_CONST_SERIAL_NCHARS; ii++) {
+    serial[ii] = (char)serial_utf16[ii];
+  }
+  serial[FS_CONST_SERIAL_NCHARS] = '\0';
+  const dataset_field_t device_info[] = {
+    { .type = DATASET_STRING, .data = DEV_INFO_MANUFACTURER },
+    { .type = DATASET_STRING, .data = DEV_INFO_MODEL },
+    { .type = DATASET_STRING, .data = DEV_INFO_VERSION },
+    { .type = DATASET_STRING, .data = serial },
+  };
+  const_resp.device_info_len = fs_const_encode(const_resp.device_info, sizeof(const_resp.device_info),
+                                               device_info, TU_ARRAY_SIZE(device_info));
+
+  mtp_device_prop_desc_header_t friendly_name_header = {
+    .device_property_code = MTP_DEV_PROP_DEVICE_FRIENDLY_NAME,
+    .datatype = MTP_DATA_TYPE_STR,
+    .get_set = MTP_MODE_GET,
+  };
+  const dataset_field_t friendly_name_desc[] = {
+    { .type = DATASET_RAW, .data = &friendly_name_header, .len = sizeof(friendly_name_header) },
+    { .type = DATASET_STRING, .data = DEV_PROP_FRIENDLY_NAME }, // factory
+    { .type = DATASET_STRING, .data = DEV_PROP_FRIENDLY_NAME }, // current
+    { .type = DATASET_RAW, .data = nullptr, .len = 1 },         // no form
+  };
+  const_resp.friendly_name_desc_len = fs_const_encode(const_resp.friendly_name_desc, sizeof(const_resp.friendly_name_desc),
+                                                      friendly_name_desc, TU_ARRAY_SIZE(friendly_name_desc));
+
+  const dataset_field_t friendly_name[] = {
+    { .type = DATASET_STRING, .data = DEV_PROP_FRIENDLY_NAME },
+  };
+  const_resp.friendly_name_len = fs_const_encode(const_resp.friendly_name, sizeof(const_resp.friendly_name),
+                                                 friendly_name, TU_ARRAY_SIZE(friendly_name));
+  const_resp.ready = true;
+}
+
+// Add a pre-encoded response to the container and send it
+static void fs_const_send(mtp_container_info_t *io_container, const void *data, size_t len)
+{
+  mtp_container_add_raw(io_container, data, len);
+  tud_mtp_data_send(io_container);
+}
@@ -0,0 +1,60 @@
+// Datasets that span packets.
+//
+// ObjectInfo, handle lists and the like are described as dataset_field_t arrays and go through
+// the dataset codec piece by piece: outgoing ones are encoded straight into each packet as it is
+// sent, incoming ones are decoded out of each packet as it arrives, wherever the packet boundaries
+// fall. A long file name or a folder with many objects takes more packets, not a bigger buffer.
+//
+// Only one dataset is in flight, like the transaction it belongs to. The fields, and what they
+// point to, must stay valid until the data phase is over: handlers keep them in statics.
+
+static dataset_state_t fs_dataset;
+static uint32_t fs_dataset_len;     // Receiving: length of the container, from its first packet
+
+// Send the dataset described by fields, count of them. The first packet gets what fits after the
+// container header, fs_dataset_send_more produces the rest in the data phase.
+static void fs_dataset_send(mtp_container_info_t *io_container, const dataset_field_t *fields, size_t count)
+{
+  datasetEncodeBegin(&fs_dataset, fields, count);
+  const uint32_t used = io_container->header->len;
+  datasetEncode(&fs_dataset, io_container->payload + (used - sizeof(mtp_container_header_t)),
+                CFG_TUD_MTP_EP_BUFSIZE - used);
+  // Same trick as fs_get_object: claim the whole dataset, only the first packet is filled
+  io_container->header->len += datasetEncodedLength(fields, count);
+  tud_mtp_data_send(io_container);
+}
+
+static void fs_dataset_send_more(mtp_container_info_t *io_container)
+{
+  if (datasetEncode(&fs_dataset, io_container->payload, io_container->payload_bytes) > 0) {
+    tud_mtp_data_send(io_container);
+  }
+}
+
+// Receive a dataset into fields, count of them. Each packet goes to fs_dataset_receive_more.
+static void fs_dataset_receive(mtp_container_info_t *io_container, const dataset_field_t *fields, size_t count)
+{
+  datasetDecodeBegin(&fs_dataset, fields, count);
+  fs_dataset_len = 0;
+  tud_mtp_data_receive(io_container);
+}
+
+// Take a packet of the dataset. Returns true once the container is complete; until then the next
+// packet has been asked for.
+static bool fs_dataset_receive_more(tud_mtp_cb_data_t *cb_data)
+{
+  mtp_container_info_t *io_container = &cb_data->io_container;
+  if (fs_dataset_len == 0) {
+    fs_dataset_len = io_container->header->len;
+  }
+  datasetDecode(&fs_dataset, io_container->payload, io_container->payload_bytes);
+  if (cb_data->total_xferred_bytes < fs_dataset_len) {
+    tud_mtp_data_receive(io_container);
+    return false;
+  }
+  if (fs_dataset.truncated) {
+    ESP_LOGW("MtpDataset", "Op %04X: a string didn't fit, truncated",
+             cb_data->command_container->header.code);
+  }
+  return true;
+}
@@ -0,0 +1,639 @@
+// Content deduplication of uploads.
+//
+// When an upload starts, stored objects of the same size become candidates. Incoming packets are
+// compared against the candidates; a candidate drops out at its first mismatching byte. Nothing is
+// written while a candidate is left, so a duplicate of any size programs no more than its stub:
+// if a candidate survives to the end, the upload is identical to it and the new object becomes a
+// small reference stub pointing at it.
+//
+// If the last candidate drops out, everything received up to then is identical to it and is
+// copied over from it. That may be megabytes, so the copy runs in slices of
+// CFG_EXAMPLE_MTP_EXEC_SLICE_US: the next packet isn't asked for until mtpPoll has finished it,
+// and when the last packet is in, a background job finishes it ahead of the response. An
+// interrupted upload doesn't copy at all; what it held back isn't committed and comes again on
+// resume.
+//
+// The object that was there first stays a real file where it is, so firmware reading it from
+// /littlefs sees its content; only the later copies are stubs. Which object holds the content of
+// a shared id, and how many stubs point at it, is kept in the shared index /.mtp/shared. Deleting
+// a stub counts its id down. Deleting or replacing the object holding the content first moves it
+// onto one of its stubs (a rename, no copy), which becomes the new holder. Stubs are looked for in
+// the handle table, then on the whole file system; if none turns up, the content is parked in
+// /.mtp/shared-<id> until the count drops to zero, so no stub is ever left pointing at nothing. Renames the firmware
+// reports with mtpNotifyRenamed are followed. Content the firmware changes or deletes behind MTP's
+// back is lost to its stubs too; leave deduplication off if it does that with uploaded files.
+//
+// Only uncompressed content is matched, since comparing against a compressed candidate would need
+// a decompressor per candidate. Stubs are read-only: in-place updates (ApplyDelta) are refused for
+// them, and a regular upload replaces the stub.
+
+#if CFG_EXAMPLE_MTP_DEDUP
+
+constexpr int DEDUP_MAX_CANDIDATES = 4;
+constexpr int DEDUP_MAX_SHARED = 16;
+constexpr uint32_t DEDUP_INDEX_MAGIC = 0x44524853; // "SHRD"
+constexpr uint32_t DEDUP_INDEX_VERSION = 1;
+
+static const uint8_t dedup_stub_magic[8] = { 0x89, 'M', 'T', 'P', 'R', 'E', 'F', '\n' };
+
+typedef struct TU_ATTR_PACKED {
+  uint8_t magic[8];
+  uint32_t logical_size;
+  uint32_t id;                    // Of the shared index entry
+} dedup_stub_t;
+
+typedef struct {
+  uint32_t id;                    // 0 when the slot is unused
+  uint32_t refcount;              // Stubs pointing here
+  char path[200];                 // Object holding the content
+} dedup_shared_t;
+
+static struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t next_id;
+  dedup_shared_t shared[DEDUP_MAX_SHARED];
+} dedup_index;
+
+static struct {
+  bool active;                    // Upload is being compared, or held back data written out
+  bool copying;                   // The last candidate dropped out, what it matched is written out
+  bool receive_waiting;           // The next packet is asked for once the copy is done
+  uint32_t matched_len;
+  uint32_t copy_pos;              // Of the matched data, written out so far
+  uint32_t packet_len;            // Of the packet that didn't match, written after the copy
+  int candidate_count;
+  FILE *candidates[DEDUP_MAX_CANDIDATES];
+  fs_handle_t candidate_handles[DEDUP_MAX_CANDIDATES];
+  mtp_container_info_t io_container;
+} dedup_state;
+
+static uint8_t dedup_cmp_buf[CFG_TUD_MTP_EP_BUFSIZE];
+static uint8_t dedup_packet[CFG_TUD_MTP_EP_BUFSIZE];
+
+static void fs_dedup_index_path(char *path_out, size_t buf_len, const char *suffix)
+{
+  snprintf(path_out, buf_len, "/littlefs/%s/shared%s", FS_PRIVATE_DIR, suffix);
+}
+
+static void fs_dedup_load(void)
+{
+  char path[64];
+  fs_dedup_index_path(path, sizeof(path), "");
+  FILE *f = fopen(path, "r");
+  const bool ok = f != nullptr && fread(&dedup_index, sizeof(dedup_index), 1, f) == 1 &&
+                  dedup_index.magic == DEDUP_INDEX_MAGIC && dedup_index.version == DEDUP_INDEX_VERSION;
+  if (f != nullptr) {
+    fclose(f);
+  }
+  if (!ok) {
+    memset(&dedup_index, 0, sizeof(dedup_index));
+    dedup_index.magic = DEDUP_INDEX_MAGIC;
+    dedup_index.version = DEDUP_INDEX_VERSION;
+    dedup_index.next_id = 1;
+  }
+}
+
+// The index is what ties stubs to their content, so changes go to flash right away. They only
+// happen when a duplicate is stored or a shared object goes away.
+static void fs_dedup_save(void)
+{
+  char path[64], tmp_path[64];
+  fs_dedup_index_path(path, sizeof(path), "");
+  fs_dedup_index_path(tmp_path, sizeof(tmp_path), ".tmp");
+  FILE *f = fopen(tmp_path, "w");
+  bool ok = f != nullptr && fwrite(&dedup_index, sizeof(dedup_index), 1, f) == 1;
+  if (f != nullptr) {
+    ok = fclose(f) == 0 && ok;
+  }
+  if (!ok || rename(tmp_path, path) != 0) {
+    ESP_LOGE("MtpDedup", "Failed to save the shared index");
+    unlink(tmp_path);
+  }
+}
+
+static dedup_shared_t *fs_dedup_find_id(uint32_t id)
+{
+  for (int ii = 0; id != 0 && ii < DEDUP_MAX_SHARED; ii++) {
+    if (dedup_index.shared[ii].id == id) {
+      return &dedup_index.shared[ii];
+    }
+  }
+  return nullptr;
+}
+
+static dedup_shared_t *fs_dedup_find_path(const char *path)
+{
+  for (int ii = 0; ii < DEDUP_MAX_SHARED; ii++) {
+    if (dedup_index.shared[ii].id != 0 && strcmp(dedup_index.shared[ii].path, path) == 0) {
+      return &dedup_index.shared[ii];
+    }
+  }
+  return nullptr;
+}
+
+static bool fs_dedup_read_stub(const char *path, dedup_stub_t *stub)
+{
+  struct stat st;
+  if (stat(path, &st) != 0 || st.st_size != sizeof(dedup_stub_t)) {
+    return false;
+  }
+  FILE *f = fopen(path, "r");
+  if (f == nullptr) {
+    return false;
+  }
+  bool ok = fread(stub, sizeof(*stub), 1, f) == 1 &&
+            memcmp(stub->magic, dedup_stub_magic, sizeof(dedup_stub_magic)) == 0;
+  fclose(f);
+  return ok;
+}
+
+static bool fs_dedup_resolve(const char *path, char *content_path, size_t buf_len)
+{
+  dedup_stub_t stub;
+  if (!fs_dedup_read_stub(path, &stub)) {
+    return false;
+  }
+  const dedup_shared_t *shared = fs_dedup_find_id(stub.id);
+  if (shared == nullptr) {
+    ESP_LOGE("MtpDedup", "%s refers to content that is gone", path);
+    return false;
+  }
+  strlcpy(content_path, shared->path, buf_len);
+  return true;
+}
+
+static bool fs_dedup_is_reference(const char *path, uint32_t *logical_size)
+{
+  dedup_stub_t stub;
+  if (!fs_dedup_read_stub(path, &stub)) {
+    return false;
+  }
+  if (logical_size != nullptr) {
+    *logical_size = stub.logical_size;
+  }
+  return true;
+}
+
+// Whether the content of the object at path can be shared without running out of index entries
+static bool fs_dedup_can_share(const char *path)
+{
+  dedup_stub_t stub;
+  if (fs_dedup_read_stub(path, &stub) || fs_dedup_find_path(path) != nullptr) {
+    return true;
+  }
+  for (int ii = 0; ii < DEDUP_MAX_SHARED; ii++) {
+    if (dedup_index.shared[ii].id == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void fs_dedup_drop_candidate(int index)
+{
+  fclose(dedup_state.candidates[index]);
+  dedup_state.candidate_count--;
+  dedup_state.candidates[index] = dedup_state.candidates[dedup_state.candidate_count];
+  dedup_state.candidate_handles[index] = dedup_state.candidate_handles[dedup_state.candidate_count];
+}
+
+static void fs_dedup_abort(void)
+{
+  while (dedup_state.candidate_count) {
+    fs_dedup_drop_candidate(dedup_state.candidate_count - 1);
+  }
+  dedup_state.active = false;
+  dedup_state.copying = false;
+  dedup_state.receive_waiting = false;
+}
+
+// Pick same-sized objects with plain content as candidates for the upload that's about to start
+static void fs_dedup_begin(fs_handle_t upload_handle, uint32_t size)
+{
+  fs_dedup_abort();
+  dedup_state.matched_len = 0;
+  if (size == 0) {
+    return;
+  }
+
+  for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE && dedup_state.candidate_count < DEDUP_MAX_CANDIDATES; ii++) {
+    auto entry = &handle_table.handles[ii];
+    if (entry->name[0] == '\0' || entry->is_dir || entry->handle == upload_handle) {
+      continue;
+    }
+
+    char pathbuf[200], content_path[200];
+    struct stat st;
+    if (!fs_path_from_handle(&handle_table, entry->handle, pathbuf, sizeof(pathbuf)) || !fs_dedup_can_share(pathbuf)) {
+      continue;
+    }
+    if (!fs_dedup_resolve(pathbuf, content_path, sizeof(content_path))) {
+      strlcpy(content_path, pathbuf, sizeof(content_path));
+    }
+    if (stat(content_path, &st) != 0 || st.st_size != size) {
+      continue;
+    }
+
+    FILE *f = fopen(content_path, "r");
+    if (f == nullptr) {
+      continue;
+    }
+    if (zfileProbe(f, nullptr)) {
+      fclose(f);
+      continue;
+    }
+    fseek(f, 0, SEEK_SET);
+    dedup_state.candidates[dedup_state.candidate_count] = f;
+    dedup_state.candidate_handles[dedup_state.candidate_count] = entry->handle;
+    dedup_state.candidate_count++;
+  }
+
+  dedup_state.active = dedup_state.candidate_count > 0;
+  if (dedup_state.active) {
+    MTP_ESP_LOG("MtpDedup", "%d candidates for upload of %d bytes", dedup_state.candidate_count, size);
+  }
+}
+
+// Bytes received but not written to the upload file yet
+static uint32_t fs_dedup_pending(void)
+{
+  if (!dedup_state.active) {
+    return 0;
+  }
+  return dedup_state.copying ? dedup_state.matched_len - dedup_state.copy_pos + dedup_state.packet_len
+                             : dedup_state.matched_len;
+}
+
+// Write out held back data, taken from the remaining candidate, for up to budget_us (at least a
+// piece). Returns true when nothing is left to write.
+static bool fs_dedup_run(int64_t budget_us)
+{
+  static uint8_t copy_buf[512];
+  if (!dedup_state.copying) {
+    return true;
+  }
+  const int64_t start = esp_timer_get_time();
+  FILE *source = dedup_state.candidates[0];
+  do {
+    if (dedup_state.copy_pos == dedup_state.matched_len) {
+      if (fs_write_current(dedup_packet, dedup_state.packet_len) != dedup_state.packet_len) {
+        ESP_LOGE("MtpDedup", "Failed to write held back data");
+      }
+      fs_dedup_abort();
+      return true;
+    }
+    const uint32_t chunk = TU_MIN(dedup_state.matched_len - dedup_state.copy_pos, sizeof(copy_buf));
+    if (fread(copy_buf, 1, chunk, source) != chunk) {
+      // The upload fails with it
+      ESP_LOGE("MtpDedup", "Failed to copy matched data at %d", dedup_state.copy_pos);
+      fs_writeback_failed();
+      fs_dedup_abort();
+      return true;
+    }
+    fs_write_current(copy_buf, chunk);
+    dedup_state.copy_pos += chunk;
+  } while (esp_timer_get_time() - start < budget_us);
+  return false;
+}
+
+// Start writing out what was held back, followed by the len bytes of data. The comparison is over.
+static void fs_dedup_copy_begin(const uint8_t *data, uint32_t len)
+{
+  if (len > 0) {
+    memcpy(dedup_packet, data, len);
+  }
+  dedup_state.packet_len = len;
+  dedup_state.copy_pos = 0;
+  dedup_state.copying = true;
+  fseek(dedup_state.candidates[0], 0, SEEK_SET);
+  fs_dedup_run(CFG_EXAMPLE_MTP_EXEC_SLICE_US);
+}
+
+// Held back data is being written out: the upload must wait for it
+static bool fs_dedup_busy(void)
+{
+  return dedup_state.copying;
+}
+
+// Ask for the next packet of the upload with io_container once fs_dedup_busy is over
+static void fs_dedup_wait(const mtp_container_info_t *io_container)
+{
+  dedup_state.io_container = *io_container;
+  dedup_state.receive_waiting = true;
+}
+
+// Carry on writing out held back data. Returns true when idle.
+static bool fs_dedup_poll(void)
+{
+  if (!fs_dedup_run(CFG_EXAMPLE_MTP_EXEC_SLICE_US)) {
+    return false;
+  }
+  if (dedup_state.receive_waiting) {
+    dedup_state.receive_waiting = false;
+    tud_mtp_data_receive(&dedup_state.io_container);
+  }
+  return true;
+}
+
+// Returns true when the data was taken: held back, or queued behind held back data that is being
+// written out. Returns false when the caller has to write it itself.
+static bool fs_dedup_consume(const uint8_t *data, uint32_t len)
+{
+  if (!dedup_state.active || dedup_state.copying) {
+    return false;
+  }
+
+  for (int ii = dedup_state.candidate_count - 1; ii >= 0; ii--) {
+    FILE *f = dedup_state.candidates[ii];
+    if (fread(dedup_cmp_buf, 1, len, f) == len && memcmp(dedup_cmp_buf, data, len) == 0) {
+      continue;
+    }
+    if (dedup_state.candidate_count == 1) {
+      // Last one standing: its first matched_len bytes are still what the host sent
+      MTP_ESP_LOG("MtpDedup", "No match after %d bytes, writing normally", dedup_state.matched_len);
+      fs_dedup_copy_begin(data, len);
+      return true;
+    }
+    fs_dedup_drop_candidate(ii);
+  }
+  dedup_state.matched_len += len;
+  return true;
+}
+
+// Write out everything held back right away. Only for uploads that turn out not to be storable as
+// a stub after all, which fs_dedup_begin makes rare.
+static void fs_dedup_flush(void)
+{
+  if (dedup_state.active && !dedup_state.copying) {
+    fs_dedup_copy_begin(nullptr, 0);
+  }
+  while (!fs_dedup_run(INT64_MAX)) {
+  }
+}
+
+static void fs_dedup_record_stub(const char *path, uint32_t logical_size, const uint8_t *sha256)
+{
+  objmeta_t *record = objmetaUpdate(path);
+  if (record != nullptr) {
+    record->flags |= OBJMETA_REFERENCE;
+    record->logical_size = logical_size;
+    if (sha256 != nullptr) {
+      record->flags |= OBJMETA_HAS_SHA256;
+      memcpy(record->sha256, sha256, OBJMETA_SHA256_LEN);
+    }
+  }
+}
+
+// Index entry for the content of the object at path, which may be a stub itself. Created if there
+// is none. Returns nullptr when the index is full.
+static dedup_shared_t *fs_dedup_share(const char *path)
+{
+  dedup_stub_t stub;
+  if (fs_dedup_read_stub(path, &stub)) {
+    return fs_dedup_find_id(stub.id);
+  }
+  dedup_shared_t *shared = fs_dedup_find_path(path);
+  for (int ii = 0; shared == nullptr && ii < DEDUP_MAX_SHARED; ii++) {
+    if (dedup_index.shared[ii].id == 0) {
+      shared = &dedup_index.shared[ii];
+      shared->id = dedup_index.next_id++;
+      shared->refcount = 0;
+      strlcpy(shared->path, path, sizeof(shared->path));
+    }
+  }
+  return shared;
+}
+
+// Called when the upload is complete. If a candidate matched all of it, turn the upload into a
+// stub pointing at the candidate's content and return true. Otherwise return false with all
+// content written, and the caller finishes the upload as usual.
+static bool fs_dedup_commit(const char *upload_path, uint32_t logical_size, const uint8_t *sha256)
+{
+  if (!dedup_state.active || dedup_state.copying) {
+    return false;
+  }
+
+  char candidate_path[200];
+  dedup_shared_t *shared = nullptr;
+  if (fs_path_from_handle(&handle_table, dedup_state.candidate_handles[0], candidate_path, sizeof(candidate_path))) {
+    shared = fs_dedup_share(candidate_path);
+  }
+  if (shared == nullptr) {
+    ESP_LOGW("MtpDedup", "Shared index full, storing %s as a copy", upload_path);
+    fs_dedup_flush();
+    return false;
+  }
+
+  // Held back data never went through the upload digest, the candidate's is the same
+  const objmeta_t *candidate_record = objmetaLookup(candidate_path);
+  if (sha256 == nullptr && candidate_record != nullptr && (candidate_record->flags & OBJMETA_HAS_SHA256)) {
+    sha256 = candidate_record->sha256;
+  }
+
+  // The upload file may already hold content or a compressed file header, start it over
+  dedup_stub_t stub = { .logical_size = logical_size, .id = shared->id };
+  memcpy(stub.magic, dedup_stub_magic, sizeof(dedup_stub_magic));
+  fflush(current_file);
+  ftruncate(fileno(current_file), 0);
+  fseek(current_file, 0, SEEK_SET);
+  current_compressed = false;
+  if (fwrite(&stub, sizeof(stub), 1, current_file) != 1 || fflush(current_file) != 0) {
+    // Nothing is shared yet: put the content back, all of it if it had been written
+    ESP_LOGE("MtpDedup", "Cannot write reference %s", upload_path);
+    ftruncate(fileno(current_file), 0);
+    fseek(current_file, 0, SEEK_SET);
+    fs_dedup_flush();
+    return false;
+  }
+  fs_dedup_abort();
+  fs_close_handle(current_handle, current_file);
+  fs_dedup_record_stub(upload_path, logical_size, sha256);
+  shared->refcount++;
+  fs_dedup_save();
+  MTP_ESP_LOG("MtpDedup", "%s is a duplicate of %s, stored as reference", upload_path, shared->path);
+  return true;
+}
+
+// Read the shared id of the stub at path. Returns false when path is no stub.
+static bool fs_dedup_ref_of(const char *path, uint32_t *id)
+{
+  dedup_stub_t stub;
+  if (!fs_dedup_read_stub(path, &stub)) {
+    return false;
+  }
+  *id = stub.id;
+  return true;
+}
+
+static void fs_dedup_parked_path(uint32_t id, char *path_out, size_t buf_len)
+{
+  char suffix[16];
+  snprintf(suffix, sizeof(suffix), "-%08lx", (unsigned long)id);
+  fs_dedup_index_path(path_out, buf_len, suffix);
+}
+
+// A stub pointing at id went away
+static void fs_dedup_release_ref(uint32_t id)
+{
+  dedup_shared_t *shared = fs_dedup_find_id(id);
+  if (shared == nullptr) {
+    return;
+  }
+  if (shared->refcount <= 1) {
+    char parked_path[64];
+    fs_dedup_parked_path(id, parked_path, sizeof(parked_path));
+    if (strcmp(shared->path, parked_path) == 0) {
+      // Nobody sees parked content, it goes with its last reference
+      unlink(parked_path);
+      objmetaRemove(parked_path);
+    }
+    // Otherwise the content stays where it is, as a plain object again
+    MTP_ESP_LOG("MtpDedup", "Last reference to %s gone", shared->path);
+    shared->id = 0;
+  } else {
+    shared->refcount--;
+  }
+  fs_dedup_save();
+}
+
+// Look for a stub pointing at id in the folder at dir_path and below, for objects that aren't in
+// the handle table. The path of the first one goes to path_out.
+static bool fs_dedup_find_stub(const char *dir_path, uint32_t id, char *path_out, size_t buf_len)
+{
+  DIR *dir = opendir(dir_path);
+  if (dir == nullptr) {
+    return false;
+  }
+  bool found = false;
+  struct dirent *item;
+  while (!found && (item = readdir(dir)) != nullptr) {
+    if (strcmp(item->d_name, FS_PRIVATE_DIR) == 0 && strcmp(dir_path, "/littlefs") == 0) {
+      continue;
+    }
+    snprintf(path_out, buf_len, "%s/%s", dir_path, item->d_name);
+    uint32_t stub_id;
+    if (item->d_type == DT_DIR) {
+      char sub_path[200];
+      strlcpy(sub_path, path_out, sizeof(sub_path));
+      found = fs_dedup_find_stub(sub_path, id, path_out, buf_len);
+    } else {
+      found = fs_dedup_ref_of(path_out, &stub_id) && stub_id == id;
+    }
+  }
+  closedir(dir);
+  return found;
+}
+
+// Move the content at path onto the stub at stub_path, which becomes a plain object holding it
+static bool fs_dedup_move_onto(dedup_shared_t *shared, const char *path, const char *stub_path)
+{
+  fs_block_cache_invalidate(stub_path);
+  if (rename(path, stub_path) != 0) {
+    ESP_LOGE("MtpDedup", "Cannot move %s onto %s", path, stub_path);
+    return false;
+  }
+  objmetaRemove(stub_path);
+  objmetaRename(path, stub_path);
+  MTP_ESP_LOG("MtpDedup", "Content of %s moved to %s", path, stub_path);
+  strlcpy(shared->path, stub_path, sizeof(shared->path));
+  return true;
+}
+
+// The object at path is about to be deleted or replaced. If stubs point at its content, move the
+// content onto one of them, which becomes a plain object holding it. Returns true when path was
+// moved away.
+static bool fs_dedup_hand_over(const char *path)
+{
+  dedup_shared_t *shared = fs_dedup_find_path(path);
+  if (shared == nullptr) {
+    return false;
+  }
+  char pathbuf[200];
+  uint32_t id;
+  for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE; ii++) {
+    auto entry = &handle_table.handles[ii];
+    if (entry->name[0] == '\0' || entry->is_dir ||
+        !fs_path_from_handle(&handle_table, entry->handle, pathbuf, sizeof(pathbuf)) ||
+        !fs_dedup_ref_of(pathbuf, &id) || id != shared->id) {
+      continue;
+    }
+    fs_file_cache_drop(entry->handle);
+    if (!fs_dedup_move_onto(shared, path, pathbuf)) {
+      return false;
+    }
+    fs_dedup_release_ref(shared->id);
+    return true;
+  }
+  // Stubs in folders the handle table has no room for
+  if (fs_dedup_find_stub("/littlefs", shared->id, pathbuf, sizeof(pathbuf))) {
+    if (!fs_dedup_move_onto(shared, path, pathbuf)) {
+      return false;
+    }
+    fs_dedup_release_ref(shared->id);
+    return true;
+  }
+  // None found, yet the count says there are: keep the content where nobody sees it
+  char parked_path[64];
+  fs_dedup_parked_path(shared->id, parked_path, sizeof(parked_path));
+  if (!fs_dedup_move_onto(shared, path, parked_path)) {
+    return false;
+  }
+  ESP_LOGW("MtpDedup", "No reference to %s found, %d counted; content parked", path, shared->refcount);
+  fs_dedup_save();
+  return true;
+}
+
+// The object at path is about to be deleted. Returns true when it has been moved away instead,
+// since stubs point at its content.
+static bool fs_dedup_release(const char *path)
+{
+  uint32_t id;
+  if (fs_dedup_ref_of(path, &id)) {
+    fs_dedup_release_ref(id);
+    return false;
+  }
+  return fs_dedup_hand_over(path);
+}
+
+// The firmware renamed old_path, a file or a folder, to new_path
+static void fs_dedup_renamed(const char *old_path, const char *new_path)
+{
+  const size_t old_len = strlen(old_path);
+  bool changed = false;
+  for (int ii = 0; ii < DEDUP_MAX_SHARED; ii++) {
+    auto shared = &dedup_index.shared[ii];
+    if (shared->id != 0 && strncmp(shared->path, old_path, old_len) == 0 &&
+        (shared->path[old_len] == '\0' || shared->path[old_len] == '/')) {
+      char moved[200];
+      snprintf(moved, sizeof(moved), "%s%s", new_path, shared->path + old_len);
+      strlcpy(shared->path, moved, sizeof(shared->path));
+      changed = true;
+    }
+  }
+  if (changed) {
+    fs_dedup_save();
+  }
+}
+
+#else
+
+static void fs_dedup_load(void) {}
+static bool fs_dedup_resolve(const char *path, char *content_path, size_t buf_len) { return false; }
+static bool fs_dedup_is_reference(const char *path, uint32_t *logical_size) { return false; }
+static void fs_dedup_begin(fs_handle_t upload_handle, uint32_t size) {}
+static bool fs_dedup_consume(const uint8_t *data, uint32_t len) { return false; }
+static bool fs_dedup_run(int64_t budget_us) { return true; }
+static bool fs_dedup_busy(void) { return false; }
+static void fs_dedup_wait(const mtp_container_info_t *io_container) {}
+static bool fs_dedup_poll(void) { return true; }
+static void fs_dedup_abort(void) {}
+static uint32_t fs_dedup_pending(void) { return 0; }
+static bool fs_dedup_commit(const char *upload_path, uint32_t logical_size, const uint8_t *sha256) { return false; }
+static bool fs_dedup_ref_of(const char *path, uint32_t *id) { return false; }
+static void fs_dedup_release_ref(uint32_t id) {}
+static bool fs_dedup_hand_over(const char *path) { return false; }
+static bool fs_dedup_release(const char *path) { return false; }
+static void fs_dedup_renamed(const char *old_path, const char *new_path) {}
+
+#endif
@@ -0,0 +1,564 @@
+// Block-delta (rsync style) synchronization for large files that are mostly unchanged.
+//
+// The host first asks for the per-block checksums of the device copy, runs the usual rolling
+// checksum search over its own version, then sends back a stream of COPY and LITERAL instructions.
+// The device builds the new version from that stream in the object's shadow (see
+// usb_mtp_shadow.c.h) and swaps it in only once the stream is complete and consistent, so only
+// changed bytes cross the bus, and a rejected instruction, a short stream or a Cancel leave the
+// object as it was. The old version stays intact until the swap, so COPY may take blocks from
+// anywhere in it, in any order.
+//
+// Only bus traffic is saved, not flash writes: the shadow is a complete new file, so copied blocks
+// are programmed again like literal ones. Patching the object in place would save those writes,
+// but a power cut halfway through would then leave a mix of both versions.
+//
+// Hashing blocks and copying runs of them can take far longer than a USB callback should. Both are
+// done in slices of CFG_EXAMPLE_MTP_EXEC_SLICE_US: when a slice runs out, the packet waits (the
+// next checksum packet isn't sent, the next part of the delta stream isn't asked for) and mtpPoll
+// carries on with it. Copying still left when the stream is complete runs as a background job
+// ahead of the response.
+
+#include "esp_rom_md5.h"
+#include "esp_timer.h"
+
+constexpr uint32_t DELTA_MIN_BLOCK_SIZE = 512;
+constexpr uint32_t DELTA_MAX_BLOCK_SIZE = 64 * 1024;
+constexpr uint32_t DELTA_DEFAULT_BLOCK_SIZE = 4096;
+
+typedef struct TU_ATTR_PACKED {
+  uint32_t block_size;
+  uint32_t block_count;
+  uint32_t file_size;
+} delta_checksum_header_t;
+
+typedef struct TU_ATTR_PACKED {
+  uint32_t rolling;
+  uint8_t strong[ESP_ROM_MD5_DIGEST_LEN];
+} delta_checksum_entry_t;
+
+typedef enum {
+  DELTA_PARSE_OPCODE,
+  DELTA_PARSE_ARGS,
+  DELTA_PARSE_LITERAL,
+} delta_parse_state_t;
+
+static struct {
+  // Shared
+  uint32_t block_size;
+  mtp_container_info_t io_container;  // Of the packet waiting for mtpPoll
+
+  // GetBlockChecksums
+  fs_handle_t checksum_handle;
+  uint32_t total_len;
+  uint32_t cached_index;          // Index of the entry in cached_entry, UINT32_MAX if none
+  delta_checksum_entry_t cached_entry;
+  uint32_t hash_index;            // Block being hashed, UINT32_MAX if none
+  uint32_t hash_done;             // Bytes of it hashed so far
+  uint32_t s1, s2;
+  md5_context_t md5;
+  uint8_t *fill_dst;              // The packet being filled: where
+  uint32_t fill_offset;           // Offset into the dataset
+  uint32_t fill_len;
+  uint32_t fill_done;
+  bool fill_first;                // First packet, the container length isn't set yet
+  bool checksum_waiting;          // The packet is finished and sent by mtpPoll
+  bool checksum_failed;           // A block couldn't be read, the list ends early
+
+  // ApplyDelta
+  FILE *out;                      // The new version, in the shadow of the object
+  char shadow_path[64];           // Of out
+  uint32_t old_size;
+  uint32_t new_size;
+  uint32_t delta_len;
+  uint32_t write_pos;
+  delta_parse_state_t state;
+  uint8_t opcode;
+  uint8_t args[8];
+  uint32_t args_len;
+  uint32_t literal_left;
+  uint32_t copy_src;              // COPY being carried out
+  uint32_t copy_left;
+  const uint8_t *input;           // Delta stream received and not parsed yet
+  uint32_t input_len;
+  bool apply_waiting;             // The next packet is asked for once the input is applied
+  int32_t resp_code;              // Final response, MTP_RESP_OK unless the stream was rejected
+  fs_handle_t applying;           // Object being rebuilt, FS_INVALID_HANDLE when idle
+} delta_state = { .checksum_handle = FS_INVALID_HANDLE, .applying = FS_INVALID_HANDLE };
+
+static uint8_t delta_io_buf[512];
+static uint8_t delta_input_buf[CFG_TUD_MTP_EP_BUFSIZE]; // Rest of a packet that has to wait
+
+// Hash the next piece of block index. Returns true once its entry is in cached_entry. A read that
+// comes up short sets checksum_failed: checksums of part of a block would send the host's delta
+// search astray.
+//
+// The rolling checksum is the one rsync uses: s1 is the byte sum, s2 the sum of all running s1
+// values, both modulo 2^16. The host rolls the same function over its copy a byte at a time.
+// Checksums are over object content, so compressed objects are hashed after decompression.
+static bool delta_hash_step(uint32_t index)
+{
+  const uint32_t block_offset = index * delta_state.block_size;
+  const uint32_t block_len = TU_MIN(delta_state.block_size, current_file_size - block_offset);
+  if (delta_state.hash_index != index) {
+    delta_state.hash_index = index;
+    delta_state.hash_done = 0;
+    delta_state.s1 = 0;
+    delta_state.s2 = 0;
+    esp_rom_md5_init(&delta_state.md5);
+  }
+
+  const uint32_t want = TU_MIN(block_len - delta_state.hash_done, sizeof(delta_io_buf));
+  const size_t chunk = want > 0 ? fs_read_current(block_offset + delta_state.hash_done, delta_io_buf, want) : 0;
+  for (size_t ii = 0; ii < chunk; ii++) {
+    delta_state.s1 += delta_io_buf[ii];
+    delta_state.s2 += delta_state.s1;
+  }
+  esp_rom_md5_update(&delta_state.md5, delta_io_buf, chunk);
+  delta_state.hash_done += chunk;
+  if (delta_state.hash_done < block_len) {
+    if (chunk == 0) {
+      ESP_LOGE("MtpDelta", "Reading block %d failed at %d of %d bytes", index, delta_state.hash_done, block_len);
+      delta_state.checksum_failed = true;
+    }
+    return false;
+  }
+
+  esp_rom_md5_final(delta_state.cached_entry.strong, &delta_state.md5);
+  delta_state.cached_entry.rolling = (delta_state.s1 & 0xFFFF) | (delta_state.s2 << 16);
+  delta_state.cached_index = index;
+  delta_state.hash_index = UINT32_MAX;
+  return true;
+}
+
+// Fill the packet being prepared, hashing for up to budget_us. Returns true when it is complete.
+// Entries are generated on demand so arbitrarily large files never need more than one block worth
+// of state.
+static bool delta_checksum_fill(int64_t budget_us)
+{
+  const int64_t start = esp_timer_get_time();
+  const delta_checksum_header_t header = {
+    .block_size = delta_state.block_size,
+    .block_count = (delta_state.total_len - sizeof(delta_checksum_header_t)) / sizeof(delta_checksum_entry_t),
+    .file_size = current_file_size,
+  };
+
+  while (delta_state.fill_done < delta_state.fill_len) {
+    const uint32_t offset = delta_state.fill_offset + delta_state.fill_done;
+    const uint32_t len = delta_state.fill_len - delta_state.fill_done;
+    uint8_t *dst = delta_state.fill_dst + delta_state.fill_done;
+    uint32_t copied;
+    if (offset < sizeof(header)) {
+      copied = TU_MIN(len, sizeof(header) - offset);
+      memcpy(dst, (const uint8_t *)&header + offset, copied);
+    } else {
+      const uint32_t entry_offset = offset - sizeof(header);
+      const uint32_t index = entry_offset / sizeof(delta_checksum_entry_t);
+      const uint32_t within = entry_offset % sizeof(delta_checksum_entry_t);
+      while (delta_state.cached_index != index) {
+        if (!delta_hash_step(index) && (delta_state.checksum_failed || esp_timer_get_time() - start >= budget_us)) {
+          return false;
+        }
+      }
+      copied = TU_MIN(len, sizeof(delta_checksum_entry_t) - within);
+      memcpy(dst, (const uint8_t *)&delta_state.cached_entry + within, copied);
+    }
+    delta_state.fill_done += copied;
+  }
+  return true;
+}
+
+// Finish and send the packet set up in delta_state. Returns false when it has to wait for mtpPoll.
+// When a block can't be read the transaction ends with IncompleteTransfer instead.
+static bool delta_checksum_send(int64_t budget_us)
+{
+  mtp_container_info_t *io_container = &delta_state.io_container;
+  delta_state.checksum_waiting = !delta_checksum_fill(budget_us);
+  if (delta_state.checksum_failed) {
+    delta_state.checksum_waiting = false;
+    fs_close_handle(delta_state.checksum_handle, current_file);
+    delta_state.checksum_handle = FS_INVALID_HANDLE;
+    io_container->header->code = MTP_RESP_INCOMPLETE_TRANSFER;
+    tud_mtp_response_send(io_container);
+    return true;
+  }
+  if (delta_state.checksum_waiting) {
+    return false;
+  }
+  if (delta_state.fill_first) {
+    // Same trick as fs_get_object: claim the whole dataset length, only the first packet is filled
+    io_container->header->len += delta_state.total_len;
+  }
+  tud_mtp_data_send(io_container);
+  if (delta_state.fill_offset + delta_state.fill_len >= delta_state.total_len) {
+    fs_close_handle(delta_state.checksum_handle, current_file);
+    delta_state.checksum_handle = FS_INVALID_HANDLE;
+    MTP_ESP_LOG("MtpDelta", "Checksum list completed, closing");
+  }
+  return true;
+}
+
+static uint32_t delta_block_size_param(uint32_t param)
+{
+  if (param == 0) {
+    return DELTA_DEFAULT_BLOCK_SIZE;
+  }
+  if (param < DELTA_MIN_BLOCK_SIZE || param > DELTA_MAX_BLOCK_SIZE) {
+    return 0;
+  }
+  return param;
+}
+
+static int32_t fs_get_block_checksums(tud_mtp_cb_data_t* cb_data) {
+  const mtp_container_command_t* command = cb_data->command_container;
+  mtp_container_info_t* io_container = &cb_data->io_container;
+  const uint32_t obj_handle = command->params[0];
+
+  if (!is_session_opened) {
+    return MTP_RESP_SESSION_NOT_OPEN;
+  }
+
+  if (cb_data->phase == MTP_PHASE_COMMAND) {
+    const uint32_t block_size = delta_block_size_param(command->params[1]);
+    if (block_size == 0) {
+      return MTP_RESP_INVALID_PARAMETER;
+    }
+    FILE *f = fs_open_handle(&handle_table, obj_handle, "r");
+    if (f == nullptr) {
+      ESP_LOGE("MtpDelta", "%s: trying to open invalid handle %d", __func__, obj_handle);
+      return MTP_RESP_INVALID_OBJECT_HANDLE;
+    }
+
+    const uint32_t block_count = (current_file_size + block_size - 1) / block_size;
+    delta_state.checksum_handle = obj_handle;
+    delta_state.block_size = block_size;
+    delta_state.total_len = sizeof(delta_checksum_header_t) + block_count * sizeof(delta_checksum_entry_t);
+    delta_state.cached_index = UINT32_MAX;
+    delta_state.hash_index = UINT32_MAX;
+    delta_state.checksum_failed = false;
+    MTP_ESP_LOG("MtpDelta", "%s: %d blocks of %d", __func__, block_count, block_size);
+
+    // The first packet goes right after the container header
+    const uint32_t used = io_container->header->len;
+    delta_state.io_container = *io_container;
+    delta_state.fill_dst = io_container->payload + (used - sizeof(mtp_container_header_t));
+    delta_state.fill_offset = 0;
+    delta_state.fill_len = TU_MIN(delta_state.total_len, CFG_TUD_MTP_EP_BUFSIZE - used);
+    delta_state.fill_done = 0;
+    delta_state.fill_first = true;
+    delta_checksum_send(CFG_EXAMPLE_MTP_EXEC_SLICE_US);
+  } else if (cb_data->phase == MTP_PHASE_DATA) {
+    const uint32_t offset = cb_data->total_xferred_bytes - sizeof(mtp_container_header_t);
+    const uint32_t xact_len = tu_min32(delta_state.total_len - offset, io_container->payload_bytes);
+    if (xact_len > 0 && delta_state.checksum_handle != FS_INVALID_HANDLE) {
+      delta_state.io_container = *io_container;
+      delta_state.fill_dst = io_container->payload;
+      delta_state.fill_offset = offset;
+      delta_state.fill_len = xact_len;
+      delta_state.fill_done = 0;
+      delta_state.fill_first = false;
+      delta_checksum_send(CFG_EXAMPLE_MTP_EXEC_SLICE_US);
+    }
+  }
+
+  return 0;
+}
+
+// Start a COPY of block_count blocks of the old version from src_block on
+static bool delta_queue_copy(uint32_t src_block, uint32_t block_count)
+{
+  const uint64_t src = (uint64_t)src_block * delta_state.block_size;
+  uint64_t len = (uint64_t)block_count * delta_state.block_size;
+  if (src >= delta_state.old_size) {
+    ESP_LOGE("MtpDelta", "COPY source block %d out of range", src_block);
+    return false;
+  }
+  // The last block of the old file may be short
+  len = TU_MIN(len, delta_state.old_size - src);
+  if (delta_state.write_pos + len > delta_state.new_size) {
+    ESP_LOGE("MtpDelta", "Delta output exceeds declared size %d", delta_state.new_size);
+    return false;
+  }
+  delta_state.copy_src = src;
+  delta_state.copy_left = len;
+  return true;
+}
+
+// Copy the next piece of the COPY under way from the old version to the new one
+static bool delta_copy_step(void)
+{
+  const uint32_t chunk = TU_MIN(delta_state.copy_left, sizeof(delta_io_buf));
+  if (fs_read_current(delta_state.copy_src, delta_io_buf, chunk) != chunk ||
+      fwrite(delta_io_buf, 1, chunk, delta_state.out) != chunk) {
+    ESP_LOGE("MtpDelta", "COPY from %d failed", delta_state.copy_src);
+    return false;
+  }
+  delta_state.copy_src += chunk;
+  delta_state.copy_left -= chunk;
+  delta_state.write_pos += chunk;
+  return true;
+}
+
+// Parse the received delta stream, up to the next COPY
+static bool delta_parse(void)
+{
+  while (delta_state.input_len > 0 && delta_state.copy_left == 0) {
+    const uint8_t *data = delta_state.input;
+    uint32_t used;
+    switch (delta_state.state) {
+      case DELTA_PARSE_OPCODE:
+        delta_state.opcode = *data;
+        used = 1;
+        if (delta_state.opcode != MTP_DELTA_INSN_COPY && delta_state.opcode != MTP_DELTA_INSN_LITERAL) {
+          ESP_LOGE("MtpDelta", "Unknown delta instruction %02X", delta_state.opcode);
+          return false;
+        }
+        delta_state.args_len = 0;
+        delta_state.state = DELTA_PARSE_ARGS;
+        break;
+
+      case DELTA_PARSE_ARGS: {
+        const uint32_t args_needed = (delta_state.opcode == MTP_DELTA_INSN_COPY) ? 8 : 4;
+        used = TU_MIN(delta_state.input_len, args_needed - delta_state.args_len);
+        memcpy(delta_state.args + delta_state.args_len, data, used);
+        delta_state.args_len += used;
+        if (delta_state.args_len < args_needed) {
+          break;
+        }
+
+        uint32_t arg0, arg1;
+        memcpy(&arg0, delta_state.args, sizeof(arg0));
+        memcpy(&arg1, delta_state.args + 4, sizeof(arg1));
+        if (delta_state.opcode == MTP_DELTA_INSN_COPY) {
+          if (!delta_queue_copy(arg0, arg1)) {
+            return false;
+          }
+          delta_state.state = DELTA_PARSE_OPCODE;
+        } else {
+          if ((uint64_t)delta_state.write_pos + arg0 > delta_state.new_size) {
+            ESP_LOGE("MtpDelta", "Delta output exceeds declared size %d", delta_state.new_size);
+            return false;
+          }
+          delta_state.literal_left = arg0;
+          delta_state.state = arg0 ? DELTA_PARSE_LITERAL : DELTA_PARSE_OPCODE;
+        }
+        break;
+      }
+
+      case DELTA_PARSE_LITERAL:
+        used = TU_MIN(delta_state.input_len, delta_state.literal_left);
+        if (fwrite(data, 1, used, delta_state.out) != used) {
+          return false;
+        }
+        delta_state.write_pos += used;
+        delta_state.literal_left -= used;
+        if (delta_state.literal_left == 0) {
+          delta_state.state = DELTA_PARSE_OPCODE;
+        }
+        break;
+
+      default:
+        return false;
+    }
+    delta_state.input += used;
+    delta_state.input_len -= used;
+  }
+  return true;
+}
+
+// Apply the delta stream received so far, for up to budget_us. Returns true once all of it is
+// applied or the stream was rejected.
+static bool delta_apply_run(int64_t budget_us)
+{
+  const int64_t start = esp_timer_get_time();
+  while (delta_state.resp_code == MTP_RESP_OK && (delta_state.copy_left > 0 || delta_state.input_len > 0)) {
+    if (delta_state.copy_left > 0 ? !delta_copy_step() : !delta_parse()) {
+      delta_state.resp_code = delta_state.copy_left > 0 ? MTP_RESP_GENERAL_ERROR : MTP_RESP_INVALID_PARAMETER;
+      break;
+    }
+    if (esp_timer_get_time() - start >= budget_us) {
+      return delta_state.copy_left == 0 && delta_state.input_len == 0;
+    }
+  }
+  // After a rejected instruction the rest of the stream is drained and dropped
+  delta_state.copy_left = 0;
+  delta_state.input_len = 0;
+  return true;
+}
+
+static int32_t fs_apply_delta(tud_mtp_cb_data_t* cb_data) {
+  const mtp_container_command_t* command = cb_data->command_container;
+  mtp_container_info_t* io_container = &cb_data->io_container;
+  const uint32_t obj_handle = command->params[0];
+
+  if (!is_session_opened) {
+    return MTP_RESP_SESSION_NOT_OPEN;
+  }
+
+  if (cb_data->phase == MTP_PHASE_COMMAND) {
+    const uint32_t block_size = delta_block_size_param(command->params[1]);
+    if (block_size == 0) {
+      return MTP_RESP_INVALID_PARAMETER;
+    }
+    char pathbuf[200];
+    if (!fs_path_from_handle(&handle_table, obj_handle, pathbuf, sizeof(pathbuf))) {
+      return MTP_RESP_INVALID_OBJECT_HANDLE;
+    }
+    if (fs_dedup_is_reference(pathbuf, nullptr) || fs_resume_find(pathbuf) >= 0) {
+      // Shared content can't change under the other references, and a partial upload owns the
+      // shadow
+      return MTP_RESP_OPERATION_NOT_SUPPORTED;
+    }
+    FILE *f = fs_open_handle(&handle_table, obj_handle, "r");
+    if (f == nullptr) {
+      ESP_LOGE("MtpDelta", "%s: trying to open invalid handle %d", __func__, obj_handle);
+      return MTP_RESP_INVALID_OBJECT_HANDLE;
+    }
+    if (current_compressed) {
+      // Frames shift around when content changes, the host falls back to a regular upload
+      fs_close_handle(obj_handle, current_file);
+      return MTP_RESP_OPERATION_NOT_SUPPORTED;
+    }
+    // Both versions are on flash until the swap. The object keeps its handle, no new one is needed.
+    if (!fs_has_space(command->params[2])) {
+      fs_close_handle(obj_handle, current_file);
+      return MTP_RESP_STORE_FULL;
+    }
+    fs_shadow_path(pathbuf, delta_state.shadow_path, sizeof(delta_state.shadow_path));
+    delta_state.out = fs_shadow_create(pathbuf);
+    if (delta_state.out == nullptr) {
+      fs_close_handle(obj_handle, current_file);
+      return MTP_RESP_GENERAL_ERROR;
+    }
+
+    delta_state.block_size = block_size;
+    delta_state.old_size = current_file_size;
+    delta_state.new_size = command->params[2];
+    delta_state.delta_len = command->params[3];
+    delta_state.write_pos = 0;
+    delta_state.state = DELTA_PARSE_OPCODE;
+    delta_state.copy_left = 0;
+    delta_state.input_len = 0;
+    delta_state.apply_waiting = false;
+    delta_state.resp_code = MTP_RESP_OK;
+    delta_state.applying = obj_handle;
+    MTP_ESP_LOG("MtpDelta", "%s: handle %d, %d -> %d bytes, %d bytes of delta",
+                __func__, obj_handle, delta_state.old_size, delta_state.new_size, delta_state.delta_len);
+
+    io_container->header->len += delta_state.delta_len;
+    tud_mtp_data_receive(io_container);
+  } else if (cb_data->phase == MTP_PHASE_DATA) {
+    const uint32_t received = cb_data->total_xferred_bytes - sizeof(mtp_container_header_t);
+    delta_state.input = io_container->payload;
+    delta_state.input_len = io_container->payload_bytes;
+    if (!delta_apply_run(CFG_EXAMPLE_MTP_EXEC_SLICE_US)) {
+      // The packet buffer goes back to the USB stack, keep what's left of it
+      memcpy(delta_input_buf, delta_state.input, delta_state.input_len);
+      delta_state.input = delta_input_buf;
+      delta_state.io_container = *io_container;
+      delta_state.apply_waiting = received < delta_state.delta_len;
+      return 0;
+    }
+    if (received < delta_state.delta_len) {
+      tud_mtp_data_receive(io_container);
+    }
+  }
+
+  return 0;
+}
+
+// Work is left over from the last packet of the stream
+static bool fs_delta_busy(void)
+{
+  return delta_state.resp_code == MTP_RESP_OK && (delta_state.copy_left > 0 || delta_state.input_len > 0);
+}
+
+// The delta stream is over: swap the new version in, or drop it. Returns the response code.
+static int32_t fs_delta_finish(void)
+{
+  const fs_handle_t handle = delta_state.applying;
+  if (handle == FS_INVALID_HANDLE) {
+    return delta_state.resp_code;
+  }
+  if (delta_state.resp_code == MTP_RESP_OK &&
+      (delta_state.state != DELTA_PARSE_OPCODE || delta_state.write_pos != delta_state.new_size)) {
+    ESP_LOGE("MtpDelta", "Delta stream ended at %d, expected %d", delta_state.write_pos, delta_state.new_size);
+    delta_state.resp_code = MTP_RESP_INCOMPLETE_TRANSFER;
+  }
+
+  char pathbuf[200];
+  if (!fs_path_from_handle(&handle_table, handle, pathbuf, sizeof(pathbuf))) {
+    // The object went away meanwhile, e.g. the application removed it
+    ESP_LOGE("MtpDelta", "Object %d is gone, dropping its new version", handle);
+    delta_state.resp_code = MTP_RESP_INVALID_OBJECT_HANDLE;
+  }
+  if (current_file != nullptr) {
+    fs_close_handle(handle, current_file);
+  }
+  const bool written = filepoolClose(delta_state.out) == 0;
+  delta_state.out = nullptr;
+  delta_state.applying = FS_INVALID_HANDLE;
+  if (delta_state.resp_code == MTP_RESP_OK) {
+    // Whatever was known about the old content goes with it
+    delta_state.resp_code = written && fs_shadow_commit(handle, delta_state.shadow_path, pathbuf) ? MTP_RESP_OK : MTP_RESP_GENERAL_ERROR;
+  } else {
+    unlink(delta_state.shadow_path);
+  }
+  MTP_ESP_LOG("MtpDelta", "%s: delta applied, resp %04X", __func__, delta_state.resp_code);
+  return delta_state.resp_code;
+}
+
+static int32_t fs_delta_finish_step(void)
+{
+  return delta_apply_run(0) ? fs_delta_finish() : 0;
+}
+
+// The data phase of ApplyDelta completed. Returns the response code, or 0 when a job was started to
+// finish the work and respond.
+static int32_t fs_delta_complete(tud_mtp_cb_data_t* cb_data)
+{
+  if (cb_data->xfer_result != XFER_RESULT_SUCCESS) {
+    delta_state.resp_code = MTP_RESP_GENERAL_ERROR;
+  }
+  if (fs_delta_busy()) {
+    return fs_exec_start(cb_data, "ApplyDelta", fs_delta_finish_step);
+  }
+  return fs_delta_finish();
+}
+
+// Carry on with a packet that ran out of time in its callback. Returns true when idle.
+static bool fs_delta_poll(void)
+{
+  if (delta_state.checksum_waiting) {
+    return delta_checksum_send(CFG_EXAMPLE_MTP_EXEC_SLICE_US);
+  }
+  if (delta_state.apply_waiting) {
+    if (!delta_apply_run(CFG_EXAMPLE_MTP_EXEC_SLICE_US)) {
+      return false;
+    }
+    delta_state.apply_waiting = false;
+    tud_mtp_data_receive(&delta_state.io_container);
+  }
+  return true;
+}
+
+// The transaction got cancelled: stop without touching flash. The new version is dropped by
+// fs_delta_discard, the object stays as it was.
+static void fs_delta_cancel(void)
+{
+  delta_state.checksum_waiting = false;
+  delta_state.checksum_handle = FS_INVALID_HANDLE;
+  delta_state.apply_waiting = false;
+  delta_state.copy_left = 0;
+  delta_state.input_len = 0;
+  if (delta_state.applying != FS_INVALID_HANDLE) {
+    delta_state.resp_code = MTP_RESP_TRANSACTION_CANCELLED;
+  }
+}
+
+static void fs_delta_discard(void)
+{
+  if (delta_state.applying != FS_INVALID_HANDLE) {
+    ESP_LOGW("MtpDelta", "Delta cancelled, object unchanged");
+    fs_delta_finish();
+  }
+}
@@ -0,0 +1,146 @@
+// Content digests for stored objects.
+//
+// Uploads are hashed as they are written: by the writer task (TaskMtpWriter) after it programs a
+// chunk of the write-back ring, or right where the data is written when there is no writer. The
+// hashing overlaps the flash writes and the next packets instead of holding up the data phase
+// callback, and the digest is ready the moment the file is closed, at no extra flash reads. Data
+// deduplication absorbed never reaches the file; such uploads take the digest of the object they
+// match. The result lands in the object metadata store, where GetObjectDigest picks it up; hosts
+// compare it with their own copy instead of downloading the object again. Objects that arrived
+// some other way are hashed on first request, in a background job. Writing an object drops its record, so a digest is
+// never served for content it wasn't computed from.
+//
+// SHA-256 goes through mbedTLS, which uses the ESP32-S3 SHA accelerator when
+// CONFIG_MBEDTLS_HARDWARE_SHA is enabled.
+
+#include "mbedtls/sha256.h"
+#include "objmeta.h"
+
+constexpr uint32_t DIGEST_ALGO_SHA256 = 1;
+
+typedef struct TU_ATTR_PACKED {
+  uint32_t algorithm;
+  uint8_t digest[OBJMETA_SHA256_LEN];
+} digest_dataset_t;
+
+// Updated by the writer task while an upload is buffered; begin and take only run once the writer
+// has drained, abort may run any time (Cancel) and only clears the flag
+static mbedtls_sha256_context upload_sha;
+static atomic_bool upload_sha_active;
+static uint32_t upload_sha_len;
+
+// Called when no upload data is buffered
+static void fs_digest_upload_begin(void)
+{
+  mbedtls_sha256_free(&upload_sha);
+  mbedtls_sha256_init(&upload_sha);
+  mbedtls_sha256_starts(&upload_sha, 0);
+  upload_sha_len = 0;
+  atomic_store(&upload_sha_active, true);
+}
+
+// Upload data went into the file, in order
+static void fs_digest_upload_update(const uint8_t *data, uint32_t len)
+{
+  if (atomic_load(&upload_sha_active)) {
+    mbedtls_sha256_update(&upload_sha, data, len);
+    upload_sha_len += len;
+  }
+}
+
+// Drop the running digest, e.g. when the upload got cancelled
+static void fs_digest_upload_abort(void)
+{
+  atomic_store(&upload_sha_active, false);
+}
+
+// Finish the running digest of the upload that just completed, size bytes long. Returns false when
+// there is none, or when not all of the content went through it.
+static bool fs_digest_upload_take(uint32_t size, uint8_t digest[OBJMETA_SHA256_LEN])
+{
+  if (!atomic_load(&upload_sha_active)) {
+    return false;
+  }
+  fs_digest_upload_abort();
+  if (upload_sha_len != size) {
+    return false;
+  }
+  mbedtls_sha256_finish(&upload_sha, digest);
+  return true;
+}
+
+// Hashing an object that has no digest on record yet. It may be megabytes, so it runs as a
+// background job, a piece per step, and the dataset is sent when it is done.
+static struct {
+  fs_handle_t handle;
+  char path[200];
+  mbedtls_sha256_context sha;
+  uint32_t offset;                // Hashed so far
+} digest_job;
+
+static int32_t fs_digest_compute_step(void)
+{
+  static uint8_t read_buf[1024];
+  if (fs_open_handle(&handle_table, digest_job.handle, "r") == nullptr) {
+    return MTP_RESP_INVALID_OBJECT_HANDLE;
+  }
+  const size_t bytes_read = fs_read_current(digest_job.offset, read_buf, sizeof(read_buf));
+  if (bytes_read > 0) {
+    mbedtls_sha256_update(&digest_job.sha, read_buf, bytes_read);
+    digest_job.offset += bytes_read;
+    return 0;
+  }
+  const bool complete = digest_job.offset == current_file_size;
+  fs_close_handle(digest_job.handle, current_file);
+  if (!complete) {
+    // A digest of part of the object must not be recorded as that of the object
+    ESP_LOGE("MtpDigest", "Reading %s failed at %d of %d bytes", digest_job.path, digest_job.offset, current_file_size);
+    return MTP_RESP_GENERAL_ERROR;
+  }
+
+  digest_dataset_t dataset = { .algorithm = DIGEST_ALGO_SHA256 };
+  mbedtls_sha256_finish(&digest_job.sha, dataset.digest);
+  objmeta_t *record = fs_object_record(digest_job.path);
+  if (record != nullptr) {
+    memcpy(record->sha256, dataset.digest, OBJMETA_SHA256_LEN);
+    record->flags |= OBJMETA_HAS_SHA256;
+  }
+  return fs_exec_send(&dataset, sizeof(dataset));
+}
+
+static int32_t fs_get_object_digest(tud_mtp_cb_data_t* cb_data) {
+  const mtp_container_command_t* command = cb_data->command_container;
+  mtp_container_info_t* io_container = &cb_data->io_container;
+  const uint32_t obj_handle = command->params[0];
+
+  if (!is_session_opened) {
+    return MTP_RESP_SESSION_NOT_OPEN;
+  }
+
+  char pathbuf[200];
+  if (!fs_path_from_handle(&handle_table, obj_handle, pathbuf, sizeof(pathbuf))) {
+    return MTP_RESP_INVALID_OBJECT_HANDLE;
+  }
+  auto entry = fs_get_handle_entry(&handle_table, obj_handle);
+  if (entry->is_dir) {
+    return MTP_RESP_INVALID_OBJECT_HANDLE;
+  }
+
+  objmeta_t *record = objmetaLookup(pathbuf);
+  if (record == nullptr || !(record->flags & OBJMETA_HAS_SHA256)) {
+    MTP_ESP_LOG("MtpDigest", "No digest on record for %s, computing", pathbuf);
+    digest_job.handle = obj_handle;
+    strlcpy(digest_job.path, pathbuf, sizeof(digest_job.path));
+    digest_job.offset = 0;
+    mbedtls_sha256_free(&digest_job.sha);
+    mbedtls_sha256_init(&digest_job.sha);
+    mbedtls_sha256_starts(&digest_job.sha, 0);
+    return fs_exec_start(cb_data, "GetObjectDigest", fs_digest_compute_step);
+  }
+
+  digest_dataset_t dataset = { .algorithm = DIGEST_ALGO_SHA256 };
+  memcpy(dataset.digest, record->sha256, sizeof(dataset.digest));
+  mtp_container_add_raw(io_container, &dataset, sizeof(dataset));
+  tud_mtp_data_send(io_container);
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Background operations.
+//
+// Operations that may run for a long time (deleting a folder full of files, say) mustn't run to
+// completion inside the MTP callback, since that stalls tud_task and with it all USB traffic,
+// control requests included. Their handlers start a job instead and return without a response.
+// The job is a step function that does a small piece of work per call. mtpPoll calls it between
+// tud_task runs, for at most CFG_EXAMPLE_MTP_EXEC_SLICE_US at a time, until it returns a response
+// code; that response then completes the transaction. GetDeviceStatus reports DeviceBusy while a
+// job is running.
+//
+// A job that ends in a data phase (the result of a lengthy computation, say) sends it with
+// fs_exec_send instead of returning a response code; the response follows the data phase as usual.
+//
+// One job runs at a time, which is all MTP allows anyway: the host waits for the response before
+// sending the next command. A Cancel drops the job, steps must leave things consistent between
+// calls for that.
+
+// Do the next piece of work. Returns 0 while there is more to do, or the response code.
+typedef int32_t (*fs_job_step_t)(void);
+
+static struct {
+  fs_job_step_t step;                 // nullptr when idle
+  const char *name;
+  mtp_container_info_t io_container;  // Of the transaction to respond to
+  int64_t started_at;
+  bool sent;                          // The job sent a data phase instead of a response
+} exec_state;
+
+static bool fs_exec_busy(void)
+{
+  return exec_state.step != nullptr;
+}
+
+// Run step in the background to complete the transaction of cb_data. The handler returns what this
+// returns.
+static int32_t fs_exec_start(tud_mtp_cb_data_t* cb_data, const char *name, fs_job_step_t step)
+{
+  if (fs_exec_busy()) {
+    return MTP_RESP_DEVICE_BUSY;
+  }
+  exec_state.step = step;
+  exec_state.name = name;
+  exec_state.io_container = cb_data->io_container;
+  exec_state.started_at = esp_timer_get_time();
+  exec_state.sent = false;
+  MTP_ESP_LOG("MtpExec", "%s started", name);
+  return 0;
+}
+
+// Work on the job for up to budget_us. Returns true when there is no job (left).
+static bool fs_exec_run(int64_t budget_us)
+{
+  if (!fs_exec_busy()) {
+    return true;
+  }
+  const int64_t start = esp_timer_get_time();
+  int32_t resp_code;
+  do {
+    resp_code = exec_state.step();
+  } while (resp_code == 0 && esp_timer_get_time() - start < budget_us);
+  if (resp_code == 0) {
+    return false;
+  }
+
+  exec_state.step = nullptr;
+  MTP_ESP_LOG("MtpExec", "%s done in %lld us, resp %04X", exec_state.name,
+              (long long)(esp_timer_get_time() - exec_state.started_at), resp_code);
+  if (!exec_state.sent) {
+    exec_state.io_container.header->code = (uint16_t)resp_code;
+    tud_mtp_response_send(&exec_state.io_container);
+  }
+  return true;
+}
+
+// Finish the job by sending len bytes of data as the data phase of its transaction. The step
+// returns what this returns.
+static int32_t fs_exec_send(const void *data, size_t len)
+{
+  mtp_container_add_raw(&exec_state.io_container, data, len);
+  tud_mtp_data_send(&exec_state.io_container);
+  exec_state.sent = true;
+  return MTP_RESP_OK;
+}
+
+// Drop the job without a response, the transaction was cancelled
+static void fs_exec_abort(void)
+{
+  if (fs_exec_busy()) {
+    ESP_LOGI("MtpExec", "%s cancelled", exec_state.name);
+    exec_state.step = nullptr;
+  }
+}
@@ -0,0 +1,139 @@
+// Open file cache.
+//
+// Only one object is open at a time (current_file), and GetObject closes it at the end. Hosts
+// often come back for the same object soon after: a partial read continued, the thumbnail and then
+// the file, a retry after a timeout. Each time that means building the path, resolving dedup
+// references, fopen in LittleFS and finding the size.
+//
+// So objects opened for reading aren't closed but parked here, with their size, and the next
+// fs_open_handle of the same handle for reading takes them back. The least recently parked one is
+// closed when there is no room. An entry goes away when its object is opened for writing or
+// deleted, and everything is closed when handles may change meaning (sessions, reconciling) and
+// when the application changes files behind our back (mtpNotify*, which may come from other tasks,
+// hence the lock).
+
+typedef struct {
+  fs_handle_t handle;           // FS_INVALID_HANDLE when free
+  FILE *file;
+  size_t size;                  // Logical size, as in current_file_size
+  bool compressed;
+  uint32_t parked_at;           // For finding the least recently used one
+} file_cache_entry_t;
+
+static struct {
+  file_cache_entry_t entries[CFG_EXAMPLE_MTP_FILE_CACHE];
+  uint32_t clock;
+  uint32_t hits;
+  uint32_t misses;
+} file_cache;
+static portMUX_TYPE file_cache_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void fs_prefetch_forget(fs_handle_t handle);
+
+// Take the parked file of handle. Returns nullptr if there is none.
+static FILE *fs_file_cache_take(fs_handle_t handle, size_t *size, bool *compressed)
+{
+  FILE *f = nullptr;
+  portENTER_CRITICAL(&file_cache_lock);
+  for (int ii = 0; ii < CFG_EXAMPLE_MTP_FILE_CACHE; ii++) {
+    auto entry = &file_cache.entries[ii];
+    if (entry->file != nullptr && entry->handle == handle) {
+      f = entry->file;
+      *size = entry->size;
+      *compressed = entry->compressed;
+      entry->file = nullptr;
+      entry->handle = FS_INVALID_HANDLE;
+      break;
+    }
+  }
+  if (f != nullptr) {
+    file_cache.hits++;
+  } else {
+    file_cache.misses++;
+  }
+  portEXIT_CRITICAL(&file_cache_lock);
+  return f;
+}
+
+// Park a file opened for reading instead of closing it. Returns false if it wasn't taken.
+static bool fs_file_cache_put(fs_handle_t handle, FILE *f, size_t size, bool compressed)
+{
+  if (CFG_EXAMPLE_MTP_FILE_CACHE == 0 || handle == FS_INVALID_HANDLE) {
+    return false;
+  }
+  FILE *evicted = nullptr;
+  portENTER_CRITICAL(&file_cache_lock);
+  file_cache_entry_t *slot = nullptr;
+  for (int ii = 0; ii < CFG_EXAMPLE_MTP_FILE_CACHE; ii++) {
+    auto entry = &file_cache.entries[ii];
+    if (entry->file == nullptr) {
+      slot = entry;
+      break;
+    }
+    if (slot == nullptr || entry->parked_at < slot->parked_at) {
+      slot = entry;
+    }
+  }
+  evicted = slot->file;
+  slot->handle = handle;
+  slot->file = f;
+  slot->size = size;
+  slot->compressed = compressed;
+  slot->parked_at = ++file_cache.clock;
+  portEXIT_CRITICAL(&file_cache_lock);
+
+  if (evicted != nullptr) {
+    filepoolClose(evicted);
+  }
+  return true;
+}
+
+// The object of handle changes or goes away
+static void fs_file_cache_drop(fs_handle_t handle)
+{
+  FILE *f = nullptr;
+  portENTER_CRITICAL(&file_cache_lock);
+  for (int ii = 0; ii < CFG_EXAMPLE_MTP_FILE_CACHE; ii++) {
+    auto entry = &file_cache.entries[ii];
+    if (entry->file != nullptr && entry->handle == handle) {
+      f = entry->file;
+      entry->file = nullptr;
+      entry->handle = FS_INVALID_HANDLE;
+      break;
+    }
+  }
+  fs_prefetch_forget(handle);
+  portEXIT_CRITICAL(&file_cache_lock);
+
+  if (f != nullptr) {
+    filepoolClose(f);
+  }
+}
+
+// Close everything. Safe to call from any task.
+static void fs_file_cache_flush(void)
+{
+  FILE *files[CFG_EXAMPLE_MTP_FILE_CACHE + 1];
+  int count = 0;
+  portENTER_CRITICAL(&file_cache_lock);
+  for (int ii = 0; ii < CFG_EXAMPLE_MTP_FILE_CACHE; ii++) {
+    auto entry = &file_cache.entries[ii];
+    if (entry->file != nullptr) {
+      files[count++] = entry->file;
+      entry->file = nullptr;
+      entry->handle = FS_INVALID_HANDLE;
+    }
+  }
+  fs_prefetch_forget(FS_INVALID_HANDLE);
+  portEXIT_CRITICAL(&file_cache_lock);
+
+  for (int ii = 0; ii < count; ii++) {
+    filepoolClose(files[ii]);
+  }
+}
+
+static void fs_file_cache_log_stats(void)
+{
+  ESP_LOGI("MtpFileCache", "%lu hits, %lu misses", (unsigned long)file_cache.hits,
+           (unsigned long)file_cache.misses);
+}
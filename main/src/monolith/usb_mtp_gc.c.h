@@ -0,0 +1,141 @@
+// Housekeeping while the host is idle.
+//
+// Creating and deleting objects leaves work behind that otherwise gets done in the middle of the
+// next transfer: the metadata store fills up with records of deleted files, and shadows of
+// replacements interrupted by a power cut stay around.
+//
+// Once the host has been quiet for CFG_EXAMPLE_MTP_GC_IDLE_MS after such changes, mtpPoll runs
+// the steps below, a few milliseconds at a time. Changes to the metadata store are written back
+// then too, rather than after every upload and delete: a burst of them costs one store rewrite.
+// Records lost to a power cut before that are caches and get rebuilt from the files. Host
+// traffic pauses them right away: they only run between tud_task calls, and not before the host
+// is idle again. What was done is logged.
+//
+// LittleFS folder metadata is not touched: esp_littlefs doesn't give access to its lfs_t, so
+// lfs_fs_gc can't be called, and anything done through the VFS adds to the metadata logs rather
+// than compacting them.
+
+#include "esp_timer.h"
+
+typedef enum {
+  GC_STEP_METADATA = 0,           // Drop metadata records of vanished files
+  GC_STEP_SHADOWS,                // Remove shadows no upload will come back to
+  GC_STEP_DONE,
+} gc_step_t;
+
+constexpr int GC_METADATA_BATCH = 4;
+
+static struct {
+  bool pending;                   // Changes were made since the last pass
+  gc_step_t step;
+  int cursor;                     // Within the step
+  int64_t host_at;                // esp_timer time of the last host traffic
+  int64_t busy_us;                // Spent on the pass so far
+  int dropped_records;
+  int removed_shadows;
+} gc_state;
+
+// The host sent something
+static void fs_gc_host_active(void)
+{
+  gc_state.host_at = esp_timer_get_time();
+}
+
+// Objects were added to or removed from the folder
+static void fs_gc_changed(fs_handle_t parent_handle)
+{
+  if (!gc_state.pending) {
+    gc_state.pending = true;
+    gc_state.step = GC_STEP_METADATA;
+    gc_state.cursor = 0;
+    gc_state.busy_us = 0;
+    gc_state.dropped_records = 0;
+    gc_state.removed_shadows = 0;
+  }
+}
+
+static bool fs_gc_shadow_wanted(const char *name)
+{
+  char shadow_path[64];
+  for (int ii = 0; ii < RESUME_MAX_UPLOADS; ii++) {
+    auto record = &resume_journal.records[ii];
+    if (record->path[0] != '\0' && (record->flags & RESUME_SHADOWED)) {
+      fs_shadow_path(record->path, shadow_path, sizeof(shadow_path));
+      if (strcmp(strrchr(shadow_path, '/') + 1, name) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void fs_gc_remove_shadows(void)
+{
+  char shadow_dir[64], shadow_path[200];
+  snprintf(shadow_dir, sizeof(shadow_dir), "/littlefs/%s/shadow", FS_PRIVATE_DIR);
+  DIR *dir = opendir(shadow_dir);
+  if (dir == nullptr) {
+    return;
+  }
+  fs_resume_load();
+  struct dirent *item;
+  while ((item = readdir(dir)) != nullptr) {
+    if (item->d_type == DT_REG && !fs_gc_shadow_wanted(item->d_name)) {
+      snprintf(shadow_path, sizeof(shadow_path), "%s/%s", shadow_dir, item->d_name);
+      if (unlink(shadow_path) == 0) {
+        objmetaRemove(shadow_path);
+        gc_state.removed_shadows++;
+      }
+    }
+  }
+  closedir(dir);
+}
+
+static void fs_gc_step(void)
+{
+  switch (gc_state.step) {
+    case GC_STEP_METADATA:
+      gc_state.dropped_records += objmetaPrune(&gc_state.cursor, GC_METADATA_BATCH);
+      if (gc_state.cursor < OBJMETA_MAX_RECORDS) {
+        return;
+      }
+      objmetaSave();
+      break;
+
+    case GC_STEP_SHADOWS:
+      fs_gc_remove_shadows();
+      break;
+
+    default:
+      break;
+  }
+  gc_state.step++;
+  gc_state.cursor = 0;
+}
+
+// Do housekeeping for up to CFG_EXAMPLE_MTP_GC_SLICE_US if the host is idle. Returns true when
+// there is nothing to do right now.
+static bool fs_gc_run(void)
+{
+  const int64_t start = esp_timer_get_time();
+  if ((!gc_state.pending && !objmetaPending()) || start - gc_state.host_at < CFG_EXAMPLE_MTP_GC_IDLE_MS * 1000LL ||
+      fs_exec_busy() || cancel_state.pending || upload_state.active) {
+    return true;
+  }
+  if (!gc_state.pending) {
+    objmetaSave();
+    return true;
+  }
+  do {
+    fs_gc_step();
+  } while (gc_state.step < GC_STEP_DONE && esp_timer_get_time() - start < CFG_EXAMPLE_MTP_GC_SLICE_US);
+  gc_state.busy_us += esp_timer_get_time() - start;
+  if (gc_state.step < GC_STEP_DONE) {
+    return false;
+  }
+
+  gc_state.pending = false;
+  ESP_LOGI("MtpGc", "Housekeeping took %lld us: %d metadata records dropped, %d shadows removed",
+           (long long)gc_state.busy_us, gc_state.dropped_records, gc_state.removed_shadows);
+  return true;
+}
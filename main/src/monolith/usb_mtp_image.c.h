@@ -0,0 +1,198 @@
+// Image metadata and thumbnails.
+//
+// Format, dimensions and bit depth come from the object's headers (see imginfo.h) and are cached
+// in the object metadata store, filled in when an upload completes or the first time an object is
+// enumerated. ObjectInfo reports them, so hosts can lay out a folder of pictures without
+// downloading any.
+//
+// GetThumb serves the EXIF thumbnail embedded in a JPEG, or small images as they are. Uncompressed
+// BMPs are scaled down once into /.mtp/thumbs; the name of the cached copy is derived from the
+// object's path, size and mtime, so a changed object never picks up an old thumbnail.
+
+#include "esp_rom_crc.h"
+#include "imginfo.h"
+
+static struct {
+  FILE *cache_file;     // Generated thumbnail, nullptr when the thumbnail is part of the object
+  uint32_t offset;      // Start of the thumbnail within the object
+  uint32_t size;
+} thumb_state;
+
+static uint16_t fs_image_mtp_format(uint16_t format)
+{
+  switch (format) {
+    case IMGINFO_FORMAT_TEXT:      return MTP_OBJ_FORMAT_TEXT;
+    case IMGINFO_FORMAT_PNG:       return MTP_OBJ_FORMAT_PNG;
+    case IMGINFO_FORMAT_JPEG_EXIF: return MTP_OBJ_FORMAT_EXIF_JPEG;
+    case IMGINFO_FORMAT_JPEG_JFIF: return MTP_OBJ_FORMAT_JFIF;
+    case IMGINFO_FORMAT_BMP:       return MTP_OBJ_FORMAT_BMP;
+    case IMGINFO_FORMAT_GIF:       return MTP_OBJ_FORMAT_GIF;
+    default:                       return MTP_OBJ_FORMAT_UNDEFINED;
+  }
+}
+
+static size_t fs_image_read(void *ctx, uint32_t offset, void *buf, size_t len)
+{
+  (void) ctx;
+  return fs_read_current(offset, buf, len);
+}
+
+// Image facts of a stored file, parsed on first use. The store is saved along with the next change
+// to it, losing the record only costs a parse.
+static bool fs_image_info(fs_handle_t handle, const char *path, imginfo_t *info)
+{
+  objmeta_t *record = objmetaLookup(path);
+  if (record != nullptr && (record->flags & OBJMETA_HAS_IMAGE)) {
+    *info = record->image;
+    return true;
+  }
+
+  if (current_file != nullptr) {
+    // Don't disturb a transfer in progress (the host may ask for ObjectInfo between SendObjectInfo
+    // and SendObject). The upload fills the record in when it completes.
+    return false;
+  }
+  auto entry = fs_get_handle_entry(&handle_table, handle);
+  if (entry == nullptr || fs_open_handle(&handle_table, handle, "r") == nullptr) {
+    return false;
+  }
+  imginfoParse(fs_image_read, nullptr, entry->name, current_file_size, info);
+  fs_close_handle(handle, current_file);
+
+  record = fs_object_record(path);
+  if (record != nullptr) {
+    record->image = *info;
+    record->flags |= OBJMETA_HAS_IMAGE;
+  }
+  return true;
+}
+
+static bool fs_image_thumb_path(const char *path, char *path_out, size_t buf_len)
+{
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return false;
+  }
+  const uint32_t key[2] = { (uint32_t)st.st_size, (uint32_t)st.st_mtime };
+  uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)path, strlen(path));
+  crc = esp_rom_crc32_le(crc, (const uint8_t *)key, sizeof(key));
+  snprintf(path_out, buf_len, "/littlefs/%s/thumbs/%08lx.bmp", FS_PRIVATE_DIR, (unsigned long)crc);
+  return true;
+}
+
+// Drop the cached thumbnail of an object. Called before the object changes or goes away.
+static void fs_image_forget(const char *path)
+{
+  char thumb_path[64];
+  if (fs_image_thumb_path(path, thumb_path, sizeof(thumb_path))) {
+    unlink(thumb_path);
+  }
+}
+
+static bool fs_image_generate_thumb(fs_handle_t handle, const imginfo_t *info, const char *thumb_path)
+{
+  char thumb_dir[64];
+  snprintf(thumb_dir, sizeof(thumb_dir), "/littlefs/%s/thumbs", FS_PRIVATE_DIR);
+  mkdir(thumb_dir, 0777);
+
+  if (fs_open_handle(&handle_table, handle, "r") == nullptr) {
+    return false;
+  }
+  FILE *out = fopen(thumb_path, "w");
+  bool ok = out != nullptr && imginfoBmpThumbnail(fs_image_read, nullptr, info, out);
+  if (out != nullptr) {
+    ok = (fclose(out) == 0) && ok;
+  }
+  fs_close_handle(handle, current_file);
+  if (!ok) {
+    ESP_LOGE("MtpImage", "Failed to generate %s", thumb_path);
+    unlink(thumb_path);
+  }
+  return ok;
+}
+
+static size_t fs_thumb_read(uint32_t offset, void *buf, size_t len)
+{
+  if (thumb_state.cache_file != nullptr) {
+    fseek(thumb_state.cache_file, offset, SEEK_SET);
+    return fread(buf, 1, len, thumb_state.cache_file);
+  }
+  return fs_read_current(thumb_state.offset + offset, buf, len);
+}
+
+static void fs_thumb_close(fs_handle_t handle)
+{
+  if (thumb_state.cache_file != nullptr) {
+    filepoolClose(thumb_state.cache_file);
+    thumb_state.cache_file = nullptr;
+  } else if (current_file != nullptr && current_handle == handle) {
+    fs_close_handle(handle, current_file);
+  }
+}
+
+static int32_t fs_get_thumb(tud_mtp_cb_data_t* cb_data) {
+  const mtp_container_command_t* command = cb_data->command_container;
+  mtp_container_info_t* io_container = &cb_data->io_container;
+  const uint32_t obj_handle = command->params[0];
+
+  if (cb_data->phase == MTP_PHASE_COMMAND) {
+    if (!is_session_opened) {
+      return MTP_RESP_SESSION_NOT_OPEN;
+    }
+    char pathbuf[200];
+    auto entry = fs_get_handle_entry(&handle_table, obj_handle);
+    if (entry == nullptr || entry->is_dir || !fs_path_from_handle(&handle_table, obj_handle, pathbuf, sizeof(pathbuf))) {
+      return MTP_RESP_INVALID_OBJECT_HANDLE;
+    }
+    fs_thumb_close(obj_handle);
+    imginfo_t info;
+    if (!fs_image_info(obj_handle, pathbuf, &info)) {
+      return MTP_RESP_GENERAL_ERROR;
+    }
+
+    thumb_state.offset = info.thumb_offset;
+    thumb_state.size = info.thumb_size;
+    if (info.thumb_source == IMGINFO_THUMB_GENERATED) {
+      char thumb_path[64];
+      if (!fs_image_thumb_path(pathbuf, thumb_path, sizeof(thumb_path))) {
+        return MTP_RESP_GENERAL_ERROR;
+      }
+      thumb_state.cache_file = filepoolOpen(thumb_path, "r");
+      if (thumb_state.cache_file == nullptr) {
+        MTP_ESP_LOG("MtpImage", "Generating thumbnail for %s", pathbuf);
+        if (!fs_image_generate_thumb(obj_handle, &info, thumb_path)) {
+          return MTP_RESP_GENERAL_ERROR;
+        }
+        thumb_state.cache_file = filepoolOpen(thumb_path, "r");
+      }
+      if (thumb_state.cache_file == nullptr) {
+        return MTP_RESP_GENERAL_ERROR;
+      }
+    } else if (info.thumb_source != IMGINFO_THUMB_NONE) {
+      if (fs_open_handle(&handle_table, obj_handle, "r") == nullptr) {
+        return MTP_RESP_GENERAL_ERROR;
+      }
+    } else {
+      return MTP_RESP_NO_THUMBNAIL_PRESENT;
+    }
+
+    // Same dance as in fs_get_object: claim the whole size, hand over what fits in the first packet
+    uint8_t first_time_buffer[CFG_TUD_MTP_EP_BUFSIZE];
+    fs_thumb_read(0, first_time_buffer, TU_MIN(CFG_TUD_MTP_EP_BUFSIZE, thumb_state.size));
+    mtp_container_add_raw(io_container, first_time_buffer, thumb_state.size);
+    tud_mtp_data_send(io_container);
+  } else if (cb_data->phase == MTP_PHASE_DATA) {
+    const uint32_t offset = cb_data->total_xferred_bytes - sizeof(mtp_container_header_t);
+    const uint32_t xact_len = tu_min32(thumb_state.size - offset, io_container->payload_bytes);
+    if (xact_len > 0) {
+      if (fs_thumb_read(offset, io_container->payload, xact_len) != xact_len) {
+        ESP_LOGE("MtpImage", "%s: short read at %d", __func__, offset);
+      }
+      tud_mtp_data_send(io_container);
+    }
+    if (offset + xact_len >= thumb_state.size) {
+      fs_thumb_close(obj_handle);
+    }
+  }
+  return 0;
+}
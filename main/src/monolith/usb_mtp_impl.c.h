@@ -27,12 +27,19 @@
 #include <sys/errno.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
+#include <stdatomic.h>
 #include "esp_littlefs.h"
 #include "esp_log.h"
 #include "tusb.h"
 #include "util.h"
+#include "dataset.h"
+#include "filepool.h"
+#include "flashio.h"
+#include "lfstune.h"
+#include "objmeta.h"
+#include "mtp.h"
+#include "zfile.h"
 #include "tinyusb_logo_png.h"
-#include "utf8-utf16-converter.h"
 
 #define TU_FIELD_SIZE(_type, _field)  (sizeof(((_type *)0)->_field))
 
@@ -97,12 +104,111 @@ storage_info_t storage_info = {
   uint8_t fs_buf[FS_MAX_CAPACITY_BYTES];
 #endif
 
+// With CFG_EXAMPLE_MTP_COMPRESSION 1, objects matching these folders (directly under the root) or
+// extensions are stored compressed. Compression is transparent to the host: GetObject decompresses
+// and ObjectInfo reports the logical size. Firmware reading such files has to go through zfile.h,
+// so it is off unless the application asks for it.
+#ifndef CFG_EXAMPLE_MTP_COMPRESSION
+  #define CFG_EXAMPLE_MTP_COMPRESSION 0
+#endif
+static const char *const fs_compressed_folders[] = { "logs" };
+static const char *const fs_compressed_extensions[] = { ".txt", ".log", ".csv", ".json", ".xml", ".htm", ".html", ".md" };
+
+// New files in these folders (directly under the root) are spread over SHARDS hidden subfolders,
+// so folders holding thousands of files stay quick to work with. It changes where files are
+// stored, so it is off unless the application asks for it. See usb_mtp_shard.c.h.
+#ifndef CFG_EXAMPLE_MTP_SHARDS
+  #define CFG_EXAMPLE_MTP_SHARDS 0
+#endif
+static const char *const fs_sharded_folders[] = { "logs" };
+
+// Uploads identical to an object already on the device are stored once and shared. Nothing of an
+// upload is written while it looks like a duplicate. See usb_mtp_dedup.c.h.
+#ifndef CFG_EXAMPLE_MTP_DEDUP
+  #define CFG_EXAMPLE_MTP_DEDUP 0
+#endif
+
+// Interrupted uploads keep what was received and can be continued with SendPartialObject. Progress
+// is made durable every CHECKPOINT bytes; partial uploads left alone for TIMEOUT_S are deleted.
+#ifndef CFG_EXAMPLE_MTP_RESUME
+  #define CFG_EXAMPLE_MTP_RESUME 1
+#endif
+#ifndef CFG_EXAMPLE_MTP_RESUME_CHECKPOINT
+  #define CFG_EXAMPLE_MTP_RESUME_CHECKPOINT (256 * 1024)
+#endif
+#ifndef CFG_EXAMPLE_MTP_RESUME_TIMEOUT_S
+  #define CFG_EXAMPLE_MTP_RESUME_TIMEOUT_S (30 * 60)
+#endif
+
+// Time a background operation (see usb_mtp_exec.c.h) may hold up tud_task for at a time, in microseconds
+#ifndef CFG_EXAMPLE_MTP_EXEC_SLICE_US
+  #define CFG_EXAMPLE_MTP_EXEC_SLICE_US (10 * 1000)
+#endif
+
+// Objects read by the host are kept open for this many later reads, see usb_mtp_filecache.c.h
+#ifndef CFG_EXAMPLE_MTP_FILE_CACHE
+  #define CFG_EXAMPLE_MTP_FILE_CACHE 2
+#endif
+
+// Bytes read ahead of the next object while a folder is downloaded, see usb_mtp_prefetch.c.h.
+// 0 turns prefetching off.
+#ifndef CFG_EXAMPLE_MTP_PREFETCH_BYTES
+  #define CFG_EXAMPLE_MTP_PREFETCH_BYTES 4096
+#endif
+
+// Share of the free PSRAM used to cache object content, and the most it may take. See
+// usb_mtp_blockcache.c.h.
+#ifndef CFG_EXAMPLE_MTP_BLOCK_CACHE_PERCENT
+  #define CFG_EXAMPLE_MTP_BLOCK_CACHE_PERCENT 25
+#endif
+#ifndef CFG_EXAMPLE_MTP_BLOCK_CACHE_MAX
+  #define CFG_EXAMPLE_MTP_BLOCK_CACHE_MAX (1024 * 1024)
+#endif
+
+// Upload data buffered for the writer task, a multiple of FLASHIO_CHUNK. 0 writes uploads from
+// the TinyUSB task. See usb_mtp_writeback.c.h.
+#ifndef CFG_EXAMPLE_MTP_WRITEBACK_BYTES
+  #define CFG_EXAMPLE_MTP_WRITEBACK_BYTES (16 * 1024)
+#endif
+
+// Housekeeping after creates and deletes (see usb_mtp_gc.c.h) starts once the host has been quiet
+// for IDLE_MS, and takes at most SLICE_US at a time
+#ifndef CFG_EXAMPLE_MTP_GC_IDLE_MS
+  #define CFG_EXAMPLE_MTP_GC_IDLE_MS 2000
+#endif
+#ifndef CFG_EXAMPLE_MTP_GC_SLICE_US
+  #define CFG_EXAMPLE_MTP_GC_SLICE_US (5 * 1000)
+#endif
+
+// Partition TuneStorage measures the flash on, at least 36 KiB. Its content is destroyed, so it
+// gets one of its own in partitions.csv.
+#ifndef CFG_EXAMPLE_MTP_TUNE_SCRATCH
+  #define CFG_EXAMPLE_MTP_TUNE_SCRATCH "lfstune"
+#endif
+
+// Count heap allocations made while handling data packets, and abort on any made in the middle of
+// a transfer. Needs CONFIG_HEAP_USE_HOOKS, and is on whenever that is: build with the
+// sdkconfig.ci.alloccheck defaults to run the check.
+#ifndef CFG_EXAMPLE_MTP_ALLOC_CHECK
+  #ifdef CONFIG_HEAP_USE_HOOKS
+    #define CFG_EXAMPLE_MTP_ALLOC_CHECK 1
+  #else
+    #define CFG_EXAMPLE_MTP_ALLOC_CHECK 0
+  #endif
+#endif
+
+// Flash work done per GetDeviceStatus poll while cleaning up after a Cancel, in microseconds
+#ifndef CFG_EXAMPLE_MTP_CANCEL_BUDGET_US
+  #define CFG_EXAMPLE_MTP_CANCEL_BUDGET_US (20 * 1000)
+#endif
+
 #define FS_FIXED_DATETIME "20250808T173500.0" // "YYYYMMDDTHHMMSS.s"
 #define README_TXT_CONTENT "TinyUSB MTP Filesystem example"
 
 // vvv My LittleFS logic
 constexpr int MTP_FILENAME_LENGTH = 63;
 constexpr int MTP_HANDLE_TABLE_SIZE = 32;
+static const char FS_PRIVATE_DIR[] = ".mtp"; // Responder bookkeeping in the root, hidden from the host
 typedef uint32_t fs_handle_t;
 constexpr fs_handle_t FS_INVALID_HANDLE = UINT_MAX;
 
@@ -130,50 +236,72 @@ typedef struct {
   uint32_t handles_used;
 } fs_handletable;
 static fs_handletable handle_table;
+
+// Listing of a folder that looks through its shards, see usb_mtp_shard.c.h
+typedef struct {
+  DIR *dir;
+  DIR *shard;                     // Shard being listed, nullptr between shards
+  char path[200];                 // Of the folder, or of the shard being listed
+  size_t path_len;                // Of the folder's path
+} fs_dir_t;
+
+// The handle table is only changed by the TinyUSB task, but other tasks read it through the
+// snapshot API (usb_mtp_index.c.h). Changes are bracketed by these, which make the sequence
+// number odd for the duration (a seqlock): readers copy what they need and start over if the
+// number changed meanwhile. Neither side ever waits for the other.
+static atomic_uint index_seq;
+
+static void fs_index_write_begin(void)
+{
+  atomic_store_explicit(&index_seq, atomic_load_explicit(&index_seq, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void fs_index_write_end(void)
+{
+  atomic_store_explicit(&index_seq, atomic_load_explicit(&index_seq, memory_order_relaxed) + 1,
+                        memory_order_release);
+}
 FILE *current_file = nullptr;
 fs_handle_t current_handle = FS_INVALID_HANDLE;
 size_t current_file_size = 0;
+bool current_compressed = false;  // current_file is a zfile, accessed through current_zfile
+bool current_shadowed = false;    // current_file is the shadow of the object, see usb_mtp_shadow.c.h
+bool current_reading = false;     // current_file is open read-only and can be kept open after closing
+static zfile_t current_zfile;
 // ^^^ My LittleFS logic
 
 enum {
   SUPPORTED_STORAGE_ID = 0x00010001u // physical = 1, logical = 1
 };
 
-static int32_t fs_get_device_info(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_open_close_session(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_get_storage_ids(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_get_storage_info(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_get_device_properties(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_get_object_handles(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_get_object_info(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_get_object(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_delete_object(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_send_object_info(tud_mtp_cb_data_t* cb_data);
-static int32_t fs_send_object(tud_mtp_cb_data_t* cb_data);
+// Handlers of the operations in MTP_OPERATIONS (mtp_operations.h), and the dispatch table built from
+// it: one slot per operation code, so finding the handler of a command or data packet is a load.
+// An operation code outside the slot ranges fails to compile.
+#define FS_OP_DECLARE(code, handler) static int32_t handler(tud_mtp_cb_data_t* cb_data);
+MTP_OPERATIONS(FS_OP_DECLARE)
+#undef FS_OP_DECLARE
 
 typedef int32_t (*fs_op_handler_t)(tud_mtp_cb_data_t* cb_data);
-typedef struct {
-  uint32_t op_code;
-  fs_op_handler_t handler;
-}fs_op_handler_dict_t;
-
-fs_op_handler_dict_t fs_op_handler_dict[] = {
-  { MTP_OP_GET_DEVICE_INFO,       fs_get_device_info    },
-  { MTP_OP_OPEN_SESSION,          fs_open_close_session },
-  { MTP_OP_CLOSE_SESSION,         fs_open_close_session },
-  { MTP_OP_GET_STORAGE_IDS,       fs_get_storage_ids       },
-  { MTP_OP_GET_STORAGE_INFO,      fs_get_storage_info      },
-  { MTP_OP_GET_DEVICE_PROP_DESC,  fs_get_device_properties  },
-  { MTP_OP_GET_DEVICE_PROP_VALUE, fs_get_device_properties },
-  { MTP_OP_GET_OBJECT_HANDLES,    fs_get_object_handles    },
-  { MTP_OP_GET_OBJECT_INFO,       fs_get_object_info       },
-  { MTP_OP_GET_OBJECT,            fs_get_object            },
-  { MTP_OP_DELETE_OBJECT,         fs_delete_object         },
-  { MTP_OP_SEND_OBJECT_INFO,      fs_send_object_info      },
-  { MTP_OP_SEND_OBJECT,           fs_send_object           },
+static const fs_op_handler_t fs_op_handlers[MTP_OPERATION_SLOTS] = {
+#define FS_OP_SLOT(code, handler) [MTP_OPERATION_SLOT(code)] = handler,
+  MTP_OPERATIONS(FS_OP_SLOT)
+#undef FS_OP_SLOT
 };
 
+// nullptr for operations we don't support
+static fs_op_handler_t fs_op_handler(uint16_t op_code)
+{
+  const uint32_t slot = MTP_OPERATION_SLOT(op_code);
+  return slot < MTP_OPERATION_SLOTS ? fs_op_handlers[slot] : nullptr;
+}
+
 static bool is_session_opened = false;
+// Set by mtpLoadStorage once LittleFS is mounted and the index built. Until then operations that
+// need the storage get DeviceBusy.
+static atomic_bool storage_ready;
+static bool index_preloaded = false;  // Built by mtpLoadStorage, for the first OpenSession to use
 static uint32_t send_obj_handle = 0;
 
 //--------------------------------------------------------------------+
@@ -199,7 +327,18 @@ static fs_handletable_entry_t *fs_get_handle_entry(fs_handletable *handle_table,
   return nullptr;
 }
 
+static bool fs_shard_folder(const char *folder_name);
+static bool fs_shard_dir(const char *name);
+static void fs_shard_append(const char *name, char *path_out, int buf_len);
+static void fs_shard_locate(const char *name, char *path_out, int buf_len);
+static bool fs_dir_open(fs_dir_t *dir, const char *dir_path);
+static struct dirent *fs_dir_next(fs_dir_t *dir, char *path_out, size_t buf_len);
+static void fs_dir_close(fs_dir_t *dir);
+
 static void fs_handletable_regenerate(fs_handletable *handle_table) {
+  // Built aside and swapped in at the end, so the directory scan doesn't hold the seqlock and
+  // index readers in other tasks see the old table until the new one is complete
+  static fs_handletable scan_table;
   int ii = fs_assign_new_handle();
   auto root = opendir("/littlefs");
   char path_buf[200];
@@ -208,11 +347,18 @@ static void fs_handletable_regenerate(fs_handletable *handle_table) {
     ESP_LOGE("MtpInit", "Cannot opendir(\"/littlefs\"), got nullptr");
     return;
   }
+  memset(scan_table.handles, 0, sizeof(scan_table.handles));
   while ((rootitem = readdir(root)) != nullptr) {
+    if (strcmp(rootitem->d_name, FS_PRIVATE_DIR) == 0) {
+      continue;
+    }
+
     // One root item was found. Record it in the handle table
-    strncpy(handle_table->handles[ii].name, rootitem->d_name, MTP_FILENAME_LENGTH);
-    handle_table->handles[ii].parent_handle = 0;
-    handle_table->handles[ii].handle = ii;
+    const fs_handle_t item_handle = ii;
+    strncpy(scan_table.handles[ii].name, rootitem->d_name, MTP_FILENAME_LENGTH);
+    scan_table.handles[ii].parent_handle = 0;
+    scan_table.handles[ii].handle = ii;
+    scan_table.handles[ii].is_dir = rootitem->d_type == DT_DIR;
     MTP_ESP_LOG("MtpInit", "Handle %d = /%s", ii, rootitem->d_name);
     if ((ii = fs_assign_new_handle()) >= MTP_HANDLE_TABLE_SIZE) {
       ESP_LOGW("MtpInit", "Handle table full, stopping handle table init");
@@ -221,34 +367,38 @@ static void fs_handletable_regenerate(fs_handletable *handle_table) {
 
     // If it is a directory, we look inside too
     if (rootitem->d_type == DT_DIR) {
-      auto parent_handle = ii;
-      handle_table->handles[parent_handle].is_dir = true;
+      auto parent_handle = item_handle;
 
       strcpy(path_buf, "/littlefs/");
       strcat(path_buf, rootitem->d_name);
-      auto subdir = opendir(path_buf);
-      if (subdir == nullptr) {
+      fs_dir_t subdir;
+      if (!fs_dir_open(&subdir, path_buf)) {
         ESP_LOGE("MtpInit", "Cannot opendir(\"/littlefs/%s\"), got nullptr", rootitem->d_name);
         continue;
       }
       struct dirent *subdiritem;
-      while ((subdiritem = readdir(subdir)) != nullptr) {
+      while ((subdiritem = fs_dir_next(&subdir, path_buf, sizeof(path_buf))) != nullptr) {
         // One subdir item was found. Record it in the handle
-        strncpy(handle_table->handles[ii].name, subdiritem->d_name, MTP_FILENAME_LENGTH);
-        handle_table->handles[ii].parent_handle = parent_handle;
-        handle_table->handles[ii].is_dir = subdiritem->d_type == DT_DIR;
+        strncpy(scan_table.handles[ii].name, subdiritem->d_name, MTP_FILENAME_LENGTH);
+        scan_table.handles[ii].handle = ii;
+        scan_table.handles[ii].parent_handle = parent_handle;
+        scan_table.handles[ii].is_dir = subdiritem->d_type == DT_DIR;
         MTP_ESP_LOG("MtpInit", "Handle %d = /%s/%s", ii, rootitem->d_name, subdiritem->d_name);
         if ((ii = fs_assign_new_handle()) >= MTP_HANDLE_TABLE_SIZE) {
           ESP_LOGW("MtpInit", "Handle table full, stopping handle table init");
+          fs_dir_close(&subdir);
           goto cleanup;
         }
       }
-      closedir(subdir);
+      fs_dir_close(&subdir);
     }
   }
 cleanup:
   closedir(root);
-  handle_table->handles_used = ii;
+  scan_table.handles_used = ii;
+  fs_index_write_begin();
+  memcpy(handle_table, &scan_table, sizeof(scan_table));
+  fs_index_write_end();
 }
 
 static fs_handle_t fs_handletable_find_empty_entry(const fs_handletable *handle_table) {
@@ -282,6 +432,11 @@ static bool fs_path_from_handle(fs_handletable *handle_table, fs_handle_t handle
     auto parent_entry = fs_get_handle_entry(handle_table, entry->parent_handle);
     strlcat(path_out, parent_entry->name, buf_len);
     strlcat(path_out, "/", buf_len);
+    if (!entry->is_dir && fs_shard_folder(parent_entry->name)) {
+      fs_shard_locate(entry->name, path_out, buf_len);
+      MTP_ESP_LOG("MtpFS", "Mapped Handle %d to File %s", handle, path_out);
+      return true;
+    }
   }
   strlcat(path_out, entry->name, buf_len);
   MTP_ESP_LOG("MtpFS", "Mapped Handle %d to File %s", handle, path_out);
@@ -298,6 +453,10 @@ static int fs_path_create(fs_handletable *handle_table, fs_handle_t parent_handl
     strlcpy(path_out, "/littlefs/", buf_len);
     strlcat(path_out, parent_entry->name, buf_len);
     strlcat(path_out, "/", buf_len);
+    if (fs_shard_folder(parent_entry->name)) {
+      fs_shard_locate(name, path_out, buf_len);
+      return 0;
+    }
   } else {
     strlcpy(path_out, "/littlefs/", buf_len);
   }
@@ -315,39 +474,251 @@ static int fs_stat_handle(fs_handletable *handle_table, fs_handle_t handle, stru
   return stat(path_buf, stat_buf);
 }
 
+static void fs_close_handle(fs_handle_t handle, FILE *file);
+static bool fs_dedup_resolve(const char *path, char *content_path, size_t buf_len);
+static bool fs_dedup_is_reference(const char *path, uint32_t *logical_size);
+static bool fs_dedup_release(const char *path);
+static void fs_dedup_load(void);
+static void fs_image_forget(const char *path);
+static FILE *fs_shadow_create(const char *path);
+static void fs_shadow_path(const char *path, char *path_out, size_t buf_len);
+static bool fs_shadow_commit(fs_handle_t handle, const char *shadow_path, const char *path);
+static void fs_sync_event(uint16_t code, uint32_t param);
+static int fs_resume_find(const char *path);
+static int32_t fs_exec_start(tud_mtp_cb_data_t* cb_data, const char *name, int32_t (*step)(void));
+static int32_t fs_exec_send(const void *data, size_t len);
+static FILE *fs_file_cache_take(fs_handle_t handle, size_t *size, bool *compressed);
+static bool fs_file_cache_put(fs_handle_t handle, FILE *f, size_t size, bool compressed);
+static void fs_file_cache_drop(fs_handle_t handle);
+static size_t fs_prefetch_copy(fs_handle_t handle, uint32_t offset, void *buf, size_t len);
+static size_t fs_block_cache_read(uint32_t offset, void *buf, size_t len);
+static void fs_block_cache_release(void);
+static void fs_block_cache_invalidate(const char *path);
+static bool fs_writeback_active(void);
+static size_t fs_writeback_put(const void *buf, size_t len);
+static void fs_digest_upload_update(const uint8_t *data, uint32_t len);
+static int fs_writeback_end(void);
+static void fs_writeback_failed(void);
+static void fs_gc_changed(fs_handle_t parent_handle);
+static void fs_shard_prepare(const char *path);
+static void fs_shard_remove_dirs(const char *dir_path);
+static uint32_t fs_reserved_bytes(void);
+static void fs_reserve(fs_handle_t handle, uint32_t bytes);
+static void fs_reserve_consume(fs_handle_t handle, uint32_t len);
+static void fs_reserve_release(fs_handle_t handle);
+
 static FILE *fs_open_handle(fs_handletable *handle_table, fs_handle_t handle, const char* restrict mode)
 {
   char path_buf[200];
   if (current_file != nullptr && current_handle == handle) {
     return current_file;
   }
+  // Read recently: the file is still open
+  if (strcmp(mode, "r") == 0) {
+    size_t size;
+    bool compressed;
+    FILE *f = fs_file_cache_take(handle, &size, &compressed);
+    if (f != nullptr) {
+      if (current_file != nullptr) {
+        fs_close_handle(current_handle, current_file);
+      }
+      current_file = f;
+      current_handle = handle;
+      current_reading = true;
+      current_file_size = size;
+      current_compressed = compressed && zfileOpenRead(&current_zfile, current_file);
+      return current_file;
+    }
+  } else {
+    fs_file_cache_drop(handle);
+  }
   if (!fs_path_from_handle(handle_table, handle, path_buf, sizeof(path_buf))) {
     return nullptr;
   }
+  if (mode[0] != 'r' || mode[1] == '+') {
+    fs_block_cache_invalidate(path_buf);
+  }
+  if (current_file != nullptr) {
+    // Only one object is open at a time
+    fs_close_handle(current_handle, current_file);
+  }
+  // Shared content is read from the blob store. Stubs are never written through.
+  char content_path[200];
+  if (strcmp(mode, "r") == 0 && fs_dedup_resolve(path_buf, content_path, sizeof(content_path))) {
+    strlcpy(path_buf, content_path, sizeof(path_buf));
+  }
+  current_file = filepoolOpen(path_buf, mode);
+  if (current_file == nullptr) {
+    return nullptr;
+  }
   current_handle = handle;
-  current_file = fopen(path_buf, mode);
+  current_reading = strcmp(mode, "r") == 0;
 
-  // Resolve file size when in read mode
+  // Resolve file size when in read mode. For compressed objects that's the logical size.
   if (mode[0] == 'r') {
-    fseek(current_file, 0, SEEK_END);
-    current_file_size = ftell(current_file);
-    fseek(current_file, 0, SEEK_SET);
+    current_compressed = zfileOpenRead(&current_zfile, current_file);
+    if (current_compressed) {
+      current_file_size = current_zfile.logical_size;
+    } else {
+      fseek(current_file, 0, SEEK_END);
+      current_file_size = ftell(current_file);
+      fseek(current_file, 0, SEEK_SET);
+    }
   }
 
   return current_file;
 }
 
-static bool fs_can_create_file(fs_handletable *handle_table, size_t size)
+// Host transfers go ahead of application I/O (see flashio.h)
+static flashio_client_t *fs_flashio_client(void)
 {
-  size_t capacity_bytes, used_bytes;
-  if (handle_table->handles_used == MTP_HANDLE_TABLE_SIZE) {
-    return false;
+  static flashio_client_t *client;
+  if (client == nullptr) {
+    client = flashioRegister("mtp", FLASHIO_PRIO_INTERACTIVE);
+  }
+  return client;
+}
+
+// Read object content (decompressed if needed) of the currently open handle, bypassing the block cache
+static size_t fs_read_current_direct(uint32_t offset, void *buf, size_t len)
+{
+  size_t read_len;
+  // The start of the object may have been read ahead
+  const size_t head_len = current_compressed ? 0 : fs_prefetch_copy(current_handle, offset, buf, len);
+  if (head_len == len) {
+    return len;
+  }
+  flashioAcquire(fs_flashio_client());
+  if (current_compressed) {
+    zfileSeek(&current_zfile, offset);
+    read_len = zfileRead(&current_zfile, buf, len);
+  } else {
+    fseek(current_file, offset + head_len, SEEK_SET);
+    read_len = head_len + fread((uint8_t *)buf + head_len, 1, len - head_len, current_file);
+  }
+  flashioRelease(fs_flashio_client());
+  return read_len;
+}
+
+// Read object content (decompressed if needed) of the currently open handle
+static size_t fs_read_current(uint32_t offset, void *buf, size_t len)
+{
+  const size_t cached_len = fs_block_cache_read(offset, buf, len);
+  return cached_len > 0 ? cached_len : fs_read_current_direct(offset, buf, len);
+}
+
+// Append object content to the currently open handle, as the I/O of client
+static size_t fs_write_current_as(flashio_client_t *client, const void *buf, size_t len)
+{
+  size_t written;
+  flashioAcquire(client);
+  if (current_compressed) {
+    written = zfileWrite(&current_zfile, buf, len);
+  } else {
+    written = fwrite(buf, 1, len, current_file);
+  }
+  flashioRelease(client);
+  return written;
+}
+
+// Append object content to the currently open handle. Uploads go through the writer task, which
+// also hashes them.
+static size_t fs_write_current(const void *buf, size_t len)
+{
+  if (fs_writeback_active()) {
+    return fs_writeback_put(buf, len);
+  }
+  const size_t written = fs_write_current_as(fs_flashio_client(), buf, len);
+  if (written != len) {
+    fs_writeback_failed();
+  }
+  fs_digest_upload_update((const uint8_t *)buf, len);
+  return written;
+}
+
+static bool fs_should_compress(fs_handletable *handle_table, fs_handle_t parent_handle, const char *name)
+{
+#if CFG_EXAMPLE_MTP_COMPRESSION
+  if (parent_handle != 0) {
+    auto parent_entry = fs_get_handle_entry(handle_table, parent_handle);
+    for (size_t ii = 0; parent_entry != nullptr && ii < TU_ARRAY_SIZE(fs_compressed_folders); ii++) {
+      if (strcasecmp(parent_entry->name, fs_compressed_folders[ii]) == 0) {
+        return true;
+      }
+    }
   }
+  const char *ext = strrchr(name, '.');
+  for (size_t ii = 0; ext != nullptr && ii < TU_ARRAY_SIZE(fs_compressed_extensions); ii++) {
+    if (strcasecmp(ext, fs_compressed_extensions[ii]) == 0) {
+      return true;
+    }
+  }
+#endif
+  return false;
+}
+
+// Logical size of an object, given its stat() result
+static uint32_t fs_object_size(fs_handletable *handle_table, fs_handletable_entry_t *entry, const char *path, const struct stat *stat_buf)
+{
+  objmeta_t *record = objmetaLookup(path);
+  if (record != nullptr) {
+    return (record->flags & (OBJMETA_COMPRESSED | OBJMETA_REFERENCE)) ? record->logical_size : stat_buf->st_size;
+  }
+  // No record (store full or lost). Only files the policy would compress can be compressed.
+  uint32_t logical_size = stat_buf->st_size;
+  if (!entry->is_dir && fs_dedup_is_reference(path, &logical_size)) {
+    return logical_size;
+  }
+  if (!entry->is_dir && fs_should_compress(handle_table, entry->parent_handle, entry->name)) {
+    FILE *f = fopen(path, "r");
+    if (f != nullptr) {
+      zfileProbe(f, &logical_size);
+      fclose(f);
+    }
+  }
+  return logical_size;
+}
+
+// Find or create the metadata record of a stored object. A new (or stale) record learns how the
+// object is stored from the file itself, so the logical size isn't lost.
+static objmeta_t *fs_object_record(const char *path)
+{
+  objmeta_t *record = objmetaUpdate(path);
+  if (record == nullptr || record->flags != 0) {
+    return record;
+  }
+  uint32_t logical_size;
+  if (fs_dedup_is_reference(path, &logical_size)) {
+    record->flags |= OBJMETA_REFERENCE;
+    record->logical_size = logical_size;
+    return record;
+  }
+  FILE *f = fopen(path, "r");
+  if (f != nullptr) {
+    if (zfileProbe(f, &logical_size)) {
+      record->flags |= OBJMETA_COMPRESSED;
+      record->logical_size = logical_size;
+    }
+    fclose(f);
+  }
+  return record;
+}
+
+// Whether size more bytes fit on the storage
+static bool fs_has_space(size_t size)
+{
+  size_t capacity_bytes, used_bytes;
   esp_littlefs_info("littlefs", &capacity_bytes, &used_bytes);
-  if (capacity_bytes - used_bytes < size) {
+  // Space held for uploads the host announced isn't free
+  return capacity_bytes - used_bytes >= (uint64_t)fs_reserved_bytes() + size;
+}
+
+static bool fs_can_create_file(fs_handletable *handle_table, size_t size)
+{
+  if (handle_table->handles_used == MTP_HANDLE_TABLE_SIZE) {
     return false;
   }
-  return true;
+  return fs_has_space(size);
 }
 
 static fs_handle_t fs_create_file(fs_handletable *handle_table, fs_handle_t parent_handle, const char *name)
@@ -367,19 +738,35 @@ static fs_handle_t fs_create_file(fs_handletable *handle_table, fs_handle_t pare
 
   fs_handle_t handle = fs_assign_new_handle();
 
-  current_file = fopen(pathbuf, "w");
+  if (current_file != nullptr) {
+    fs_close_handle(current_handle, current_file);
+  }
+  // An existing object stays as it is until the upload replacing it is complete
+  struct stat stat_buf;
+  const bool replacing = stat(pathbuf, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode);
+  if (!replacing) {
+    fs_shard_prepare(pathbuf);
+  }
+  fs_block_cache_invalidate(pathbuf);
+  current_file = replacing ? fs_shadow_create(pathbuf) : filepoolOpen(pathbuf, "w");
   if (current_file == nullptr) {
     ESP_LOGE("MtpFS", "fs_create_file failed to open file in write mode: %s", pathbuf);
     return FS_INVALID_HANDLE;
   }
+  current_shadowed = replacing;
+  lfstuneRecord(LFSTUNE_OP_CREATE, 0);
 
   auto entry = &handle_table->handles[handle_slot];
+  fs_index_write_begin();
   entry->parent_handle = parent_handle;
   entry->handle = handle;
+  entry->is_dir = false;
   strlcpy(entry->name, name, MTP_FILENAME_LENGTH);
 
   current_handle = handle;
   handle_table->handles_used++;
+  fs_index_write_end();
+  fs_gc_changed(parent_handle);
   MTP_ESP_LOG("MtpFS", "Created file for write, handle=%d, path=%s", handle, pathbuf);
   return handle;
 }
@@ -390,10 +777,17 @@ static void fs_close_handle(fs_handle_t handle, FILE *file)
     ESP_LOGE("MtpFS", "fs_close_handle check fail: mismatched state");
     return;
   }
+  fs_writeback_end();
 
-  fclose(file);
+  if (!current_reading || !fs_file_cache_put(handle, file, current_file_size, current_compressed)) {
+    filepoolClose(file);
+  }
   current_handle = FS_INVALID_HANDLE;
   current_file = nullptr;
+  current_compressed = false;
+  current_shadowed = false;
+  current_reading = false;
+  fs_block_cache_release();
 }
 
 static int fs_delete_handle(fs_handletable *handle_table, fs_handle_t handle)
@@ -401,14 +795,43 @@ static int fs_delete_handle(fs_handletable *handle_table, fs_handle_t handle)
   for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE; ii++) {
     auto entry = &handle_table->handles[ii];
     if (entry->handle == handle && entry->name[0] != '\0') {
+      fs_file_cache_drop(handle);
+      fs_reserve_release(handle);
+      fs_gc_changed(entry->parent_handle);
+      fs_index_write_begin();
       entry->name[0] = '\0';
       handle_table->handles_used--;
+      fs_index_write_end();
       return 0;
     }
   }
   return -ENOENT;
 }
 
+//--------------------------------------------------------------------+
+// Extensions
+//--------------------------------------------------------------------+
+#include "usb_mtp_filecache.c.h"
+#include "usb_mtp_blockcache.c.h"
+#include "usb_mtp_writeback.c.h"
+#include "usb_mtp_delta.c.h"
+#include "usb_mtp_digest.c.h"
+#include "usb_mtp_dedup.c.h"
+#include "usb_mtp_image.c.h"
+#include "usb_mtp_shadow.c.h"
+#include "usb_mtp_resume.c.h"
+#include "usb_mtp_exec.c.h"
+#include "usb_mtp_sync.c.h"
+#include "usb_mtp_index.c.h"
+#include "usb_mtp_cancel.c.h"
+#include "usb_mtp_prefetch.c.h"
+#include "usb_mtp_gc.c.h"
+#include "usb_mtp_shard.c.h"
+#include "usb_mtp_tune.c.h"
+#include "usb_mtp_dataset.c.h"
+#include "usb_mtp_constant.c.h"
+#include "usb_mtp_reserve.c.h"
+
 //--------------------------------------------------------------------+
 // Control Request callback
 //--------------------------------------------------------------------+
@@ -417,11 +840,60 @@ bool tud_mtp_request_cancel_cb(tud_mtp_request_cb_data_t* cb_data) {
   memcpy(&cancel_data, cb_data->buf, sizeof(cancel_data));
   (void) cancel_data.code;
   (void ) cancel_data.transaction_id;
-  // Dump the file currently working on.
-  fs_close_handle(current_handle, current_file);
+  // Only stop things here, flash work happens while the host polls the device status
+  fs_cancel_begin();
   return true;
 }
 
+// Invoked when the device is unmounted: cable pulled or host gone. The host opens a new session
+// when it comes back.
+void tud_umount_cb(void) {
+  fs_cancel_begin();
+  fs_cancel_run(0);
+  fs_file_cache_flush();
+  if (is_session_opened) {
+    is_session_opened = false;
+    handle_self_inc = 0;
+  }
+}
+
+void mtpInit(void) {
+  fs_sync_init();
+  fs_block_cache_init();
+  fs_writeback_init();
+}
+
+void mtpLoadStorage(void) {
+  fs_handletable_regenerate(&handle_table);
+  objmetaLoad("/littlefs");
+  fs_dedup_load();
+  fs_resume_load();
+  index_preloaded = true;
+  atomic_store_explicit(&storage_ready, true, memory_order_release);
+}
+
+static bool fs_storage_ready(void)
+{
+  return atomic_load_explicit(&storage_ready, memory_order_acquire);
+}
+
+uint32_t mtpPoll(void) {
+  if (!fs_storage_ready()) {
+    return MTP_POLL_INTERVAL_MS;
+  }
+  fs_cancel_run(0);
+  fs_resume_expire();
+  // Come back right after the next USB events while a background job or firmware changes have
+  // work left
+  bool idle = fs_exec_run(CFG_EXAMPLE_MTP_EXEC_SLICE_US);
+  idle = fs_sync_poll() && idle;
+  idle = fs_prefetch_run() && idle;
+  idle = fs_delta_poll() && idle;
+  idle = fs_dedup_poll() && idle;
+  idle = fs_gc_run() && idle;
+  return idle ? MTP_POLL_INTERVAL_MS : 0;
+}
+
 // Invoked when received Device Reset request
 // return false to stall the request
 bool tud_mtp_request_device_reset_cb(tud_mtp_request_cb_data_t* cb_data) {
@@ -441,27 +913,92 @@ int32_t tud_mtp_request_get_extended_event_cb(tud_mtp_request_cb_data_t* cb_data
 int32_t tud_mtp_request_get_device_status_cb(tud_mtp_request_cb_data_t* cb_data) {
   uint16_t* buf16 = (uint16_t*)(uintptr_t) cb_data->buf;
   buf16[0] = 4; // length
-  buf16[1] = MTP_RESP_OK; // status
+  // Busy until the cleanup after a Cancel is done (each poll moves it along a bit), and while a
+  // background job is running
+  const bool idle = fs_storage_ready() && fs_cancel_run(CFG_EXAMPLE_MTP_CANCEL_BUDGET_US) && !fs_exec_busy();
+  buf16[1] = idle ? MTP_RESP_OK : MTP_RESP_DEVICE_BUSY; // status
   return 4;
 }
 
+//--------------------------------------------------------------------+
+// Allocation check
+//--------------------------------------------------------------------+
+#if CFG_EXAMPLE_MTP_ALLOC_CHECK
+#if !CONFIG_HEAP_USE_HOOKS
+  #error "CFG_EXAMPLE_MTP_ALLOC_CHECK needs CONFIG_HEAP_USE_HOOKS"
+#endif
+#include <stdlib.h>
+#include "tasks.h"
+
+static atomic_uint alloc_check_count;
+static unsigned alloc_check_mid;      // Of the current transfer, in packets that must not allocate
+static unsigned alloc_check_exempt;   // Of the current transfer, in packets that may
+
+// Called by the heap for every allocation
+void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+  (void) ptr;
+  (void) size;
+  (void) caps;
+  if (xTaskGetCurrentTaskHandle() == hTaskTinyusb) {
+    atomic_fetch_add_explicit(&alloc_check_count, 1, memory_order_relaxed);
+  }
+}
+
+void esp_heap_trace_free_hook(void* ptr) {
+  (void) ptr;
+}
+
+static unsigned fs_alloc_check_begin(void) {
+  return atomic_load_explicit(&alloc_check_count, memory_order_relaxed);
+}
+
+// A packet that neither ended the transfer (the file is still open) nor made a checkpoint must not
+// have allocated anything. Failing loudly makes the check usable in a test run.
+static void fs_alloc_check_end(unsigned start, uint16_t op_code, uint32_t checkpoint_before) {
+  const unsigned count = atomic_load_explicit(&alloc_check_count, memory_order_relaxed) - start;
+  if (current_file != nullptr && upload_state.last_checkpoint == checkpoint_before) {
+    alloc_check_mid += count;
+  } else {
+    alloc_check_exempt += count;
+  }
+  if (alloc_check_mid > 0) {
+    ESP_LOGE("MtpAlloc", "Data phase of %04X made %u allocations mid-transfer", op_code, count);
+    abort();
+  }
+}
+
+// The data phase is over: log the counts, pytest_mtp_alloc.py looks for them
+static void fs_alloc_check_report(uint16_t op_code) {
+  ESP_LOGI("MtpAlloc", "Data phase of %04X done: %u allocations mid-transfer, %u at its ends",
+           op_code, alloc_check_mid, alloc_check_exempt);
+  alloc_check_mid = 0;
+  alloc_check_exempt = 0;
+}
+#endif
+
 //--------------------------------------------------------------------+
 // Bulk Only Protocol
 //--------------------------------------------------------------------+
 int32_t tud_mtp_command_received_cb(tud_mtp_cb_data_t* cb_data) {
   const mtp_container_command_t* command = cb_data->command_container;
   mtp_container_info_t* io_container = &cb_data->io_container;
-  fs_op_handler_t handler = NULL;
-  for (size_t i = 0; i < TU_ARRAY_SIZE(fs_op_handler_dict); i++) {
-    if (fs_op_handler_dict[i].op_code == command->header.code) {
-      handler = fs_op_handler_dict[i].handler;
-      break;
-    }
+  fs_gc_host_active();
+  // The host didn't wait for the device to become idle after a Cancel
+  if (fs_storage_ready()) {
+    fs_cancel_run(0);
   }
 
+  const fs_op_handler_t handler = fs_op_handler(command->header.code);
+
   int32_t resp_code;
   if (handler == NULL) {
     resp_code = MTP_RESP_OPERATION_NOT_SUPPORTED;
+  } else if (fs_exec_busy() || (!fs_storage_ready() && command->header.code != MTP_OP_GET_DEVICE_INFO)) {
+    // The host didn't wait for the response of the operation still running, or for the storage to
+    // be mounted
+    resp_code = MTP_RESP_DEVICE_BUSY;
+    io_container->header->code = (uint16_t)resp_code;
+    tud_mtp_response_send(io_container);
   } else {
     resp_code = handler(cb_data);
     if (resp_code > MTP_RESP_UNDEFINED) {
@@ -477,20 +1014,26 @@ int32_t tud_mtp_command_received_cb(tud_mtp_cb_data_t* cb_data) {
 int32_t tud_mtp_data_xfer_cb(tud_mtp_cb_data_t* cb_data) {
   const mtp_container_command_t* command = cb_data->command_container;
   mtp_container_info_t* io_container = &cb_data->io_container;
-
-  fs_op_handler_t handler = NULL;
-  for (size_t i = 0; i < TU_ARRAY_SIZE(fs_op_handler_dict); i++) {
-    if (fs_op_handler_dict[i].op_code == command->header.code) {
-      handler = fs_op_handler_dict[i].handler;
-      break;
-    }
+  fs_gc_host_active();
+  if (cancel_state.pending) {
+    // Stragglers of the cancelled transaction
+    return 0;
   }
 
+  const fs_op_handler_t handler = fs_op_handler(command->header.code);
+
   int32_t resp_code;
   if (handler == NULL) {
     resp_code = MTP_RESP_OPERATION_NOT_SUPPORTED;
   } else {
+#if CFG_EXAMPLE_MTP_ALLOC_CHECK
+    const unsigned alloc_start = fs_alloc_check_begin();
+    const uint32_t checkpoint_before = upload_state.last_checkpoint;
+#endif
     resp_code = handler(cb_data);
+#if CFG_EXAMPLE_MTP_ALLOC_CHECK
+    fs_alloc_check_end(alloc_start, command->header.code, checkpoint_before);
+#endif
     if (resp_code > MTP_RESP_UNDEFINED) {
       // send response if needed
       io_container->header->code = (uint16_t)resp_code;
@@ -504,6 +1047,9 @@ int32_t tud_mtp_data_xfer_cb(tud_mtp_cb_data_t* cb_data) {
 int32_t tud_mtp_data_complete_cb(tud_mtp_cb_data_t* cb_data) {
   const mtp_container_command_t* command = cb_data->command_container;
   mtp_container_info_t* resp = &cb_data->io_container;
+#if CFG_EXAMPLE_MTP_ALLOC_CHECK
+  fs_alloc_check_report(command->header.code);
+#endif
   switch (command->header.code) {
     case MTP_OP_SEND_OBJECT_INFO: {
       auto entry = fs_get_handle_entry(&handle_table, current_handle);
@@ -519,6 +1065,31 @@ int32_t tud_mtp_data_complete_cb(tud_mtp_cb_data_t* cb_data) {
       break;
     }
 
+    case MTP_OP_SEND_OBJECT:
+    case MTP_OP_ANDROID_SEND_PARTIAL_OBJECT:
+      if (cb_data->xfer_result == XFER_RESULT_SUCCESS && upload_state.active && fs_dedup_busy()) {
+        // Held back data is still being written out, a job finishes the upload and responds
+        const int32_t resp_code = fs_exec_start(cb_data, "SendObject", fs_upload_finish_step);
+        if (resp_code == 0) {
+          return 0;
+        }
+        resp->header->code = (uint16_t)resp_code;
+        break;
+      }
+      // Data lost on the way to flash fails the upload even though the transfer went fine
+      resp->header->code = (cb_data->xfer_result == XFER_RESULT_SUCCESS) ? upload_state.result : MTP_RESP_GENERAL_ERROR;
+      break;
+
+    case MTP_OP_VENDOR_APPLY_DELTA: {
+      const int32_t resp_code = fs_delta_complete(cb_data);
+      if (resp_code == 0) {
+        // The rest of the work runs as a job, which responds
+        return 0;
+      }
+      resp->header->code = (uint16_t)resp_code;
+      break;
+    }
+
     default:
       resp->header->code = (cb_data->xfer_result == XFER_RESULT_SUCCESS) ? MTP_RESP_OK : MTP_RESP_GENERAL_ERROR;
       break;
@@ -539,17 +1110,8 @@ int32_t tud_mtp_response_complete_cb(tud_mtp_cb_data_t* cb_data) {
 static int32_t fs_get_device_info(tud_mtp_cb_data_t* cb_data) {
   // Device info is already prepared up to playback formats. Application only need to add string fields
   mtp_container_info_t* io_container = &cb_data->io_container;
-  mtp_container_add_cstring(io_container, DEV_INFO_MANUFACTURER);
-  mtp_container_add_cstring(io_container, DEV_INFO_MODEL);
-  mtp_container_add_cstring(io_container, DEV_INFO_VERSION);
-
-  enum { MAX_SERIAL_NCHARS = 32 };
-  uint16_t serial_utf16[MAX_SERIAL_NCHARS+1];
-  utilGetMacAddressNoDelimiterUtf16le(serial_utf16);
-  serial_utf16[tu_min32(12, MAX_SERIAL_NCHARS)] = 0; // ensure null termination
-  mtp_container_add_string(io_container, serial_utf16);
-
-  tud_mtp_data_send(io_container);
+  fs_const_prepare();
+  fs_const_send(io_container, const_resp.device_info, const_resp.device_info_len);
   return 0;
 }
 
@@ -561,23 +1123,36 @@ static int32_t fs_open_close_session(tud_mtp_cb_data_t* cb_data) {
     }
     is_session_opened = true;
 
-    // Upon session open, we regenerate the handle table
-    fs_handletable_regenerate(&handle_table);
+    // Upon session open, we regenerate the handle table, unless the one built at boot is still fresh
+    if (index_preloaded) {
+      index_preloaded = false;
+    } else {
+      fs_file_cache_flush();
+      fs_handletable_regenerate(&handle_table);
+      objmetaLoad("/littlefs");
+      fs_dedup_load();
+      fs_resume_load();
+    }
   } else { // close session
     if (!is_session_opened) {
       return MTP_RESP_SESSION_NOT_OPEN;
     }
     is_session_opened = false;
     handle_self_inc = 0;
+    fs_reserve_release(FS_INVALID_HANDLE);
+    objmetaSave();
+    fs_file_cache_flush();
+    fs_file_cache_log_stats();
+    fs_prefetch_log_stats();
+    fs_block_cache_log_stats();
+    flashioLogStats();
   }
   return MTP_RESP_OK;
 }
 
 static int32_t fs_get_storage_ids(tud_mtp_cb_data_t* cb_data) {
   mtp_container_info_t* io_container = &cb_data->io_container;
-  uint32_t storage_ids [] = { SUPPORTED_STORAGE_ID };
-  mtp_container_add_auint32(io_container, 1, storage_ids);
-  tud_mtp_data_send(io_container);
+  fs_const_send(io_container, fs_const_storage_ids, sizeof(fs_const_storage_ids));
   return 0;
 }
 
@@ -591,7 +1166,8 @@ static int32_t fs_get_storage_info(tud_mtp_cb_data_t* cb_data) {
   esp_littlefs_info("littlefs", &capacity_bytes, &used_bytes);
   storage_info.max_capacity_in_bytes = capacity_bytes;
   storage_info.free_space_in_objects = MTP_HANDLE_TABLE_SIZE - handle_table.handles_used;
-  storage_info.free_space_in_bytes = capacity_bytes - used_bytes;
+  const uint64_t reserved = fs_reserved_bytes();
+  storage_info.free_space_in_bytes = capacity_bytes - used_bytes > reserved ? capacity_bytes - used_bytes - reserved : 0;
   mtp_container_add_raw(io_container, &storage_info, sizeof(storage_info));
   tud_mtp_data_send(io_container);
   return 0;
@@ -601,20 +1177,13 @@ static int32_t fs_get_device_properties(tud_mtp_cb_data_t* cb_data) {
   const mtp_container_command_t* command = cb_data->command_container;
   mtp_container_info_t* io_container = &cb_data->io_container;
   const uint16_t dev_prop_code = (uint16_t) command->params[0];
+  fs_const_prepare();
 
   if (command->header.code == MTP_OP_GET_DEVICE_PROP_DESC) {
     // get describing dataset
-    mtp_device_prop_desc_header_t device_prop_header;
-    device_prop_header.device_property_code = dev_prop_code;
     switch (dev_prop_code) {
       case MTP_DEV_PROP_DEVICE_FRIENDLY_NAME:
-        device_prop_header.datatype = MTP_DATA_TYPE_STR;
-        device_prop_header.get_set = MTP_MODE_GET;
-        mtp_container_add_raw(io_container, &device_prop_header, sizeof(device_prop_header));
-        mtp_container_add_cstring(io_container, DEV_PROP_FRIENDLY_NAME); // factory
-        mtp_container_add_cstring(io_container, DEV_PROP_FRIENDLY_NAME); // current
-        mtp_container_add_uint8(io_container, 0); // no form
-        tud_mtp_data_send(io_container);
+        fs_const_send(io_container, const_resp.friendly_name_desc, const_resp.friendly_name_desc_len);
         break;
 
       default:
@@ -624,8 +1193,7 @@ static int32_t fs_get_device_properties(tud_mtp_cb_data_t* cb_data) {
     // get value
     switch (dev_prop_code) {
       case MTP_DEV_PROP_DEVICE_FRIENDLY_NAME:
-        mtp_container_add_cstring(io_container, DEV_PROP_FRIENDLY_NAME);
-        tud_mtp_data_send(io_container);
+        fs_const_send(io_container, const_resp.friendly_name, const_resp.friendly_name_len);
         break;
 
       default:
@@ -635,6 +1203,25 @@ static int32_t fs_get_device_properties(tud_mtp_cb_data_t* cb_data) {
   return 0;
 }
 
+// Hands out the handles of the children of parent, in handle table order
+typedef struct {
+  fs_handle_t parent;
+  size_t slot;
+} fs_handle_cursor_t;
+
+static void fs_handle_cursor_next(void *ctx, uint32_t index, uint32_t *value)
+{
+  fs_handle_cursor_t *cursor = ctx;
+  (void)index;
+  while (cursor->slot < MTP_HANDLE_TABLE_SIZE) {
+    const fs_handletable_entry_t *entry = &handle_table.handles[cursor->slot++];
+    if (entry->parent_handle == cursor->parent && entry->name[0] != '\0' && !fs_shadow_hidden(entry)) {
+      *value = entry->handle;
+      return;
+    }
+  }
+}
+
 static int32_t fs_get_object_handles(tud_mtp_cb_data_t* cb_data) {
   // `ls /<folder_in_question>`
   const mtp_container_command_t* command = cb_data->command_container;
@@ -649,19 +1236,27 @@ static int32_t fs_get_object_handles(tud_mtp_cb_data_t* cb_data) {
     return MTP_RESP_INVALID_STORAGE_ID;
   }
 
-  fs_handle_t handle = (parent_handle == 0xFFFFFFFF) ? 0 : parent_handle;
-
-  uint32_t handles[MTP_HANDLE_TABLE_SIZE] = { 0 };
-  uint32_t count = 0;
-  for (uint8_t i = 0; i < MTP_HANDLE_TABLE_SIZE; i++) {
-    if (handle_table.handles[i].parent_handle == handle &&
-        handle_table.handles[i].name[0] != '\0') {
-      handles[count++] = handle_table.handles[i].handle;
+  // The array is produced as it is sent, a packet at a time
+  static fs_handle_cursor_t cursor;
+  static dataset_field_t fields[] = {
+    { .type = DATASET_ARRAY_U32, .element = fs_handle_cursor_next, .ctx = &cursor },
+  };
+  if (cb_data->phase == MTP_PHASE_COMMAND) {
+    cursor.parent = (parent_handle == 0xFFFFFFFF) ? 0 : parent_handle;
+    cursor.slot = 0;
+    uint32_t count = 0;
+    for (size_t i = 0; i < MTP_HANDLE_TABLE_SIZE; i++) {
+      if (handle_table.handles[i].parent_handle == cursor.parent &&
+          handle_table.handles[i].name[0] != '\0' && !fs_shadow_hidden(&handle_table.handles[i])) {
+        count++;
+      }
     }
+    fields[0].len = count;
+    MTP_ESP_LOG("MtpImpl", "Reported %d objects in %d", count, cursor.parent);
+    fs_dataset_send(io_container, fields, TU_ARRAY_SIZE(fields));
+  } else if (cb_data->phase == MTP_PHASE_DATA) {
+    fs_dataset_send_more(io_container);
   }
-  MTP_ESP_LOG("MtpImpl", "Reported %d objects in root", count);
-  mtp_container_add_auint32(io_container, count, handles);
-  tud_mtp_data_send(io_container);
 
   return 0;
 }
@@ -671,6 +1266,21 @@ static int32_t fs_get_object_info(tud_mtp_cb_data_t* cb_data) {
   const mtp_container_command_t* command = cb_data->command_container;
   mtp_container_info_t* io_container = &cb_data->io_container;
   const uint32_t obj_handle = command->params[0];
+  // Encoded as it is sent: a long name may end up in the next packet
+  static mtp_object_info_header_t obj_info_header;
+  static char name[MTP_FILENAME_LENGTH];
+  static const dataset_field_t fields[] = {
+    { .type = DATASET_RAW, .data = &obj_info_header, .len = sizeof(obj_info_header) },
+    { .type = DATASET_STRING, .data = name },
+    { .type = DATASET_STRING, .data = (void *)FS_FIXED_DATETIME },  // date created
+    { .type = DATASET_STRING, .data = (void *)FS_FIXED_DATETIME },  // date modified
+    { .type = DATASET_STRING, .data = nullptr },                    // keywords, not used
+  };
+  if (cb_data->phase == MTP_PHASE_DATA) {
+    fs_dataset_send_more(io_container);
+    return 0;
+  }
+
   struct stat stat_buf;
   fs_handletable_entry_t *entry = nullptr;
   int retval = fs_stat_handle(&handle_table, obj_handle, &stat_buf, &entry);
@@ -678,33 +1288,33 @@ static int32_t fs_get_object_info(tud_mtp_cb_data_t* cb_data) {
     ESP_LOGE("MtpImpl", "Failed to stat handle %d: returned %d", obj_handle, retval);
     return MTP_RESP_INVALID_OBJECT_HANDLE;
   }
-  uint16_t utf16_filename[MTP_FILENAME_LENGTH];
-  auto write_count = utf8_to_utf16((uint8_t *)entry->name, strlen(entry->name), utf16_filename, MTP_FILENAME_LENGTH);
-  utf16_filename[TU_MIN(write_count, MTP_FILENAME_LENGTH)] = 0;
-  mtp_object_info_header_t obj_info_header = {
+  char pathbuf[200];
+  fs_path_from_handle(&handle_table, obj_handle, pathbuf, sizeof(pathbuf));
+  const uint32_t object_size = fs_object_size(&handle_table, entry, pathbuf, &stat_buf);
+  imginfo_t image = { 0 };
+  if (!entry->is_dir && !fs_image_info(obj_handle, pathbuf, &image)) {
+    MTP_ESP_LOG("MtpImpl", "No image info for %s yet", pathbuf);
+  }
+  strlcpy(name, entry->name, sizeof(name));
+  obj_info_header = (mtp_object_info_header_t) {
     .storage_id = SUPPORTED_STORAGE_ID,
-    .object_format = MTP_OBJ_FORMAT_UNDEFINED,
+    .object_format = entry->is_dir ? MTP_OBJ_FORMAT_ASSOCIATION : fs_image_mtp_format(image.format),
     .protection_status =  MTP_PROTECTION_STATUS_NO_PROTECTION,
-    .object_compressed_size = stat_buf.st_size,
-    .thumb_format = MTP_OBJ_FORMAT_UNDEFINED,
-    .thumb_compressed_size = 0,
-    .thumb_pix_width = 0,
-    .thumb_pix_height = 0,
-    .image_pix_width = 0,
-    .image_pix_height = 0,
-    .image_bit_depth = 0,
+    .object_compressed_size = object_size,
+    .thumb_format = fs_image_mtp_format(image.thumb_format),
+    .thumb_compressed_size = image.thumb_size,
+    .thumb_pix_width = image.thumb_width,
+    .thumb_pix_height = image.thumb_height,
+    .image_pix_width = image.width,
+    .image_pix_height = image.height,
+    .image_bit_depth = image.bit_depth,
     .parent_object = entry->parent_handle,
     .association_type = entry->is_dir ? MTP_ASSOCIATION_GENERIC_FOLDER : MTP_ASSOCIATION_UNDEFINED,
     .association_desc = 0,
     .sequence_number = 0
   };
-  mtp_container_add_raw(io_container, &obj_info_header, sizeof(obj_info_header));
-  mtp_container_add_string(io_container, utf16_filename);
-  mtp_container_add_cstring(io_container, FS_FIXED_DATETIME);
-  mtp_container_add_cstring(io_container, FS_FIXED_DATETIME);
-  mtp_container_add_cstring(io_container, ""); // keywords, not used
-  tud_mtp_data_send(io_container);
-  MTP_ESP_LOG("MtpImpl", "Reported %d: %s, size=%d", obj_handle, entry->name, stat_buf.st_size);
+  fs_dataset_send(io_container, fields, TU_ARRAY_SIZE(fields));
+  MTP_ESP_LOG("MtpImpl", "Reported %d: %s, size=%d", obj_handle, entry->name, object_size);
 
   return 0;
 }
@@ -736,6 +1346,7 @@ static int32_t fs_get_object(tud_mtp_cb_data_t* cb_data) {
   }
 #elif 1
   if (cb_data->phase == MTP_PHASE_COMMAND) {
+    fs_prefetch_begin(obj_handle);
     // If file contents is larger than CFG_TUD_MTP_EP_BUFSIZE, data may only partially is added here
     // the rest will be sent in tud_mtp_data_more_cb
     // Rants: TinyUSB MTP design is slightly annoying, it assumed your entire file to transfer is
@@ -749,7 +1360,7 @@ static int32_t fs_get_object(tud_mtp_cb_data_t* cb_data) {
     // not gonna fit in the MTP packet's remaining space if our file is larger than the free space,
     // and when the file's smaller than that we're totally fine then.
     char first_time_buffer[CFG_TUD_MTP_EP_BUFSIZE];
-    fread(first_time_buffer, 1, TU_MIN(CFG_TUD_MTP_EP_BUFSIZE, current_file_size), current_file);
+    fs_read_current(0, first_time_buffer, TU_MIN(CFG_TUD_MTP_EP_BUFSIZE, current_file_size));
     auto bytes_queued = mtp_container_add_raw(io_container, first_time_buffer, current_file_size);
     MTP_ESP_LOG("MtpImpl", "%s: responded %d bytes", __func__, bytes_queued);
     tud_mtp_data_send(io_container);
@@ -758,11 +1369,14 @@ static int32_t fs_get_object(tud_mtp_cb_data_t* cb_data) {
     const uint32_t offset = cb_data->total_xferred_bytes - sizeof(mtp_container_header_t);
     const uint32_t xact_len = tu_min32(current_file_size - offset, io_container->payload_bytes);
     if (xact_len > 0) {
-      fseek(current_file, offset, SEEK_SET);
       uint8_t *write_ptr = io_container->payload;
       auto remaining_len = xact_len;
       while (remaining_len) {
-        auto bytes_read = fread(write_ptr, 1, remaining_len, current_file);
+        auto bytes_read = fs_read_current(offset + (write_ptr - io_container->payload), write_ptr, remaining_len);
+        if (bytes_read == 0) {
+          ESP_LOGE("MtpImpl", "%s: short read at %d", __func__, offset);
+          break;
+        }
         remaining_len -= bytes_read;
         write_ptr += bytes_read;
         MTP_ESP_LOG("MtpImpl", "%s: fread read %d bytes, %d left", __func__, bytes_read, remaining_len);
@@ -771,7 +1385,9 @@ static int32_t fs_get_object(tud_mtp_cb_data_t* cb_data) {
       MTP_ESP_LOG("MtpImpl", "%s: responded %d bytes at %d", __func__, xact_len, offset);
     }
     if (offset + xact_len >= current_file_size) {
+      lfstuneRecord(LFSTUNE_OP_READ, current_file_size);
       fs_close_handle(obj_handle, current_file);
+      fs_prefetch_end(obj_handle);
       MTP_ESP_LOG("MtpImpl", "File read completed, closing");
     }
   }
@@ -798,11 +1414,30 @@ static int32_t fs_send_object_info(tud_mtp_cb_data_t* cb_data) {
     return MTP_RESP_INVALID_STORAGE_ID;
   }
 
+  // The dataset may take more than one packet, with a long name or keywords: it is decoded as it
+  // arrives, and looked at once complete
+  static mtp_object_info_header_t obj_info_buf;
+  static char filename[MTP_FILENAME_LENGTH];
+  static const dataset_field_t fields[] = {
+    { .type = DATASET_RAW, .data = &obj_info_buf, .len = sizeof(obj_info_buf) },
+    { .type = DATASET_STRING, .data = filename, .len = sizeof(filename) },
+    { .type = DATASET_STRING, .data = nullptr },  // date created
+    { .type = DATASET_STRING, .data = nullptr },  // date modified
+    { .type = DATASET_STRING, .data = nullptr },  // keywords
+  };
+
   if (cb_data->phase == MTP_PHASE_COMMAND) {
     MTP_ESP_LOG("MtpImpl", "%s: command phase, receive first", __func__);
-    tud_mtp_data_receive(io_container);
+    fs_dataset_receive(io_container, fields, TU_ARRAY_SIZE(fields));
   } else if (cb_data->phase == MTP_PHASE_DATA) {
-    mtp_object_info_header_t* obj_info = (mtp_object_info_header_t*) io_container->payload;
+    if (!fs_dataset_receive_more(cb_data)) {
+      return 0;
+    }
+    if (fs_dataset.field < 2) {
+      ESP_LOGE("MtpImpl", "%s: ObjectInfo ends before the file name", __func__);
+      return MTP_RESP_INCOMPLETE_TRANSFER;
+    }
+    const mtp_object_info_header_t* obj_info = &obj_info_buf;
     if (obj_info->storage_id != 0 && obj_info->storage_id != SUPPORTED_STORAGE_ID) {
       MTP_ESP_LOG("MtpImpl", "%s: data phase: invalid storage ID %08X", __func__, obj_info->storage_id);
       return MTP_RESP_INVALID_STORAGE_ID;
@@ -822,36 +1457,38 @@ static int32_t fs_send_object_info(tud_mtp_cb_data_t* cb_data) {
     }
 
     if (obj_info->association_type == MTP_ASSOCIATION_UNDEFINED) {
-      // Regular file
+      // Regular file. An upload the host abandoned for this one stays resumable, and the space held
+      // for an earlier SendObjectInfo is no longer needed.
+      fs_upload_interrupt();
+      fs_reserve_release(FS_INVALID_HANDLE);
       if (!fs_can_create_file(&handle_table, obj_info->object_compressed_size)) {
         return MTP_RESP_STORE_FULL;
       }
-      char filename[MTP_FILENAME_LENGTH];
-      uint8_t* filename_buf = io_container->payload + sizeof(mtp_object_info_header_t);
-      auto filename_len = *filename_buf;
-      auto u8_filename_len = utf16_to_utf8((const utf16_t *)(filename_buf + 1),
-                                           filename_len,
-                                           (utf8_t *)filename,
-                                           MTP_FILENAME_LENGTH);
-      MTP_ESP_LOG("MtpImpl", "UTF16->UTF8 Conversion: expected UTF16 length: %d, output %d bytes, string:[%s]",
-               filename_len, u8_filename_len, filename);
-      fs_create_file(&handle_table, parent_handle, filename);
+      MTP_ESP_LOG("MtpImpl", "%s: file name [%s]", __func__, filename);
+      if (parent_handle == 0 && strcmp(filename, FS_PRIVATE_DIR) == 0) {
+        return MTP_RESP_INVALID_PARAMETER;
+      }
+      if (fs_create_file(&handle_table, parent_handle, filename) == FS_INVALID_HANDLE) {
+        return MTP_RESP_GENERAL_ERROR;
+      }
+      fs_reserve(current_handle, obj_info->object_compressed_size);
       // Here the current_file_size is used to hold the length-to-receive value till the send_object phase
       current_file_size = obj_info->object_compressed_size;
+      if (fs_should_compress(&handle_table, parent_handle, filename)) {
+        current_compressed = zfileOpenWrite(&current_zfile, current_file, current_file_size);
+        MTP_ESP_LOG("MtpImpl", "%s: storing %s compressed", __func__, filename);
+      }
     } else if (obj_info->association_type == MTP_ASSOCIATION_GENERIC_FOLDER) {
       // Folder
       if (parent_handle != 0) {
         ESP_LOGE("MtpImpl", "Attempting to create folder in folder %d", parent_handle);
         return MTP_RESP_INVALID_PARENT_OBJECT;
       }
-      char dir_path[100] = "/littlefs/";
-      char *dir_name = dir_path + strlen(dir_path);
-      uint8_t* filename_buf = io_container->payload + sizeof(mtp_object_info_header_t);
-      auto filename_len = *filename_buf;
-      utf16_to_utf8((const utf16_t *)(filename_buf + 1),
-                    filename_len,
-                    (utf8_t *)dir_name,
-                    sizeof(dir_path) - (dir_name - dir_path) - 1);
+      if (strcmp(filename, FS_PRIVATE_DIR) == 0) {
+        return MTP_RESP_INVALID_PARAMETER;
+      }
+      char dir_path[100];
+      snprintf(dir_path, sizeof(dir_path), "/littlefs/%s", filename);
       mkdir(dir_path, 0777);
     } else {
       ESP_LOGE("MtpImpl", "Attempting to create unsupported association: %d", obj_info->association_type);
@@ -870,23 +1507,36 @@ static int32_t fs_send_object(tud_mtp_cb_data_t* cb_data) {
   }
 
   if (cb_data->phase == MTP_PHASE_COMMAND) {
+    char pathbuf[200];
+    fs_path_from_handle(&handle_table, current_handle, pathbuf, sizeof(pathbuf));
     io_container->header->len += current_file_size;
+    fs_digest_upload_begin();
+    fs_dedup_begin(current_handle, current_file_size);
+    fs_upload_begin(pathbuf, 0, current_file_size, current_compressed);
     tud_mtp_data_receive(io_container);
   } else if (cb_data->phase == MTP_PHASE_DATA) {
     // file contents offset is total xferred minus header size minus last received chunk
     // const uint32_t offset = cb_data->total_xferred_bytes - sizeof(mtp_container_header_t) - io_container->payload_bytes;
     // memcpy(f->data + offset, io_container->payload, io_container->payload_bytes);
-    fwrite(io_container->payload, 1, io_container->payload_bytes, current_file);
+    if (!fs_dedup_consume(io_container->payload, io_container->payload_bytes)) {
+      fs_write_current(io_container->payload, io_container->payload_bytes);
+    }
+    fs_upload_progress(io_container->payload_bytes);
     MTP_ESP_LOG("MtpImpl", "%s: data phase, written %d bytes to file", __func__, io_container->payload_bytes);
     if (cb_data->total_xferred_bytes - sizeof(mtp_container_header_t) < current_file_size) {
       MTP_ESP_LOG("MtpImpl", "%s: Starting new reception, %d bytes to go",
                __func__,
                current_file_size - cb_data->total_xferred_bytes + sizeof(mtp_container_header_t));
       MTP_ESP_LOG("MtpImpl", "%s: pcontainer->header->len = %d", __func__, io_container->header->len);
-      tud_mtp_data_receive(io_container);
-    } else {
+      if (fs_dedup_busy()) {
+        // Held back data is being written out, mtpPoll asks for the next packet after that
+        fs_dedup_wait(io_container);
+      } else {
+        tud_mtp_data_receive(io_container);
+      }
+    } else if (!fs_dedup_busy()) {
       MTP_ESP_LOG("MtpImpl", "%s: File write completed, closing", __func__);
-      fs_close_handle(current_handle, current_file);
+      fs_upload_finish();
     }
   } else {
     ESP_LOGE("MtpImpl", "%s: Unknown phase %d", __func__, cb_data->phase);
@@ -896,6 +1546,80 @@ static int32_t fs_send_object(tud_mtp_cb_data_t* cb_data) {
   return 0;
 }
 
+// Remove a file and everything kept about it. handle may be FS_INVALID_HANDLE for files that
+// didn't fit into the handle table.
+static bool fs_delete_file(fs_handle_t handle, const char *path)
+{
+  if (current_file != nullptr && current_handle == handle) {
+    fs_close_handle(current_handle, current_file);
+  }
+  fs_file_cache_drop(handle);
+  fs_block_cache_invalidate(path);
+  fs_image_forget(path);
+  // Its content may live on in a stub instead
+  const bool ok = fs_dedup_release(path) || unlink(path) == 0;
+  if (ok) {
+    lfstuneRecord(LFSTUNE_OP_DELETE, 0);
+  }
+  if (handle != FS_INVALID_HANDLE) {
+    fs_delete_handle(&handle_table, handle);
+  }
+  objmetaRemove(path);
+  return ok;
+}
+
+// DeleteObject runs in the background, one file per step: a folder may hold many
+static struct {
+  fs_handle_t handle;
+  bool is_dir;
+  bool partial;                   // Something couldn't be deleted
+  char path[200];
+} delete_job;
+
+static int32_t fs_delete_step(void)
+{
+  if (!delete_job.is_dir) {
+    if (!fs_delete_file(delete_job.handle, delete_job.path)) {
+      return MTP_RESP_GENERAL_ERROR;
+    }
+    return MTP_RESP_OK;
+  }
+
+  // Children known by handle first
+  for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE; ii++) {
+    auto entry = &handle_table.handles[ii];
+    char pathbuf[200];
+    if (entry->name[0] != '\0' && entry->parent_handle == delete_job.handle &&
+        fs_path_from_handle(&handle_table, entry->handle, pathbuf, sizeof(pathbuf))) {
+      delete_job.partial |= !fs_delete_file(entry->handle, pathbuf);
+      return 0;
+    }
+  }
+  // Then those that didn't fit into the handle table
+  fs_dir_t dir;
+  if (fs_dir_open(&dir, delete_job.path)) {
+    char pathbuf[200];
+    struct dirent *item = fs_dir_next(&dir, pathbuf, sizeof(pathbuf));
+    fs_dir_close(&dir);
+    if (item != nullptr) {
+      if (!fs_delete_file(FS_INVALID_HANDLE, pathbuf)) {
+        ESP_LOGE("MtpImpl", "Cannot delete %s", pathbuf);
+        delete_job.partial = true;
+        rmdir(delete_job.path);
+        return MTP_RESP_PARTIAL_DELETION;
+      }
+      return 0;
+    }
+  }
+
+  fs_shard_remove_dirs(delete_job.path);
+  if (delete_job.partial || rmdir(delete_job.path) != 0) {
+    return MTP_RESP_PARTIAL_DELETION;
+  }
+  fs_delete_handle(&handle_table, delete_job.handle);
+  return MTP_RESP_OK;
+}
+
 static int32_t fs_delete_object(tud_mtp_cb_data_t* cb_data) {
   const mtp_container_command_t* command = cb_data->command_container;
   const uint32_t obj_handle = command->params[0];
@@ -905,9 +1629,11 @@ static int32_t fs_delete_object(tud_mtp_cb_data_t* cb_data) {
   if (!is_session_opened) {
     return MTP_RESP_SESSION_NOT_OPEN;
   }
-  
-  char pathbuf[200];
-  if (!fs_path_from_handle(&handle_table, obj_handle, pathbuf, sizeof(pathbuf))) {
+  if (fs_exec_busy()) {
+    return MTP_RESP_DEVICE_BUSY;
+  }
+
+  if (!fs_path_from_handle(&handle_table, obj_handle, delete_job.path, sizeof(delete_job.path))) {
     return MTP_RESP_INVALID_OBJECT_HANDLE;
   }
 
@@ -915,17 +1641,12 @@ static int32_t fs_delete_object(tud_mtp_cb_data_t* cb_data) {
   fs_handletable_entry_t *entry;
   int retval = fs_stat_handle(&handle_table, obj_handle, &stat, &entry);
   if (retval != 0) {
-    ESP_LOGE("MtpImpl", "fs_delete_object failed to stat %s: %d", pathbuf, retval);
+    ESP_LOGE("MtpImpl", "fs_delete_object failed to stat %s: %d", delete_job.path, retval);
     return MTP_RESP_GENERAL_ERROR;
   }
 
-  if (stat.st_mode & S_IFDIR) {
-    // TODO: Is a directory, delete descendants
-    return MTP_RESP_OPERATION_NOT_SUPPORTED;
-  } else {
-    unlink(pathbuf);
-    fs_delete_handle(&handle_table, obj_handle);
-  }
-  
-  return MTP_RESP_OK;
+  delete_job.handle = obj_handle;
+  delete_job.is_dir = S_ISDIR(stat.st_mode);
+  delete_job.partial = false;
+  return fs_exec_start(cb_data, "DeleteObject", fs_delete_step);
 }
@@ -0,0 +1,90 @@
+// Object index snapshots for other tasks.
+//
+// Readers copy entries out of the handle table under the seqlock (see fs_index_write_begin): read
+// the sequence number, copy, and check that it's still the same and even. If the TinyUSB task
+// changed the table meanwhile, the copy is thrown away and taken again. Readers don't take any
+// lock, so the TinyUSB task never waits for them.
+
+// A reader that preempted the writer on the same core would spin forever; after this many tries
+// it sleeps for a tick to let the writer finish
+constexpr int INDEX_SPIN_TRIES = 8;
+
+static unsigned fs_index_read_begin(int *tries)
+{
+  unsigned seq;
+  while ((seq = atomic_load_explicit(&index_seq, memory_order_acquire)) & 1u) {
+    if (++*tries >= INDEX_SPIN_TRIES) {
+      vTaskDelay(1);
+    }
+  }
+  return seq;
+}
+
+static bool fs_index_read_retry(unsigned seq, int *tries)
+{
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&index_seq, memory_order_relaxed) == seq) {
+    return false;
+  }
+  if (++*tries >= INDEX_SPIN_TRIES) {
+    vTaskDelay(1);
+  }
+  return true;
+}
+
+static void fs_index_copy(const fs_handletable_entry_t *entry, mtp_object_t *object)
+{
+  object->handle = entry->handle;
+  object->parent_handle = entry->parent_handle;
+  object->is_dir = entry->is_dir;
+  memcpy(object->name, entry->name, MTP_FILENAME_LENGTH);
+  object->name[MTP_FILENAME_LENGTH - 1] = '\0';
+}
+
+uint32_t mtpIndexVersion(void) {
+  int tries = 0;
+  return fs_index_read_begin(&tries);
+}
+
+size_t mtpListObjects(mtp_object_t *objects, size_t max_objects, uint32_t *version) {
+  size_t count;
+  unsigned seq;
+  int tries = 0;
+  do {
+    seq = fs_index_read_begin(&tries);
+    count = 0;
+    for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE; ii++) {
+      const auto entry = &handle_table.handles[ii];
+      if (entry->name[0] == '\0') {
+        continue;
+      }
+      if (count < max_objects) {
+        fs_index_copy(entry, &objects[count]);
+      }
+      count++;
+    }
+  } while (fs_index_read_retry(seq, &tries));
+
+  if (version != nullptr) {
+    *version = seq;
+  }
+  return count;
+}
+
+bool mtpGetObject(uint32_t handle, mtp_object_t *object) {
+  bool found;
+  unsigned seq;
+  int tries = 0;
+  do {
+    seq = fs_index_read_begin(&tries);
+    found = false;
+    for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE && !found; ii++) {
+      const auto entry = &handle_table.handles[ii];
+      if (entry->name[0] != '\0' && entry->handle == handle) {
+        fs_index_copy(entry, object);
+        found = true;
+      }
+    }
+  } while (fs_index_read_retry(seq, &tries));
+  return found;
+}
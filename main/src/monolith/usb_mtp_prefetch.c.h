@@ -0,0 +1,155 @@
+// Prefetch for folder downloads.
+//
+// A host copying a folder off the device lists it with GetObjectHandles, then asks for the objects
+// one after another in the order they were listed, which is handle table order. When GetObject
+// follows that order, we guess that the next object in the folder comes next: once the current one
+// has been read to the end, mtpPoll opens the next one, parks it in the open file cache and reads
+// its first CFG_EXAMPLE_MTP_PREFETCH_BYTES into a buffer. Its GetObject then starts without
+// waiting for the flash.
+//
+// The buffer belongs to one handle and is forgotten together with the cache entries, so writes and
+// deletes invalidate it the same way. Compressed objects are opened but not read ahead.
+
+static struct {
+  fs_handle_t last;               // Object of the last GetObject
+  bool sequential;                // ... which was the one after the one before
+  fs_handle_t pending;            // To be prefetched by mtpPoll
+  fs_handle_t handle;             // Whose start is in head
+  size_t head_len;
+  uint32_t issued;
+  uint32_t used;
+  uint8_t head[CFG_EXAMPLE_MTP_PREFETCH_BYTES];
+} prefetch_state = {
+  .last = FS_INVALID_HANDLE,
+  .pending = FS_INVALID_HANDLE,
+  .handle = FS_INVALID_HANDLE,
+};
+
+// The file listed after handle in the same folder, or FS_INVALID_HANDLE
+static fs_handle_t fs_prefetch_next(fs_handle_t handle)
+{
+  int ii = 0;
+  while (ii < MTP_HANDLE_TABLE_SIZE &&
+         (handle_table.handles[ii].handle != handle || handle_table.handles[ii].name[0] == '\0')) {
+    ii++;
+  }
+  if (ii == MTP_HANDLE_TABLE_SIZE) {
+    return FS_INVALID_HANDLE;
+  }
+  const fs_handle_t parent_handle = handle_table.handles[ii].parent_handle;
+  for (ii++; ii < MTP_HANDLE_TABLE_SIZE; ii++) {
+    auto entry = &handle_table.handles[ii];
+    if (entry->name[0] != '\0' && entry->parent_handle == parent_handle) {
+      // The host asks for folders' contents first, that's where the pattern ends
+      return entry->is_dir ? FS_INVALID_HANDLE : entry->handle;
+    }
+  }
+  return FS_INVALID_HANDLE;
+}
+
+// GetObject of handle begins
+static void fs_prefetch_begin(fs_handle_t handle)
+{
+  if (handle == prefetch_state.handle) {
+    prefetch_state.used++;
+  }
+  prefetch_state.sequential = prefetch_state.last != FS_INVALID_HANDLE &&
+                              fs_prefetch_next(prefetch_state.last) == handle;
+  prefetch_state.last = handle;
+}
+
+// GetObject of handle read the last byte
+static void fs_prefetch_end(fs_handle_t handle)
+{
+  if (CFG_EXAMPLE_MTP_PREFETCH_BYTES > 0 && CFG_EXAMPLE_MTP_FILE_CACHE > 0 && prefetch_state.sequential) {
+    prefetch_state.pending = fs_prefetch_next(handle);
+  }
+}
+
+// Copy what was read ahead of [offset, offset + len) of handle into buf. Returns the number of
+// bytes copied, from offset on.
+static size_t fs_prefetch_copy(fs_handle_t handle, uint32_t offset, void *buf, size_t len)
+{
+  if (handle != prefetch_state.handle || offset >= prefetch_state.head_len) {
+    return 0;
+  }
+  const size_t copy_len = TU_MIN(len, prefetch_state.head_len - offset);
+  memcpy(buf, prefetch_state.head + offset, copy_len);
+  return copy_len;
+}
+
+// The content of handle changed, FS_INVALID_HANDLE for all. Called with file_cache_lock held.
+static void fs_prefetch_forget(fs_handle_t handle)
+{
+  if (handle == FS_INVALID_HANDLE || handle == prefetch_state.handle) {
+    prefetch_state.handle = FS_INVALID_HANDLE;
+    prefetch_state.head_len = 0;
+  }
+}
+
+// Open and read ahead the pending object. Returns true when there is nothing (more) to do.
+static bool fs_prefetch_run(void)
+{
+  const fs_handle_t handle = prefetch_state.pending;
+  if (handle == FS_INVALID_HANDLE) {
+    return true;
+  }
+  // Not while the transaction is still going or something else needs the flash. That can last a
+  // whole upload, so it waits for a later poll instead of keeping mtpPoll from idling.
+  if (fs_exec_busy() || cancel_state.pending || (current_file != nullptr && !current_reading)) {
+    return true;
+  }
+  prefetch_state.pending = FS_INVALID_HANDLE;
+  if (handle == current_handle) {
+    return true;
+  }
+
+  char path_buf[200], content_path[200];
+  if (!fs_path_from_handle(&handle_table, handle, path_buf, sizeof(path_buf))) {
+    return true;
+  }
+  if (fs_dedup_resolve(path_buf, content_path, sizeof(content_path))) {
+    strlcpy(path_buf, content_path, sizeof(path_buf));
+  }
+  // head is about to be overwritten
+  portENTER_CRITICAL(&file_cache_lock);
+  fs_prefetch_forget(FS_INVALID_HANDLE);
+  portEXIT_CRITICAL(&file_cache_lock);
+  flashioAcquire(fs_flashio_client());
+  FILE *f = filepoolOpen(path_buf, "r");
+  if (f == nullptr) {
+    flashioRelease(fs_flashio_client());
+    return true;
+  }
+  uint32_t logical_size;
+  size_t size;
+  const bool compressed = zfileProbe(f, &logical_size);
+  size_t head_len = 0;
+  if (compressed) {
+    size = logical_size;
+  } else {
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    head_len = fread(prefetch_state.head, 1, TU_MIN(size, sizeof(prefetch_state.head)), f);
+  }
+  flashioRelease(fs_flashio_client());
+
+  if (!fs_file_cache_put(handle, f, size, compressed)) {
+    filepoolClose(f);
+    return true;
+  }
+  portENTER_CRITICAL(&file_cache_lock);
+  prefetch_state.handle = handle;
+  prefetch_state.head_len = head_len;
+  portEXIT_CRITICAL(&file_cache_lock);
+  prefetch_state.issued++;
+  MTP_ESP_LOG("MtpPrefetch", "Prefetched %d: %u of %u bytes", handle, (unsigned)head_len, (unsigned)size);
+  return true;
+}
+
+static void fs_prefetch_log_stats(void)
+{
+  ESP_LOGI("MtpPrefetch", "%lu prefetched, %lu used", (unsigned long)prefetch_state.issued,
+           (unsigned long)prefetch_state.used);
+}
@@ -0,0 +1,67 @@
+// Space reservations for uploads.
+//
+// SendObjectInfo announces the size of the object, SendObject brings the data. Space is reserved
+// when SendObjectInfo is accepted, so a host that announces more than fits gets StoreFull right
+// away instead of a failed write after moving megabytes over the bus, and a reservation can't be
+// handed out twice.
+//
+// Held space is:
+//  - what is still to come of the object of the last accepted SendObjectInfo, or of the upload in
+//    progress. It shrinks as data arrives, and is released when the upload completes, is
+//    interrupted or the object is deleted. A new SendObjectInfo replaces it: the host can't send
+//    to the earlier object any more.
+//  - what is missing of interrupted uploads that can be resumed, as long as they are in the upload
+//    journal.
+// Reservations are rounded up to LittleFS blocks. fs_can_create_file and StorageInfo only count
+// space nobody holds.
+
+constexpr uint32_t RESERVE_BLOCK = 4096; // LittleFS block size
+
+static struct {
+  fs_handle_t handle;             // FS_INVALID_HANDLE when nothing is held
+  uint32_t bytes;                 // Still to be written
+} reserve_ledger = { .handle = FS_INVALID_HANDLE };
+
+static uint32_t fs_reserve_blocks(uint32_t bytes)
+{
+  return (bytes + RESERVE_BLOCK - 1) / RESERVE_BLOCK * RESERVE_BLOCK;
+}
+
+// Hold bytes for the upload to handle, replacing what was held before
+static void fs_reserve(fs_handle_t handle, uint32_t bytes)
+{
+  reserve_ledger.handle = handle;
+  reserve_ledger.bytes = bytes;
+  MTP_ESP_LOG("MtpReserve", "Holding %d bytes for %d", bytes, handle);
+}
+
+// Data for handle arrived
+static void fs_reserve_consume(fs_handle_t handle, uint32_t len)
+{
+  if (reserve_ledger.handle == handle) {
+    reserve_ledger.bytes -= TU_MIN(len, reserve_ledger.bytes);
+  }
+}
+
+// The upload to handle is over, or handle is gone. FS_INVALID_HANDLE releases whatever is held.
+static void fs_reserve_release(fs_handle_t handle)
+{
+  if (handle == FS_INVALID_HANDLE || reserve_ledger.handle == handle) {
+    reserve_ledger.handle = FS_INVALID_HANDLE;
+    reserve_ledger.bytes = 0;
+  }
+}
+
+static uint32_t fs_reserved_bytes(void)
+{
+  uint32_t bytes = reserve_ledger.handle != FS_INVALID_HANDLE ? fs_reserve_blocks(reserve_ledger.bytes) : 0;
+  for (int ii = 0; ii < RESUME_MAX_UPLOADS; ii++) {
+    const auto record = &resume_journal.records[ii];
+    // The upload in progress is in the ledger
+    if (record->path[0] != '\0' && !(upload_state.active && upload_state.record == ii) &&
+        record->expected_size > record->committed) {
+      bytes += fs_reserve_blocks(record->expected_size - record->committed);
+    }
+  }
+  return bytes;
+}
@@ -0,0 +1,533 @@
+// Resumable uploads.
+//
+// Every upload is tracked from SendObject to completion. Progress is made durable at checkpoints
+// (fsync of the file, then the committed length goes into the upload journal /.mtp/uploads), so
+// after a cancel, a pulled cable or a power cut the object keeps its handle and the content up to
+// the last checkpoint. A cancel or disconnect checkpoints right away, so nothing received is lost
+// in those cases. An upload only gets its journal record at its first checkpoint: one that
+// completes before never touches the journal, and one cut off by a power cut before is left as
+// LittleFS last synced it (empty, or the old version when it was replacing one).
+//
+// A host that comes back asks GetUploadState for the committed length and sends the rest with
+// SendPartialObject (the Android MTP extension) starting at that offset. The upload is complete,
+// and treated like any other finished upload, once the expected size is reached. Partial uploads
+// nobody resumes are deleted after CFG_EXAMPLE_MTP_RESUME_TIMEOUT_S.
+//
+// An upload replacing an existing object is written to its shadow (see usb_mtp_shadow.c.h); the
+// journal remembers that, so a resumed upload carries on in the shadow.
+//
+// Compressed uploads can't be resumed, since the state of the frame being built is lost. They are
+// deleted when interrupted, as are all uploads when CFG_EXAMPLE_MTP_RESUME is 0.
+
+#include "esp_timer.h"
+
+constexpr int RESUME_MAX_UPLOADS = 4;
+constexpr uint32_t RESUME_JOURNAL_MAGIC = 0x4C4E524Au; // "JRNL"
+constexpr uint32_t RESUME_JOURNAL_VERSION = 2;
+
+enum {
+  RESUME_SHADOWED = 1u << 0,      // Content goes to the shadow of path, which holds the old version
+};
+
+typedef struct {
+  char path[OBJMETA_PATH_LEN];    // Empty when the slot is unused
+  uint32_t expected_size;
+  uint32_t committed;             // Bytes known to be on flash
+  uint32_t flags;                 // RESUME_*
+} resume_record_t;
+
+typedef struct TU_ATTR_PACKED {
+  uint32_t expected_size;
+  uint32_t committed_size;
+} upload_state_dataset_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t record_count;
+} resume_journal_header_t;
+
+static struct {
+  bool loaded;
+  resume_record_t records[RESUME_MAX_UPLOADS];
+  int64_t idle_since[RESUME_MAX_UPLOADS];   // esp_timer time the upload stopped making progress
+} resume_journal;
+
+// The upload in progress, if any
+static struct {
+  bool active;
+  bool resumable;
+  bool shadowed;                  // Written to the shadow of the object
+  int record;                     // Journal slot, -1 if not journaled
+  fs_handle_t handle;
+  uint32_t expected_size;
+  uint32_t received;              // Object bytes accepted so far, including those before a resume
+  uint32_t last_checkpoint;
+  uint32_t xfer_left;             // Remaining bytes of the current SendPartialObject
+  uint16_t result;                // Response once the data phase is over
+} upload_state = { .record = -1, .result = MTP_RESP_OK };
+
+static void fs_resume_journal_path(char *path_out, size_t buf_len, const char *file)
+{
+  snprintf(path_out, buf_len, "/littlefs/%s/%s", FS_PRIVATE_DIR, file);
+}
+
+static void fs_resume_save(void)
+{
+  char path[64], tmp_path[64];
+  resume_journal_header_t header = {
+    .magic = RESUME_JOURNAL_MAGIC,
+    .version = RESUME_JOURNAL_VERSION,
+    .record_size = sizeof(resume_record_t),
+    .record_count = RESUME_MAX_UPLOADS,
+  };
+
+  fs_resume_journal_path(path, sizeof(path), "uploads");
+  fs_resume_journal_path(tmp_path, sizeof(tmp_path), "uploads.tmp");
+  FILE *f = fopen(tmp_path, "w");
+  if (f == nullptr) {
+    ESP_LOGE("MtpResume", "Cannot write upload journal");
+    return;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(resume_journal.records, sizeof(resume_record_t), RESUME_MAX_UPLOADS, f) == RESUME_MAX_UPLOADS;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp_path, path) != 0) {
+    ESP_LOGE("MtpResume", "Failed to save upload journal");
+    unlink(tmp_path);
+  }
+}
+
+// Load the journal once after boot, and cut partial files back to their last checkpoint. Anything
+// after it may be torn.
+static void fs_resume_load(void)
+{
+  if (resume_journal.loaded) {
+    return;
+  }
+  resume_journal.loaded = true;
+  memset(resume_journal.records, 0, sizeof(resume_journal.records));
+
+  char path[64];
+  fs_resume_journal_path(path, sizeof(path), "uploads");
+  FILE *f = fopen(path, "r");
+  if (f == nullptr) {
+    return;
+  }
+  resume_journal_header_t header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      header.magic != RESUME_JOURNAL_MAGIC ||
+      header.version != RESUME_JOURNAL_VERSION ||
+      header.record_size != sizeof(resume_record_t) ||
+      header.record_count != RESUME_MAX_UPLOADS ||
+      fread(resume_journal.records, sizeof(resume_record_t), RESUME_MAX_UPLOADS, f) != RESUME_MAX_UPLOADS) {
+    ESP_LOGW("MtpResume", "Ignoring incompatible upload journal");
+    memset(resume_journal.records, 0, sizeof(resume_journal.records));
+  }
+  fclose(f);
+
+  const int64_t now = esp_timer_get_time();
+  for (int ii = 0; ii < RESUME_MAX_UPLOADS; ii++) {
+    auto record = &resume_journal.records[ii];
+    struct stat st;
+    char shadow_path[64];
+    if (record->path[0] == '\0') {
+      continue;
+    }
+    const char *content_path = fs_shadow_content_path(record->path, record->flags & RESUME_SHADOWED,
+                                                      shadow_path, sizeof(shadow_path));
+    if (stat(content_path, &st) != 0) {
+      record->path[0] = '\0';
+      continue;
+    }
+    if (st.st_size > record->committed) {
+      FILE *partial = fopen(content_path, "r+");
+      if (partial != nullptr) {
+        ftruncate(fileno(partial), record->committed);
+        fclose(partial);
+      }
+    } else {
+      record->committed = st.st_size;
+    }
+    resume_journal.idle_since[ii] = now;
+    ESP_LOGI("MtpResume", "Partial upload %s: %d of %d bytes", record->path, record->committed, record->expected_size);
+  }
+}
+
+static int fs_resume_find(const char *path)
+{
+  for (int ii = 0; ii < RESUME_MAX_UPLOADS; ii++) {
+    if (resume_journal.records[ii].path[0] != '\0' && strcmp(resume_journal.records[ii].path, path) == 0) {
+      return ii;
+    }
+  }
+  return -1;
+}
+
+static void fs_resume_drop(int index)
+{
+  if (index >= 0) {
+    resume_journal.records[index].path[0] = '\0';
+    fs_resume_save();
+  }
+}
+
+// Claim a journal record for path. The caller saves the journal.
+static int fs_resume_add(const char *path, uint32_t expected_size, uint32_t flags)
+{
+  int index = fs_resume_find(path);
+  for (int ii = 0; index < 0 && ii < RESUME_MAX_UPLOADS; ii++) {
+    if (resume_journal.records[ii].path[0] == '\0') {
+      index = ii;
+    }
+  }
+  if (index < 0) {
+    ESP_LOGW("MtpResume", "Upload journal full, %s won't be resumable", path);
+    return -1;
+  }
+  auto record = &resume_journal.records[index];
+  strlcpy(record->path, path, sizeof(record->path));
+  record->expected_size = expected_size;
+  record->committed = 0;
+  record->flags = flags;
+  return index;
+}
+
+// Make everything written so far durable and record it
+static void fs_upload_checkpoint(void)
+{
+  const uint32_t committed = upload_state.received - fs_dedup_pending();
+  upload_state.last_checkpoint = upload_state.received;
+  if (!upload_state.resumable ||
+      committed == (upload_state.record >= 0 ? resume_journal.records[upload_state.record].committed : 0)) {
+    return;
+  }
+  fs_writeback_drain();
+  fflush(current_file);
+  fsync(fileno(current_file));
+  if (fs_writeback_error() != 0) {
+    // The journal must not claim data that never made it
+    return;
+  }
+  if (upload_state.record < 0) {
+    char pathbuf[200];
+    fs_path_from_handle(&handle_table, upload_state.handle, pathbuf, sizeof(pathbuf));
+    upload_state.record = fs_resume_add(pathbuf, upload_state.expected_size,
+                                        upload_state.shadowed ? RESUME_SHADOWED : 0);
+    if (upload_state.record < 0) {
+      upload_state.resumable = false;
+      return;
+    }
+  }
+  resume_journal.records[upload_state.record].committed = committed;
+  fs_resume_save();
+}
+
+// Start tracking the upload into the file that is currently open, which already holds offset bytes
+static void fs_upload_begin(const char *path, uint32_t offset, uint32_t expected_size, bool compressed)
+{
+  fs_resume_load();
+  upload_state.active = true;
+  upload_state.resumable = CFG_EXAMPLE_MTP_RESUME && !compressed;
+  upload_state.shadowed = current_shadowed;
+  upload_state.handle = current_handle;
+  upload_state.expected_size = expected_size;
+  upload_state.received = offset;
+  upload_state.last_checkpoint = offset;
+  upload_state.record = fs_resume_find(path);
+  upload_state.result = MTP_RESP_OK;
+  // What is known about the content being written is about to be wrong
+  char shadow_path[64];
+  objmetaRemove(fs_shadow_content_path(path, upload_state.shadowed, shadow_path, sizeof(shadow_path)));
+  fs_writeback_begin();
+  if (upload_state.resumable && upload_state.record >= 0 && offset == 0) {
+    // Started over: the old record must not outlive a power cut as it is
+    upload_state.record = fs_resume_add(path, expected_size, upload_state.shadowed ? RESUME_SHADOWED : 0);
+    fs_resume_save();
+  }
+}
+
+static void fs_upload_progress(uint32_t len)
+{
+  upload_state.received += len;
+  fs_reserve_consume(upload_state.handle, len);
+  if (upload_state.received - upload_state.last_checkpoint >= CFG_EXAMPLE_MTP_RESUME_CHECKPOINT) {
+    fs_upload_checkpoint();
+  }
+}
+
+// Forget data held back by deduplication instead of writing it out, which could take arbitrarily
+// long. The committed length only counts what's in the file.
+static void fs_upload_drop_pending(void)
+{
+  if (upload_state.active) {
+    upload_state.received -= fs_dedup_pending();
+    upload_state.xfer_left = 0;
+  }
+  fs_dedup_abort();
+}
+
+// A partial object nobody can finish is just in the way: remove it along with its handle. An
+// object it was to replace stays.
+static void fs_upload_remove(const char *path)
+{
+  char shadow_path[64];
+  const char *content_path = fs_shadow_content_path(path, upload_state.shadowed, shadow_path, sizeof(shadow_path));
+  fs_close_handle(current_handle, current_file);
+  unlink(content_path);
+  fs_delete_handle(&handle_table, upload_state.handle);
+  fs_resume_drop(upload_state.record);
+  objmetaRemove(content_path);
+}
+
+// The upload stopped before all data arrived: cancel, disconnect, or the host moved on
+static void fs_upload_interrupt(void)
+{
+  if (!upload_state.active) {
+    return;
+  }
+  // Held back data would take arbitrarily long to write out, the host sends it again on resume
+  fs_upload_drop_pending();
+  upload_state.active = false;
+  // What is missing of a resumable upload stays held through its journal record
+  fs_reserve_release(upload_state.handle);
+  fs_digest_upload_abort();
+  if (current_file == nullptr || current_handle != upload_state.handle) {
+    return;
+  }
+
+  char pathbuf[200];
+  fs_path_from_handle(&handle_table, upload_state.handle, pathbuf, sizeof(pathbuf));
+  if (upload_state.resumable) {
+    fs_upload_checkpoint();
+  }
+  if (upload_state.resumable && upload_state.record >= 0) {
+    fs_close_handle(current_handle, current_file);
+    resume_journal.idle_since[upload_state.record] = esp_timer_get_time();
+    ESP_LOGI("MtpResume", "Upload of %s interrupted at %d of %d bytes",
+             pathbuf, upload_state.received, upload_state.expected_size);
+  } else {
+    fs_upload_remove(pathbuf);
+    ESP_LOGI("MtpResume", "Upload of %s interrupted, removed", pathbuf);
+  }
+  upload_state.record = -1;
+}
+
+// Response for an upload whose writes failed with error
+static uint16_t fs_upload_error_response(int error)
+{
+  return error == ENOSPC ? MTP_RESP_STORE_FULL : MTP_RESP_GENERAL_ERROR;
+}
+
+// All data has arrived: close the file and record what we know about it. The response goes into
+// upload_state.result; if data was lost on the way to flash, the upload fails and is removed.
+static void fs_upload_finish(void)
+{
+  char pathbuf[200], shadow_path[64];
+  const fs_handle_t handle = current_handle;
+  int error = fs_writeback_end();
+  fs_path_from_handle(&handle_table, handle, pathbuf, sizeof(pathbuf));
+  const char *content_path = fs_shadow_content_path(pathbuf, upload_state.shadowed, shadow_path, sizeof(shadow_path));
+  uint8_t digest[OBJMETA_SHA256_LEN];
+  const bool have_digest = fs_digest_upload_take(current_file_size, digest);
+  if (error == 0 && !fs_dedup_commit(content_path, current_file_size, have_digest ? digest : nullptr)) {
+    const bool compressed = current_compressed;
+    if (compressed && !zfileFinish(&current_zfile)) {
+      error = errno != 0 ? errno : EIO;
+    }
+    if (error == 0) {
+      fs_close_handle(handle, current_file);
+
+      objmeta_t *record = objmetaUpdate(content_path);
+      if (record != nullptr && compressed) {
+        record->flags |= OBJMETA_COMPRESSED;
+        record->logical_size = current_file_size;
+      }
+      if (record != nullptr && have_digest) {
+        memcpy(record->sha256, digest, sizeof(digest));
+        record->flags |= OBJMETA_HAS_SHA256;
+      }
+    }
+  }
+  upload_state.active = false;
+  fs_reserve_release(handle);
+  if (error != 0) {
+    // The object it was to replace stays, the host learns the new one is gone
+    ESP_LOGE("MtpResume", "Upload of %s failed: %s", pathbuf, strerror(error));
+    fs_dedup_abort();
+    upload_state.result = fs_upload_error_response(error);
+    fs_upload_remove(pathbuf);
+    fs_sync_event(MTP_EVENT_OBJECT_REMOVED, handle);
+    upload_state.record = -1;
+    return;
+  }
+  lfstuneRecord(LFSTUNE_OP_WRITE, current_file_size);
+  if (upload_state.shadowed && !fs_shadow_commit(handle, content_path, pathbuf)) {
+    upload_state.result = MTP_RESP_GENERAL_ERROR;
+  }
+  fs_resume_drop(upload_state.record);
+  upload_state.record = -1;
+
+  // Read the image headers now, while they're still in the LittleFS cache
+  imginfo_t image;
+  fs_image_info(handle, pathbuf, &image);
+}
+
+// Job finishing an upload whose last packet arrived while held back data was being written out
+static int32_t fs_upload_finish_step(void)
+{
+  if (!fs_dedup_run(0)) {
+    return 0;
+  }
+  fs_upload_finish();
+  return upload_state.result;
+}
+
+// Delete partial uploads that have been left alone for too long
+static void fs_resume_expire(void)
+{
+  const int64_t now = esp_timer_get_time();
+  fs_resume_load();
+  for (int ii = 0; ii < RESUME_MAX_UPLOADS; ii++) {
+    auto record = &resume_journal.records[ii];
+    if (record->path[0] == '\0' || (upload_state.active && upload_state.record == ii) ||
+        now - resume_journal.idle_since[ii] < CFG_EXAMPLE_MTP_RESUME_TIMEOUT_S * 1000000LL) {
+      continue;
+    }
+    ESP_LOGI("MtpResume", "Partial upload %s expired", record->path);
+    if (record->flags & RESUME_SHADOWED) {
+      // The object it was to replace stays, under a single handle
+      char shadow_path[64];
+      fs_shadow_path(record->path, shadow_path, sizeof(shadow_path));
+      unlink(shadow_path);
+      objmetaRemove(shadow_path);
+      fs_shadow_drop_duplicates(record->path, FS_INVALID_HANDLE);
+      fs_resume_drop(ii);
+      continue;
+    }
+    for (int jj = 0; jj < MTP_HANDLE_TABLE_SIZE; jj++) {
+      char pathbuf[200];
+      auto entry = &handle_table.handles[jj];
+      if (entry->name[0] != '\0' && !entry->is_dir &&
+          fs_path_from_handle(&handle_table, entry->handle, pathbuf, sizeof(pathbuf)) &&
+          strcmp(pathbuf, record->path) == 0) {
+        fs_delete_handle(&handle_table, entry->handle);
+        break;
+      }
+    }
+    unlink(record->path);
+    objmetaRemove(record->path);
+    fs_resume_drop(ii);
+  }
+}
+
+static int32_t fs_get_upload_state(tud_mtp_cb_data_t* cb_data) {
+  const mtp_container_command_t* command = cb_data->command_container;
+  mtp_container_info_t* io_container = &cb_data->io_container;
+  const uint32_t obj_handle = command->params[0];
+
+  if (!is_session_opened) {
+    return MTP_RESP_SESSION_NOT_OPEN;
+  }
+  char pathbuf[200];
+  struct stat stat_buf;
+  fs_handletable_entry_t *entry;
+  if (!fs_path_from_handle(&handle_table, obj_handle, pathbuf, sizeof(pathbuf)) ||
+      fs_stat_handle(&handle_table, obj_handle, &stat_buf, &entry) != 0 || entry->is_dir) {
+    return MTP_RESP_INVALID_OBJECT_HANDLE;
+  }
+
+  fs_resume_load();
+  upload_state_dataset_t dataset;
+  const int index = fs_resume_find(pathbuf);
+  if (upload_state.active && upload_state.handle == obj_handle) {
+    dataset.expected_size = upload_state.expected_size;
+    dataset.committed_size = upload_state.received - fs_dedup_pending();
+  } else if (index >= 0) {
+    dataset.expected_size = resume_journal.records[index].expected_size;
+    dataset.committed_size = resume_journal.records[index].committed;
+  } else {
+    dataset.expected_size = dataset.committed_size = fs_object_size(&handle_table, entry, pathbuf, &stat_buf);
+  }
+  mtp_container_add_raw(io_container, &dataset, sizeof(dataset));
+  tud_mtp_data_send(io_container);
+  return 0;
+}
+
+static int32_t fs_send_partial_object(tud_mtp_cb_data_t* cb_data) {
+  const mtp_container_command_t* command = cb_data->command_container;
+  mtp_container_info_t* io_container = &cb_data->io_container;
+  const uint32_t obj_handle = command->params[0];
+
+  if (cb_data->phase == MTP_PHASE_COMMAND) {
+    const uint64_t offset = command->params[1] | ((uint64_t)command->params[2] << 32);
+    const uint32_t size = command->params[3];
+    if (!is_session_opened) {
+      return MTP_RESP_SESSION_NOT_OPEN;
+    }
+    char pathbuf[200];
+    if (!fs_path_from_handle(&handle_table, obj_handle, pathbuf, sizeof(pathbuf))) {
+      return MTP_RESP_INVALID_OBJECT_HANDLE;
+    }
+    fs_resume_load();
+    const int index = fs_resume_find(pathbuf);
+    if (index < 0) {
+      // Only partial uploads can be continued, complete objects are replaced with SendObject
+      return MTP_RESP_OPERATION_NOT_SUPPORTED;
+    }
+    const auto record = &resume_journal.records[index];
+    if (offset > record->committed || offset + size > record->expected_size) {
+      return MTP_RESP_INVALID_PARAMETER;
+    }
+    FILE *file = (record->flags & RESUME_SHADOWED) ? fs_shadow_reopen(obj_handle, pathbuf)
+                                                   : fs_open_handle(&handle_table, obj_handle, "r+");
+    if (file == nullptr) {
+      return MTP_RESP_GENERAL_ERROR;
+    }
+    // Anything past the resume point gets written again
+    fflush(current_file);
+    ftruncate(fileno(current_file), offset);
+    fseek(current_file, offset, SEEK_SET);
+    record->committed = offset;
+
+    // The digest of the earlier part is gone, the object gets hashed on demand instead
+    fs_digest_upload_abort();
+    fs_upload_begin(pathbuf, offset, record->expected_size, false);
+    upload_state.xfer_left = size;
+    fs_reserve(obj_handle, record->expected_size - (uint32_t)offset);
+    current_file_size = record->expected_size;
+    MTP_ESP_LOG("MtpResume", "Resuming %s at %d, %d bytes", pathbuf, (uint32_t)offset, size);
+
+    io_container->header->len += size;
+    tud_mtp_data_receive(io_container);
+  } else if (cb_data->phase == MTP_PHASE_DATA) {
+    if (!upload_state.active || current_file == nullptr) {
+      return MTP_RESP_GENERAL_ERROR;
+    }
+    const uint32_t len = TU_MIN(io_container->payload_bytes, upload_state.xfer_left);
+    fs_write_current(io_container->payload, len);
+    upload_state.xfer_left -= len;
+    fs_upload_progress(len);
+    if (upload_state.xfer_left > 0) {
+      tud_mtp_data_receive(io_container);
+    } else if (upload_state.received >= upload_state.expected_size) {
+      MTP_ESP_LOG("MtpResume", "%s: upload completed", __func__);
+      fs_upload_finish();
+    } else {
+      // More to come in another SendPartialObject
+      fs_upload_checkpoint();
+      upload_state.active = false;
+      if (upload_state.record >= 0) {
+        resume_journal.idle_since[upload_state.record] = esp_timer_get_time();
+      }
+      upload_state.record = -1;
+      fs_close_handle(current_handle, current_file);
+      // The journal still has the last offset that made it to flash, the host can resume there
+      if (fs_writeback_error() != 0) {
+        upload_state.result = fs_upload_error_response(fs_writeback_error());
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,123 @@
+// Shadow replacement of objects.
+//
+// An upload to a name that already exists doesn't touch the existing file. It goes into a shadow
+// file in /.mtp/shadow instead, and only when the upload is complete is the shadow renamed over the
+// object. LittleFS renames are atomic, so anyone reading the object, on the host through its old
+// handle or in firmware through /littlefs, sees the old version up to that point and the new one
+// afterwards, never a mix. An interrupted or abandoned upload leaves the object as it was.
+//
+// The shadow's name is derived from the object's path, so a resumed upload finds it again.
+
+static void fs_shadow_path(const char *path, char *path_out, size_t buf_len)
+{
+  const uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)path, strlen(path));
+  snprintf(path_out, buf_len, "/littlefs/%s/shadow/%08lx", FS_PRIVATE_DIR, (unsigned long)crc);
+}
+
+// Open a new, empty shadow for the object at path
+static FILE *fs_shadow_create(const char *path)
+{
+  char shadow_dir[64], shadow_path[64];
+  snprintf(shadow_dir, sizeof(shadow_dir), "/littlefs/%s/shadow", FS_PRIVATE_DIR);
+  mkdir(shadow_dir, 0777);
+  fs_shadow_path(path, shadow_path, sizeof(shadow_path));
+  return filepoolOpen(shadow_path, "w");
+}
+
+// Open the shadow of the object behind handle to carry on with a partial upload
+static FILE *fs_shadow_reopen(fs_handle_t handle, const char *path)
+{
+  char shadow_path[64];
+  fs_shadow_path(path, shadow_path, sizeof(shadow_path));
+  if (current_file != nullptr) {
+    fs_close_handle(current_handle, current_file);
+  }
+  current_file = filepoolOpen(shadow_path, "r+");
+  if (current_file == nullptr) {
+    return nullptr;
+  }
+  current_handle = handle;
+  current_shadowed = true;
+  return current_file;
+}
+
+// Where the content of an upload to path is being written
+static const char *fs_shadow_content_path(const char *path, bool shadowed, char *path_out, size_t buf_len)
+{
+  if (!shadowed) {
+    return path;
+  }
+  fs_shadow_path(path, path_out, buf_len);
+  return path_out;
+}
+
+// An upload under another handle is replacing the object of entry. Listings leave entry out until
+// the swap, so the host sees one object of that name, the one being written.
+static bool fs_shadow_hidden(const fs_handletable_entry_t *entry)
+{
+  if (current_file == nullptr || !current_shadowed || current_handle == entry->handle || entry->is_dir) {
+    return false;
+  }
+  auto upload = fs_get_handle_entry(&handle_table, current_handle);
+  return upload != nullptr && upload->parent_handle == entry->parent_handle && strcmp(upload->name, entry->name) == 0;
+}
+
+// Several handles name the same object while a replacement is under way. Keep only one of them,
+// the lowest when keep is FS_INVALID_HANDLE, and tell the host the others are gone.
+static void fs_shadow_drop_duplicates(const char *path, fs_handle_t keep)
+{
+  fs_handle_t duplicates[4];
+  int count = 0;
+  for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE && count < (int)TU_ARRAY_SIZE(duplicates); ii++) {
+    char pathbuf[200];
+    auto entry = &handle_table.handles[ii];
+    if (entry->name[0] != '\0' && !entry->is_dir &&
+        fs_path_from_handle(&handle_table, entry->handle, pathbuf, sizeof(pathbuf)) &&
+        strcmp(pathbuf, path) == 0) {
+      duplicates[count++] = entry->handle;
+    }
+  }
+  if (keep == FS_INVALID_HANDLE) {
+    for (int ii = 0; ii < count; ii++) {
+      keep = TU_MIN(keep, duplicates[ii]);
+    }
+  }
+  for (int ii = 0; ii < count; ii++) {
+    if (duplicates[ii] != keep) {
+      MTP_ESP_LOG("MtpShadow", "Handle %d replaced by %d", duplicates[ii], keep);
+      fs_delete_handle(&handle_table, duplicates[ii]);
+      fs_sync_event(MTP_EVENT_OBJECT_REMOVED, duplicates[ii]);
+    }
+  }
+}
+
+// The upload into the (closed) shadow is complete: swap it in for the object at path, which from
+// now on is only known by handle
+static bool fs_shadow_commit(fs_handle_t handle, const char *shadow_path, const char *path)
+{
+  uint32_t ref_id;
+  const bool was_reference = fs_dedup_ref_of(path, &ref_id);
+  fs_image_forget(path);
+  // Older handles of path may still have the old version open
+  fs_file_cache_flush();
+  fs_block_cache_invalidate(path);
+  // Stubs sharing the old content keep it
+  if (!was_reference) {
+    fs_dedup_hand_over(path);
+  }
+  if (rename(shadow_path, path) != 0) {
+    ESP_LOGE("MtpShadow", "Cannot replace %s, keeping the old version", path);
+    unlink(shadow_path);
+    objmetaRemove(shadow_path);
+    return false;
+  }
+  // Whatever was known about the old version went with it
+  if (was_reference) {
+    fs_dedup_release_ref(ref_id);
+  }
+  objmetaRemove(path);
+  objmetaRename(shadow_path, path);
+  fs_shadow_drop_duplicates(path, handle);
+  MTP_ESP_LOG("MtpShadow", "%s replaced", path);
+  return true;
+}
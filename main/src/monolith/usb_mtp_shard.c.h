@@ -0,0 +1,172 @@
+// Sharded folders.
+//
+// LittleFS looks names up by walking a folder's metadata pairs one after another, so creating,
+// opening and deleting get slower the more files a folder holds. With CFG_EXAMPLE_MTP_SHARDS set,
+// new files in the folders listed in fs_sharded_folders are kept in that many subfolders instead,
+// picked by a hash of the file name: /littlefs/logs/trace-0815.log is stored as
+// /littlefs/logs/.mtp-3a/trace-0815.log. Each shard holds a fraction of the folder, and that's all
+// a lookup walks.
+//
+// The host doesn't see the shards. fs_path_from_handle and fs_path_create map logical paths to
+// physical ones, folder listings (fs_dir_*) look through the shards, and changes the application
+// reports with a physical path are taken for the logical object. The application gets the
+// physical path of a new file from mtpResolvePath.
+//
+// Files directly in a sharded folder, from before it was sharded or written there by the
+// application, stay where they are: a name is looked for in its shard first, then in the folder.
+
+#include <ctype.h>
+#include "esp_rom_crc.h"
+
+static bool fs_shard_folder(const char *folder_name)
+{
+#if CFG_EXAMPLE_MTP_SHARDS > 0
+  for (size_t ii = 0; ii < TU_ARRAY_SIZE(fs_sharded_folders); ii++) {
+    if (strcasecmp(folder_name, fs_sharded_folders[ii]) == 0) {
+      return true;
+    }
+  }
+#endif
+  return false;
+}
+
+// Whether name is that of a shard folder
+static bool fs_shard_dir(const char *name)
+{
+  const size_t prefix_len = strlen(FS_PRIVATE_DIR);
+  return strncmp(name, FS_PRIVATE_DIR, prefix_len) == 0 && name[prefix_len] == '-' &&
+         isxdigit((unsigned char)name[prefix_len + 1]) && isxdigit((unsigned char)name[prefix_len + 2]) &&
+         name[prefix_len + 3] == '\0';
+}
+
+// Append the shard folder of file name, and a slash, to path_out
+static void fs_shard_append(const char *name, char *path_out, int buf_len)
+{
+  const uint32_t shard = esp_rom_crc32_le(0, (const uint8_t *)name, strlen(name)) % TU_MAX(CFG_EXAMPLE_MTP_SHARDS, 1);
+  const size_t len = strlen(path_out);
+  snprintf(path_out + len, buf_len > (int)len ? buf_len - len : 0, "%s-%02lx/", FS_PRIVATE_DIR, (unsigned long)shard);
+}
+
+// Create the folder a file is about to be created in, if it is a shard
+static void fs_shard_prepare(const char *path)
+{
+  char dir_path[200];
+  strlcpy(dir_path, path, sizeof(dir_path));
+  char *slash = strrchr(dir_path, '/');
+  if (slash == nullptr) {
+    return;
+  }
+  *slash = '\0';
+  const char *dir_name = strrchr(dir_path, '/');
+  if (dir_name != nullptr && fs_shard_dir(dir_name + 1)) {
+    mkdir(dir_path, 0777);
+  }
+}
+
+// Append the physical path of file name in the sharded folder path_out (ending in a slash) to
+// path_out: its shard, unless only the folder itself has a file of that name
+static void fs_shard_locate(const char *name, char *path_out, int buf_len)
+{
+  const size_t dir_len = strlen(path_out);
+  struct stat stat_buf;
+  fs_shard_append(name, path_out, buf_len);
+  strlcat(path_out, name, buf_len);
+  if (stat(path_out, &stat_buf) != 0) {
+    path_out[dir_len] = '\0';
+    strlcat(path_out, name, buf_len);
+    if (stat(path_out, &stat_buf) != 0) {
+      path_out[dir_len] = '\0';
+      fs_shard_append(name, path_out, buf_len);
+      strlcat(path_out, name, buf_len);
+    }
+  }
+}
+
+// Remove the (empty) shards of the folder at dir_path, before removing the folder
+static void fs_shard_remove_dirs(const char *dir_path)
+{
+  auto dir = opendir(dir_path);
+  if (dir == nullptr) {
+    return;
+  }
+  char shard_path[200];
+  struct dirent *item;
+  while ((item = readdir(dir)) != nullptr) {
+    if (item->d_type == DT_DIR && fs_shard_dir(item->d_name)) {
+      snprintf(shard_path, sizeof(shard_path), "%s/%s", dir_path, item->d_name);
+      rmdir(shard_path);
+    }
+  }
+  closedir(dir);
+}
+
+// List the folder at dir_path, the content of its shards included
+static bool fs_dir_open(fs_dir_t *dir, const char *dir_path)
+{
+  dir->shard = nullptr;
+  dir->path_len = strlcpy(dir->path, dir_path, sizeof(dir->path));
+  dir->dir = opendir(dir_path);
+  return dir->dir != nullptr;
+}
+
+// The next item, and its physical path in path_out. nullptr after the last one.
+static struct dirent *fs_dir_next(fs_dir_t *dir, char *path_out, size_t buf_len)
+{
+  for (;;) {
+    if (dir->shard != nullptr) {
+      struct dirent *item = readdir(dir->shard);
+      if (item != nullptr) {
+        snprintf(path_out, buf_len, "%s/%s", dir->path, item->d_name);
+        return item;
+      }
+      closedir(dir->shard);
+      dir->shard = nullptr;
+      dir->path[dir->path_len] = '\0';
+    }
+    struct dirent *item = readdir(dir->dir);
+    if (item == nullptr) {
+      return nullptr;
+    }
+    if (item->d_type == DT_DIR && fs_shard_dir(item->d_name)) {
+      snprintf(dir->path + dir->path_len, sizeof(dir->path) - dir->path_len, "/%s", item->d_name);
+      dir->shard = opendir(dir->path);
+      if (dir->shard == nullptr) {
+        dir->path[dir->path_len] = '\0';
+      }
+      continue;
+    }
+    snprintf(path_out, buf_len, "%s/%s", dir->path, item->d_name);
+    return item;
+  }
+}
+
+static void fs_dir_close(fs_dir_t *dir)
+{
+  if (dir->shard != nullptr) {
+    closedir(dir->shard);
+  }
+  closedir(dir->dir);
+}
+
+int mtpResolvePath(const char *path, char *path_out, size_t buf_len) {
+  static const char mount[] = "/littlefs/";
+  const bool mounted = strncmp(path, mount, sizeof(mount) - 1) == 0;
+  const char *rel = mounted ? path + sizeof(mount) - 1 : path;
+  const char *slash = mounted ? strchr(rel, '/') : nullptr;
+  char folder[MTP_FILENAME_LENGTH];
+  if (slash == nullptr || strchr(slash + 1, '/') != nullptr ||
+      (size_t)(slash - rel) >= sizeof(folder)) {
+    return strlcpy(path_out, path, buf_len) < buf_len ? 0 : -ENAMETOOLONG;
+  }
+  strlcpy(folder, rel, slash - rel + 1);
+  if (!fs_shard_folder(folder)) {
+    return strlcpy(path_out, path, buf_len) < buf_len ? 0 : -ENAMETOOLONG;
+  }
+  strlcpy(path_out, path, TU_MIN(buf_len, (size_t)(slash - path + 2)));
+  fs_shard_locate(slash + 1, path_out, buf_len);
+  if (strlen(path_out) + 1 >= buf_len) {
+    return -ENAMETOOLONG;
+  }
+  fs_shard_prepare(path_out);
+  return 0;
+}
@@ -0,0 +1,381 @@
+// Filesystem changes made by the firmware.
+//
+// The handle table is built at OpenSession. Files the firmware creates, deletes or renames under
+// /littlefs afterwards are reported with the mtpNotify* functions (or made with the mtpMkdir /
+// mtpUnlink / mtpRename wrappers, see mtp.h). Those may be called from any task: they only queue
+// the change. mtpPoll applies queued changes to the handle table in the TinyUSB task, one entry at
+// a time, and tells the host with ObjectAdded / ObjectRemoved / ObjectInfoChanged events so its
+// view stays current without a reconnect.
+//
+// If the queue overflows, the next poll reconciles the handle table with the directory contents
+// instead: existing objects keep their handles, new ones are added and vanished ones dropped.
+
+#include "freertos/queue.h"
+
+constexpr int SYNC_QUEUE_LEN = 8;
+constexpr int SYNC_MAX_EVENTS = 4;
+constexpr int64_t SYNC_EVENT_TIMEOUT_US = 100 * 1000;   // Drop an event the host doesn't pick up
+
+typedef enum {
+  SYNC_WRITTEN = 0,
+  SYNC_REMOVED,
+  SYNC_RENAMED,
+} sync_kind_t;
+
+typedef struct {
+  uint8_t kind;                   // sync_kind_t
+  char path[OBJMETA_PATH_LEN];
+  char new_path[OBJMETA_PATH_LEN];
+} sync_change_t;
+
+static struct {
+  QueueHandle_t queue;
+  StaticQueue_t queue_buf;
+  uint8_t queue_storage[SYNC_QUEUE_LEN * sizeof(sync_change_t)];
+  volatile bool overflow;         // Changes were lost, reconcile
+  mtp_event_t events[SYNC_MAX_EVENTS];  // Waiting to be sent, oldest at event_head
+  int event_head;
+  int event_count;
+  int64_t event_since;            // When the oldest event was first tried
+  // A transfer may still be reading the buffer sent last, so they take turns. A send only gets
+  // through after the previous transfer is done.
+  mtp_event_t in_flight[2];
+  int in_flight_next;
+} sync_state;
+
+static void fs_sync_init(void)
+{
+  sync_state.queue = xQueueCreateStatic(SYNC_QUEUE_LEN, sizeof(sync_change_t), sync_state.queue_storage,
+                                        &sync_state.queue_buf);
+}
+
+static void fs_sync_queue(sync_kind_t kind, const char *path, const char *new_path)
+{
+  if (sync_state.queue == nullptr) {
+    return;
+  }
+  sync_change_t change = { .kind = (uint8_t)kind };
+  strlcpy(change.path, path, sizeof(change.path));
+  if (new_path != nullptr) {
+    strlcpy(change.new_path, new_path, sizeof(change.new_path));
+  }
+  if (xQueueSend(sync_state.queue, &change, pdMS_TO_TICKS(10)) != pdPASS) {
+    sync_state.overflow = true;
+  }
+}
+
+static void fs_sync_event(uint16_t code, uint32_t param)
+{
+  if (sync_state.event_count == SYNC_MAX_EVENTS) {
+    ESP_LOGW("MtpSync", "Too many events, dropping %04X", code);
+    return;
+  }
+  if (sync_state.event_count == 0) {
+    sync_state.event_since = esp_timer_get_time();
+  }
+  sync_state.events[(sync_state.event_head + sync_state.event_count++) % SYNC_MAX_EVENTS] = (mtp_event_t) {
+    .len = sizeof(mtp_container_header_t) + sizeof(uint32_t),
+    .type = MTP_CONTAINER_TYPE_EVENT_BLOCK,
+    .code = code,
+    .params = { param },
+  };
+}
+
+// Try to send the oldest event. Returns true when none are left.
+static bool fs_sync_send_event(void)
+{
+  if (sync_state.event_count == 0) {
+    return true;
+  }
+  auto buf = &sync_state.in_flight[sync_state.in_flight_next];
+  *buf = sync_state.events[sync_state.event_head];
+  if (tud_mtp_event_send(buf)) {
+    sync_state.in_flight_next ^= 1;
+  } else if (esp_timer_get_time() - sync_state.event_since < SYNC_EVENT_TIMEOUT_US) {
+    return false;
+  } else {
+    ESP_LOGW("MtpSync", "Host didn't take event %04X", buf->code);
+  }
+  sync_state.event_head = (sync_state.event_head + 1) % SYNC_MAX_EVENTS;
+  sync_state.event_since = esp_timer_get_time();
+  return --sync_state.event_count == 0;
+}
+
+// Split an absolute path into the handle of its folder (0 for the root) and its name. Returns false
+// for paths the host doesn't see. Files in a shard belong to the sharded folder.
+static bool fs_sync_split(const char *path, fs_handle_t *parent_handle, const char **name)
+{
+  static const char mount[] = "/littlefs/";
+  if (strncmp(path, mount, sizeof(mount) - 1) != 0) {
+    return false;
+  }
+  const char *rel = path + sizeof(mount) - 1;
+  const char *slash = strchr(rel, '/');
+  if (slash == nullptr) {
+    *parent_handle = 0;
+    *name = rel;
+    return strcmp(rel, FS_PRIVATE_DIR) != 0 && rel[0] != '\0';
+  }
+  const char *shard_slash = strchr(slash + 1, '/');
+  if (shard_slash != nullptr) {
+    char shard[MTP_FILENAME_LENGTH];
+    strlcpy(shard, slash + 1, TU_MIN(sizeof(shard), (size_t)(shard_slash - slash)));
+    if (!fs_shard_dir(shard) || strchr(shard_slash + 1, '/') != nullptr) {
+      return false;   // Only one level of folders
+    }
+  }
+  if (slash[1] == '\0') {
+    return false;
+  }
+  const size_t dir_len = slash - rel;
+  if (dir_len == strlen(FS_PRIVATE_DIR) && strncmp(rel, FS_PRIVATE_DIR, dir_len) == 0) {
+    return false;
+  }
+  *parent_handle = FS_INVALID_HANDLE;
+  for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE; ii++) {
+    auto entry = &handle_table.handles[ii];
+    if (entry->name[0] != '\0' && entry->is_dir && entry->parent_handle == 0 &&
+        strlen(entry->name) == dir_len && strncmp(entry->name, rel, dir_len) == 0) {
+      *parent_handle = entry->handle;
+      break;
+    }
+  }
+  *name = shard_slash != nullptr ? shard_slash + 1 : slash + 1;
+  return *parent_handle != FS_INVALID_HANDLE && !fs_shard_dir(*name);
+}
+
+static fs_handletable_entry_t *fs_sync_find(fs_handle_t parent_handle, const char *name)
+{
+  for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE; ii++) {
+    auto entry = &handle_table.handles[ii];
+    if (entry->name[0] != '\0' && entry->parent_handle == parent_handle && strcmp(entry->name, name) == 0) {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+static fs_handletable_entry_t *fs_sync_add(fs_handle_t parent_handle, const char *name, bool is_dir)
+{
+  const fs_handle_t slot = fs_handletable_find_empty_entry(&handle_table);
+  if (slot == FS_INVALID_HANDLE) {
+    ESP_LOGW("MtpSync", "Handle table full, %s stays hidden", name);
+    return nullptr;
+  }
+  auto entry = &handle_table.handles[slot];
+  fs_index_write_begin();
+  entry->handle = fs_assign_new_handle();
+  entry->parent_handle = parent_handle;
+  entry->is_dir = is_dir;
+  strlcpy(entry->name, name, MTP_FILENAME_LENGTH);
+  handle_table.handles_used++;
+  fs_index_write_end();
+  fs_gc_changed(parent_handle);
+  return entry;
+}
+
+static void fs_sync_written(const char *path)
+{
+  fs_handle_t parent_handle;
+  const char *name;
+  struct stat st;
+  if (!fs_sync_split(path, &parent_handle, &name) || stat(path, &st) != 0) {
+    return;
+  }
+  fs_block_cache_invalidate(path);
+  // Digests and the like were of the old content
+  objmetaRemove(path);
+  auto entry = fs_sync_find(parent_handle, name);
+  if (entry != nullptr) {
+    fs_file_cache_drop(entry->handle);
+    fs_sync_event(MTP_EVENT_OBJECT_INFO_CHANGED, entry->handle);
+    return;
+  }
+  entry = fs_sync_add(parent_handle, name, S_ISDIR(st.st_mode));
+  if (entry != nullptr) {
+    MTP_ESP_LOG("MtpSync", "Handle %d = %s", entry->handle, path);
+    fs_sync_event(MTP_EVENT_OBJECT_ADDED, entry->handle);
+  }
+}
+
+static void fs_sync_removed(const char *path)
+{
+  fs_handle_t parent_handle;
+  const char *name;
+  fs_block_cache_invalidate(path);
+  if (!fs_sync_split(path, &parent_handle, &name)) {
+    return;
+  }
+  auto entry = fs_sync_find(parent_handle, name);
+  if (entry == nullptr) {
+    return;
+  }
+  const fs_handle_t handle = entry->handle;
+  if (current_file != nullptr && current_handle == handle) {
+    fs_close_handle(current_handle, current_file);
+  }
+  for (int ii = 0; entry->is_dir && ii < MTP_HANDLE_TABLE_SIZE; ii++) {
+    if (handle_table.handles[ii].name[0] != '\0' && handle_table.handles[ii].parent_handle == handle) {
+      fs_delete_handle(&handle_table, handle_table.handles[ii].handle);
+    }
+  }
+  fs_delete_handle(&handle_table, handle);
+  objmetaRemove(path);
+  fs_sync_event(MTP_EVENT_OBJECT_REMOVED, handle);
+}
+
+static void fs_sync_renamed(const char *old_path, const char *new_path)
+{
+  fs_handle_t old_parent, new_parent;
+  const char *old_name, *new_name;
+  fs_block_cache_invalidate(old_path);
+  fs_block_cache_invalidate(new_path);
+  auto entry = fs_sync_split(old_path, &old_parent, &old_name) ? fs_sync_find(old_parent, old_name) : nullptr;
+  if (entry == nullptr) {
+    fs_sync_written(new_path);
+    return;
+  }
+  if (!fs_sync_split(new_path, &new_parent, &new_name)) {
+    // Moved out of sight
+    fs_sync_removed(old_path);
+    return;
+  }
+  auto replaced = fs_sync_find(new_parent, new_name);
+  if (replaced != nullptr && replaced != entry) {
+    fs_delete_handle(&handle_table, replaced->handle);
+    fs_sync_event(MTP_EVENT_OBJECT_REMOVED, replaced->handle);
+  }
+  fs_index_write_begin();
+  entry->parent_handle = new_parent;
+  strlcpy(entry->name, new_name, MTP_FILENAME_LENGTH);
+  fs_index_write_end();
+  objmetaRename(old_path, new_path);
+  fs_dedup_renamed(old_path, new_path);
+  fs_sync_event(MTP_EVENT_OBJECT_INFO_CHANGED, entry->handle);
+}
+
+// Bring the handle table in line with the directories after changes were lost. Existing entries
+// keep their handles. The host is told to look again through a StorageInfoChanged event.
+static void fs_sync_reconcile(void)
+{
+  ESP_LOGW("MtpSync", "Change queue overflowed, reconciling handle table");
+  fs_file_cache_flush();
+  fs_block_cache_invalidate(nullptr);
+  char pathbuf[200];
+  struct stat st;
+  for (int ii = 0; ii < MTP_HANDLE_TABLE_SIZE; ii++) {
+    auto entry = &handle_table.handles[ii];
+    if (entry->name[0] != '\0' && (!fs_path_from_handle(&handle_table, entry->handle, pathbuf, sizeof(pathbuf)) ||
+                                   stat(pathbuf, &st) != 0)) {
+      fs_delete_handle(&handle_table, entry->handle);
+    }
+  }
+
+  auto root = opendir("/littlefs");
+  struct dirent *item;
+  while (root != nullptr && (item = readdir(root)) != nullptr) {
+    if (strcmp(item->d_name, FS_PRIVATE_DIR) == 0) {
+      continue;
+    }
+    auto entry = fs_sync_find(0, item->d_name);
+    if (entry == nullptr) {
+      entry = fs_sync_add(0, item->d_name, item->d_type == DT_DIR);
+    }
+    if (entry == nullptr || !entry->is_dir) {
+      continue;
+    }
+    snprintf(pathbuf, sizeof(pathbuf), "/littlefs/%s", item->d_name);
+    fs_dir_t dir;
+    if (!fs_dir_open(&dir, pathbuf)) {
+      continue;
+    }
+    struct dirent *subitem;
+    while ((subitem = fs_dir_next(&dir, pathbuf, sizeof(pathbuf))) != nullptr) {
+      if (fs_sync_find(entry->handle, subitem->d_name) == nullptr) {
+        fs_sync_add(entry->handle, subitem->d_name, subitem->d_type == DT_DIR);
+      }
+    }
+    fs_dir_close(&dir);
+  }
+  if (root != nullptr) {
+    closedir(root);
+  }
+  fs_sync_event(MTP_EVENT_STORAGE_INFO_CHANGED, SUPPORTED_STORAGE_ID);
+}
+
+// Apply a queued change, or send the event of the last one. Returns true when there's nothing left.
+static bool fs_sync_poll(void)
+{
+  if (sync_state.queue == nullptr) {
+    return true;
+  }
+  if (!is_session_opened || !tud_mounted()) {
+    // The next OpenSession builds the handle table from scratch
+    xQueueReset(sync_state.queue);
+    sync_state.overflow = false;
+    sync_state.event_count = 0;
+    return true;
+  }
+
+  // Changes are applied once their events are out, the host sees them in order
+  if (!fs_sync_send_event()) {
+    return false;
+  }
+
+  sync_change_t change;
+  if (sync_state.overflow) {
+    sync_state.overflow = false;
+    xQueueReset(sync_state.queue);
+    fs_sync_reconcile();
+  } else if (xQueueReceive(sync_state.queue, &change, 0) == pdPASS) {
+    // Files kept open for the host may be the ones changed
+    fs_file_cache_flush();
+    switch (change.kind) {
+      case SYNC_WRITTEN: fs_sync_written(change.path); break;
+      case SYNC_REMOVED: fs_sync_removed(change.path); break;
+      case SYNC_RENAMED: fs_sync_renamed(change.path, change.new_path); break;
+      default: break;
+    }
+  } else {
+    return true;
+  }
+  return false;
+}
+
+// These run in the caller's task and only queue. Files kept open for the host belong to the TinyUSB
+// task; the ones the change concerns are closed when mtpPoll applies it.
+void mtpNotifyWritten(const char *path) {
+  fs_sync_queue(SYNC_WRITTEN, path, nullptr);
+}
+
+void mtpNotifyRemoved(const char *path) {
+  fs_sync_queue(SYNC_REMOVED, path, nullptr);
+}
+
+void mtpNotifyRenamed(const char *old_path, const char *new_path) {
+  fs_sync_queue(SYNC_RENAMED, old_path, new_path);
+}
+
+int mtpMkdir(const char *path) {
+  const int ret = mkdir(path, 0777);
+  if (ret == 0) {
+    mtpNotifyWritten(path);
+  }
+  return ret;
+}
+
+int mtpUnlink(const char *path) {
+  const int ret = unlink(path);
+  if (ret == 0) {
+    mtpNotifyRemoved(path);
+  }
+  return ret;
+}
+
+int mtpRename(const char *old_path, const char *new_path) {
+  const int ret = rename(old_path, new_path);
+  if (ret == 0) {
+    mtpNotifyRenamed(old_path, new_path);
+  }
+  return ret;
+}
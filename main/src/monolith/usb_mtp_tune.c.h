@@ -0,0 +1,62 @@
+// LittleFS configuration tuning (TuneStorage vendor operation).
+//
+// The operation runs lfstune as a background job: a measurement per step, on the
+// CFG_EXAMPLE_MTP_TUNE_SCRATCH partition, then the cost model over the trace of what the host did
+// since boot. The result goes to the log and, as an sdkconfig fragment, to lfstune.sdkconfig in
+// the root of the storage, where the host can pick it up.
+//
+// esp_littlefs mounts with the geometry it was built with, so configurations can't be tried by
+// remounting; the fragment is for the next build. Changing read, program or cache size needs the
+// partition to be reformatted.
+
+static const char TUNE_RESULT_PATH[] = "/littlefs/lfstune.sdkconfig";
+
+static void fs_tune_write_result(const lfstune_config_t *best, const lfstune_config_t *current)
+{
+  char text[512];
+  const int len = lfstuneFormat(best, current, text, sizeof(text));
+  FILE *f = fopen(TUNE_RESULT_PATH, "w");
+  if (f == nullptr) {
+    ESP_LOGE("MtpTune", "Cannot create %s", TUNE_RESULT_PATH);
+    return;
+  }
+  fwrite(text, 1, TU_MIN(len, (int)sizeof(text) - 1), f);
+  fclose(f);
+  mtpNotifyWritten(TUNE_RESULT_PATH);
+}
+
+static int32_t fs_tune_step(void)
+{
+  flashioAcquire(fs_flashio_client());
+  const bool measured = lfstuneStep();
+  flashioRelease(fs_flashio_client());
+  if (!measured) {
+    return 0;
+  }
+
+  lfstune_config_t best, current;
+  if (!lfstuneResult(&best, &current)) {
+    return MTP_RESP_GENERAL_ERROR;
+  }
+  ESP_LOGI("MtpTune", "Best: read %u, prog %u, cache %u, lookahead %u, %lu bytes RAM, %llu us",
+           best.read_size, best.prog_size, best.cache_size, best.lookahead_size,
+           (unsigned long)best.ram, (unsigned long long)best.cost_us);
+  ESP_LOGI("MtpTune", "Built in: read %u, prog %u, cache %u, lookahead %u, %lu bytes RAM, %llu us",
+           current.read_size, current.prog_size, current.cache_size, current.lookahead_size,
+           (unsigned long)current.ram, (unsigned long long)current.cost_us);
+  fs_tune_write_result(&best, &current);
+  return MTP_RESP_OK;
+}
+
+static int32_t fs_tune_storage(tud_mtp_cb_data_t* cb_data) {
+  if (!is_session_opened) {
+    return MTP_RESP_SESSION_NOT_OPEN;
+  }
+  if (fs_exec_busy()) {
+    return MTP_RESP_DEVICE_BUSY;
+  }
+  if (!lfstuneBegin(CFG_EXAMPLE_MTP_TUNE_SCRATCH)) {
+    return MTP_RESP_GENERAL_ERROR;
+  }
+  return fs_exec_start(cb_data, "TuneStorage", fs_tune_step);
+}
@@ -0,0 +1,149 @@
+// Write-back of upload data.
+//
+// Writing an upload from the data phase callback puts LittleFS' program and erase times on the
+// bus: while a block is erased and programmed the TinyUSB task does nothing, and the host waits.
+// Instead, upload data is copied into a ring of CFG_EXAMPLE_MTP_WRITEBACK_BYTES and written by the
+// writer task (TaskMtpWriter), in whole FLASHIO_CHUNK (erase block) pieces, while the next packets
+// arrive. The TinyUSB task only waits when the ring is full, that is when the flash can't keep up.
+//
+// Anything else that touches the upload file goes through a barrier first: fs_writeback_drain has
+// the writer write out everything buffered, including a partial chunk, and waits for it. The
+// resume checkpoints (fsync, then the journal), the end of an upload and closing the file do that,
+// so what the journal calls committed is on flash, as before.
+//
+// esp_littlefs offers no way to reach the block device, so blocks can't be erased ahead of the
+// LittleFS allocator; the erases still happen, only no longer in the TinyUSB task.
+
+#include "esp_attr.h"
+#include "freertos/semphr.h"
+#include "tasks.h"
+
+static struct {
+  bool active;                    // An upload is buffered here
+  atomic_bool drain;              // Write out everything, then give drained
+  atomic_size_t head;             // Bytes put in since the upload began
+  atomic_size_t tail;             // Bytes written out since the upload began
+  int error;                      // errno of the first write of the upload that failed, 0 if none
+  SemaphoreHandle_t space;        // Given by the writer after writing
+  StaticSemaphore_t space_buf;
+  SemaphoreHandle_t drained;
+  StaticSemaphore_t drained_buf;
+  flashio_client_t *client;       // The writer's
+} writeback;
+static DMA_ATTR uint8_t writeback_ring[CFG_EXAMPLE_MTP_WRITEBACK_BYTES];
+
+static size_t fs_write_current_as(flashio_client_t *client, const void *buf, size_t len);
+
+static void fs_writeback_init(void)
+{
+  writeback.space = xSemaphoreCreateBinaryStatic(&writeback.space_buf);
+  writeback.drained = xSemaphoreCreateBinaryStatic(&writeback.drained_buf);
+}
+
+// An upload into current_file starts
+static void fs_writeback_begin(void)
+{
+  writeback.error = 0;
+  if (CFG_EXAMPLE_MTP_WRITEBACK_BYTES == 0 || hTaskMtpWriter == nullptr) {
+    return;
+  }
+  atomic_store(&writeback.head, 0);
+  atomic_store(&writeback.tail, 0);
+  writeback.active = true;
+}
+
+// A write of upload data came up short. Also called for writes that don't go through the ring.
+static void fs_writeback_failed(void)
+{
+  if (writeback.error == 0) {
+    writeback.error = errno != 0 ? errno : EIO;
+  }
+}
+
+// Whether all upload data written so far made it, as of the last drain: 0, or the errno of the
+// first write that failed
+static int fs_writeback_error(void)
+{
+  return writeback.error;
+}
+
+static bool fs_writeback_active(void)
+{
+  return writeback.active;
+}
+
+// Buffer upload data. Waits while the ring is full.
+static size_t fs_writeback_put(const void *buf, size_t len)
+{
+  size_t done = 0;
+  while (done < len) {
+    const size_t head = atomic_load_explicit(&writeback.head, memory_order_relaxed);
+    const size_t used = head - atomic_load_explicit(&writeback.tail, memory_order_acquire);
+    const size_t pos = head % sizeof(writeback_ring);
+    const size_t n = TU_MIN(TU_MIN(len - done, sizeof(writeback_ring) - used), sizeof(writeback_ring) - pos);
+    if (n == 0) {
+      xTaskNotifyGive(hTaskMtpWriter);
+      xSemaphoreTake(writeback.space, portMAX_DELAY);
+      continue;
+    }
+    memcpy(writeback_ring + pos, (const uint8_t *)buf + done, n);
+    atomic_store_explicit(&writeback.head, head + n, memory_order_release);
+    done += n;
+    if (used + n >= FLASHIO_CHUNK) {
+      xTaskNotifyGive(hTaskMtpWriter);
+    }
+  }
+  return done;
+}
+
+// Barrier: everything buffered is in the file once this returns
+static void fs_writeback_drain(void)
+{
+  if (!writeback.active ||
+      atomic_load(&writeback.head) == atomic_load_explicit(&writeback.tail, memory_order_acquire)) {
+    return;
+  }
+  atomic_store(&writeback.drain, true);
+  xTaskNotifyGive(hTaskMtpWriter);
+  xSemaphoreTake(writeback.drained, portMAX_DELAY);
+}
+
+// The upload is over, or current_file is about to be closed. Returns fs_writeback_error().
+static int fs_writeback_end(void)
+{
+  fs_writeback_drain();
+  writeback.active = false;
+  return writeback.error;
+}
+
+// Body of TaskMtpWriter: wait for a chunk or a drain request, write, repeat
+void mtpWriterWork(void)
+{
+  if (writeback.client == nullptr) {
+    writeback.client = flashioRegister("mtp-writer", FLASHIO_PRIO_INTERACTIVE);
+  }
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  for (;;) {
+    const size_t tail = atomic_load_explicit(&writeback.tail, memory_order_relaxed);
+    const size_t avail = atomic_load_explicit(&writeback.head, memory_order_acquire) - tail;
+    const bool drain = atomic_load(&writeback.drain);
+    if (avail == 0 && drain) {
+      // Nothing arrives while the TinyUSB task waits for this
+      atomic_store(&writeback.drain, false);
+      xSemaphoreGive(writeback.drained);
+      break;
+    }
+    if (avail == 0 || (avail < FLASHIO_CHUNK && !drain)) {
+      break;
+    }
+    const size_t pos = tail % sizeof(writeback_ring);
+    const size_t n = TU_MIN(TU_MIN(avail, (size_t)FLASHIO_CHUNK), sizeof(writeback_ring) - pos);
+    if (fs_write_current_as(writeback.client, writeback_ring + pos, n) != n) {
+      fs_writeback_failed();
+    }
+    // Hash while the TinyUSB task takes the next packets, not in the data phase callback
+    fs_digest_upload_update(writeback_ring + pos, n);
+    atomic_store_explicit(&writeback.tail, tail + n, memory_order_release);
+    xSemaphoreGive(writeback.space);
+  }
+}
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <esp_log.h>
+#include "objmeta.h"
+
+#define TAG "objmeta"
+
+#define OBJMETA_MAGIC   0x4154454Du // "META"
+#define OBJMETA_VERSION 6
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t record_count;
+} objmeta_file_header_t;
+
+static objmeta_t records[OBJMETA_MAX_RECORDS];
+static char base[32];
+static size_t base_len;
+static bool dirty;
+
+// Paths handed in are absolute, records store them relative to the mount point
+static const char *objmetaRelative(const char *path)
+{
+    if (strncmp(path, base, base_len) == 0 && path[base_len] == '/') {
+        return path + base_len + 1;
+    }
+    return path;
+}
+
+static objmeta_t *objmetaFind(const char *path)
+{
+    const char *rel = objmetaRelative(path);
+    for (int ii = 0; ii < OBJMETA_MAX_RECORDS; ii++) {
+        if (records[ii].path[0] != '\0' && strcmp(records[ii].path, rel) == 0) {
+            return &records[ii];
+        }
+    }
+    return nullptr;
+}
+
+static void objmetaStorePath(char *out, size_t len, const char *file)
+{
+    snprintf(out, len, "%s/.mtp/%s", base, file);
+}
+
+void objmetaLoad(const char *base_path)
+{
+    char path[64];
+
+    strlcpy(base, base_path, sizeof(base));
+    base_len = strlen(base);
+    memset(records, 0, sizeof(records));
+    dirty = false;
+
+    objmetaStorePath(path, sizeof(path), "");
+    mkdir(path, 0777);
+
+    objmetaStorePath(path, sizeof(path), "objmeta");
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) {
+        return;
+    }
+
+    objmeta_file_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.magic != OBJMETA_MAGIC ||
+        header.version != OBJMETA_VERSION ||
+        header.record_size != sizeof(objmeta_t) ||
+        header.record_count > OBJMETA_MAX_RECORDS) {
+        ESP_LOGW(TAG, "Ignoring incompatible metadata store");
+        fclose(f);
+        return;
+    }
+    if (fread(records, sizeof(objmeta_t), header.record_count, f) != header.record_count) {
+        ESP_LOGW(TAG, "Metadata store truncated, dropping it");
+        memset(records, 0, sizeof(records));
+    }
+    fclose(f);
+    ESP_LOGI(TAG, "Loaded %d metadata records", header.record_count);
+}
+
+void objmetaSave(void)
+{
+    char path[64], tmp_path[64];
+
+    if (!dirty) {
+        return;
+    }
+
+    // Compact used records to the front so the file only holds live ones
+    uint32_t count = 0;
+    for (int ii = 0; ii < OBJMETA_MAX_RECORDS; ii++) {
+        if (records[ii].path[0] != '\0') {
+            if (ii != count) {
+                records[count] = records[ii];
+                records[ii].path[0] = '\0';
+            }
+            count++;
+        }
+    }
+
+    // Write a new copy and rename it over the old one, so a power cut never leaves a torn store
+    objmetaStorePath(path, sizeof(path), "objmeta");
+    objmetaStorePath(tmp_path, sizeof(tmp_path), "objmeta.tmp");
+    FILE *f = fopen(tmp_path, "w");
+    if (f == nullptr) {
+        ESP_LOGE(TAG, "Cannot write metadata store");
+        return;
+    }
+    const objmeta_file_header_t header = {
+        .magic = OBJMETA_MAGIC,
+        .version = OBJMETA_VERSION,
+        .record_size = sizeof(objmeta_t),
+        .record_count = count,
+    };
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(records, sizeof(objmeta_t), count, f) == count;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        ESP_LOGE(TAG, "Failed to save metadata store");
+        unlink(tmp_path);
+        return;
+    }
+    dirty = false;
+}
+
+bool objmetaPending(void)
+{
+    return dirty;
+}
+
+objmeta_t *objmetaLookup(const char *path)
+{
+    objmeta_t *record = objmetaFind(path);
+    if (record == nullptr) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size != record->size) {
+        return nullptr;
+    }
+    return record;
+}
+
+objmeta_t *objmetaUpdate(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return nullptr;
+    }
+
+    objmeta_t *record = objmetaFind(path);
+    if (record == nullptr) {
+        for (int ii = 0; ii < OBJMETA_MAX_RECORDS; ii++) {
+            if (records[ii].path[0] == '\0') {
+                record = &records[ii];
+                break;
+            }
+        }
+        if (record == nullptr) {
+            ESP_LOGW(TAG, "Metadata store full, not recording %s", path);
+            return nullptr;
+        }
+        memset(record, 0, sizeof(*record));
+        strlcpy(record->path, objmetaRelative(path), OBJMETA_PATH_LEN);
+    }
+
+    if (record->size != st.st_size) {
+        record->size = st.st_size;
+        record->flags = 0;
+    }
+    dirty = true;
+    return record;
+}
+
+void objmetaMarkDirty(void)
+{
+    dirty = true;
+}
+
+void objmetaRemove(const char *path)
+{
+    objmeta_t *record = objmetaFind(path);
+    if (record != nullptr) {
+        record->path[0] = '\0';
+        dirty = true;
+    }
+}
+
+void objmetaRename(const char *old_path, const char *new_path)
+{
+    objmeta_t *record = objmetaFind(old_path);
+    if (record != nullptr) {
+        objmetaRemove(new_path);
+        strlcpy(record->path, objmetaRelative(new_path), OBJMETA_PATH_LEN);
+        dirty = true;
+    }
+}
+
+int objmetaPrune(int *cursor, int count)
+{
+    int dropped = 0;
+    for (; *cursor < OBJMETA_MAX_RECORDS && count > 0; (*cursor)++, count--) {
+        objmeta_t *record = &records[*cursor];
+        if (record->path[0] == '\0') {
+            continue;
+        }
+        char path[sizeof(base) + OBJMETA_PATH_LEN + 1];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", base, record->path);
+        if (stat(path, &st) != 0) {
+            record->path[0] = '\0';
+            dirty = true;
+            dropped++;
+        }
+    }
+    return dropped;
+}
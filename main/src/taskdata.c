@@ -6,3 +6,5 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 TaskHandle_t hTaskTinyusb;
+TaskHandle_t hTaskMtpWriter;
+TaskHandle_t hTaskStorage;
@@ -0,0 +1,266 @@
+#include <stddef.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+#include "lzblock.h"
+#include "zfile.h"
+
+#define TAG "zfile"
+
+#define ZFILE_VERSION       2           // 1 had no frame index
+#define ZFILE_INDEX_MAGIC   0x5844495Au // "ZIDX"
+#define ZFILE_FRAME_RAW     0x8000u
+#define ZFILE_FRAME_LEN     0x7FFFu
+
+static const uint8_t zfile_magic[8] = { 0x89, 'M', 'T', 'P', 'Z', '\r', '\n', 0x1A };
+
+typedef struct __attribute__((packed)) {
+    uint8_t magic[8];
+    uint16_t version;
+    uint8_t block_shift;
+    uint8_t reserved;
+    uint32_t logical_size;
+    uint32_t header_crc;        // CRC32 over all fields above
+} zfile_header_t;
+
+// Last thing in the file, right after the index entries
+typedef struct __attribute__((packed)) {
+    uint32_t stride;            // Blocks per index entry
+    uint32_t count;             // Index entries
+    uint32_t magic;
+    uint32_t footer_crc;        // CRC32 over all fields above
+} zfile_footer_t;
+
+// Blocks per index entry for a file of logical_size bytes
+static uint32_t zfileIndexStride(uint32_t logical_size)
+{
+    const uint32_t blocks = (logical_size + ZFILE_BLOCK_SIZE - 1) >> ZFILE_BLOCK_SHIFT;
+    return blocks <= ZFILE_INDEX_MAX ? 1 : (blocks + ZFILE_INDEX_MAX - 1) / ZFILE_INDEX_MAX;
+}
+
+bool zfileProbe(FILE *f, uint32_t *logical_size)
+{
+    zfile_header_t header;
+    if (fseek(f, 0, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, f) != 1) {
+        return false;
+    }
+    if (memcmp(header.magic, zfile_magic, sizeof(zfile_magic)) != 0 ||
+        header.version < 1 || header.version > ZFILE_VERSION ||
+        header.block_shift != ZFILE_BLOCK_SHIFT ||
+        header.header_crc != esp_rom_crc32_le(0, (const uint8_t *)&header, offsetof(zfile_header_t, header_crc))) {
+        return false;
+    }
+    if (logical_size != nullptr) {
+        *logical_size = header.logical_size;
+    }
+    return true;
+}
+
+bool zfileOpenRead(zfile_t *z, FILE *f)
+{
+    if (!zfileProbe(f, &z->logical_size)) {
+        return false;
+    }
+    z->f = f;
+    z->pos = 0;
+    z->block_index = UINT32_MAX;
+    z->block_len = 0;
+    z->next_frame_index = 0;
+    z->next_frame_offset = sizeof(zfile_header_t);
+    z->index_offset = 0;
+
+    // No usable index only makes seeking slower
+    zfile_footer_t footer;
+    const uint32_t stride = zfileIndexStride(z->logical_size);
+    const uint32_t count = z->logical_size == 0 ? 0 : ((z->logical_size - 1) >> ZFILE_BLOCK_SHIFT) / stride + 1;
+    if (fseek(f, -(long)sizeof(footer), SEEK_END) == 0 && fread(&footer, sizeof(footer), 1, f) == 1 &&
+        footer.magic == ZFILE_INDEX_MAGIC && footer.stride == stride && footer.count == count &&
+        footer.footer_crc == esp_rom_crc32_le(0, (const uint8_t *)&footer, offsetof(zfile_footer_t, footer_crc))) {
+        z->index_stride = stride;
+        z->index_offset = ftell(f) - sizeof(footer) - count * sizeof(uint32_t);
+    }
+    return true;
+}
+
+// Move the frame walk close to block index, using the frame index
+static void zfileIndexJump(zfile_t *z, uint32_t index)
+{
+    const uint32_t entry = index / z->index_stride;
+    uint32_t offset;
+    if (fseek(z->f, z->index_offset + entry * sizeof(offset), SEEK_SET) != 0 ||
+        fread(&offset, sizeof(offset), 1, z->f) != 1 ||
+        offset < sizeof(zfile_header_t) || offset >= z->index_offset) {
+        ESP_LOGE(TAG, "Corrupted frame index");
+        return;
+    }
+    z->next_frame_index = entry * z->index_stride;
+    z->next_frame_offset = offset;
+}
+
+static bool zfileLoadBlock(zfile_t *z, uint32_t index)
+{
+    uint16_t frame;
+
+    // Frames are only chained forwards. Going back, or further ahead than the next index entry,
+    // starts from the closest indexed frame, or without an index from the first one.
+    if (z->index_offset != 0 &&
+        (index < z->next_frame_index || index - z->next_frame_index >= z->index_stride)) {
+        zfileIndexJump(z, index);
+    }
+    if (index < z->next_frame_index) {
+        z->next_frame_index = 0;
+        z->next_frame_offset = sizeof(zfile_header_t);
+    }
+    if (fseek(z->f, z->next_frame_offset, SEEK_SET) != 0) {
+        return false;
+    }
+    while (z->next_frame_index < index) {
+        if (fread(&frame, sizeof(frame), 1, z->f) != 1 ||
+            fseek(z->f, frame & ZFILE_FRAME_LEN, SEEK_CUR) != 0) {
+            return false;
+        }
+        z->next_frame_offset += sizeof(frame) + (frame & ZFILE_FRAME_LEN);
+        z->next_frame_index++;
+    }
+
+    const uint32_t expected_len = (index == (z->logical_size - 1) >> ZFILE_BLOCK_SHIFT)
+                                  ? z->logical_size - (index << ZFILE_BLOCK_SHIFT)
+                                  : ZFILE_BLOCK_SIZE;
+    if (fread(&frame, sizeof(frame), 1, z->f) != 1) {
+        return false;
+    }
+    const uint32_t frame_len = frame & ZFILE_FRAME_LEN;
+    if (frame_len > ZFILE_BLOCK_SIZE) {
+        ESP_LOGE(TAG, "Corrupted frame %d", index);
+        return false;
+    }
+    if (frame & ZFILE_FRAME_RAW) {
+        if (frame_len != expected_len || fread(z->raw, 1, frame_len, z->f) != frame_len) {
+            return false;
+        }
+    } else {
+        if (fread(z->packed, 1, frame_len, z->f) != frame_len ||
+            lzblockDecompress(z->packed, frame_len, z->raw, sizeof(z->raw)) != expected_len) {
+            ESP_LOGE(TAG, "Corrupted frame %d", index);
+            return false;
+        }
+    }
+
+    z->block_index = index;
+    z->block_len = expected_len;
+    z->next_frame_index = index + 1;
+    z->next_frame_offset += sizeof(frame) + frame_len;
+    return true;
+}
+
+size_t zfileRead(zfile_t *z, void *buf, size_t len)
+{
+    uint8_t *out = buf;
+    size_t done = 0;
+
+    while (done < len && z->pos < z->logical_size) {
+        const uint32_t index = z->pos >> ZFILE_BLOCK_SHIFT;
+        if (index != z->block_index && !zfileLoadBlock(z, index)) {
+            break;
+        }
+        const uint32_t within = z->pos - (index << ZFILE_BLOCK_SHIFT);
+        const size_t chunk = (len - done < z->block_len - within) ? len - done : z->block_len - within;
+        memcpy(out + done, z->raw + within, chunk);
+        done += chunk;
+        z->pos += chunk;
+    }
+    return done;
+}
+
+bool zfileSeek(zfile_t *z, uint32_t offset)
+{
+    if (offset > z->logical_size) {
+        return false;
+    }
+    z->pos = offset;
+    return true;
+}
+
+bool zfileOpenWrite(zfile_t *z, FILE *f, uint32_t logical_size)
+{
+    zfile_header_t header = {
+        .version = ZFILE_VERSION,
+        .block_shift = ZFILE_BLOCK_SHIFT,
+        .logical_size = logical_size,
+    };
+    memcpy(header.magic, zfile_magic, sizeof(zfile_magic));
+    header.header_crc = esp_rom_crc32_le(0, (const uint8_t *)&header, offsetof(zfile_header_t, header_crc));
+
+    z->f = f;
+    z->logical_size = logical_size;
+    z->pos = 0;
+    z->block_len = 0;
+    z->block_index = UINT32_MAX;
+    z->next_frame_index = 0;
+    z->next_frame_offset = sizeof(zfile_header_t);
+    z->index_stride = zfileIndexStride(logical_size);
+    return fwrite(&header, sizeof(header), 1, f) == 1;
+}
+
+static bool zfileFlushBlock(zfile_t *z)
+{
+    if (z->block_len == 0) {
+        return true;
+    }
+
+    // Anything that doesn't save at least a byte is stored as is
+    size_t packed_len = lzblockCompress(z->raw, z->block_len, z->packed, z->block_len - 1);
+    const uint8_t *data = z->packed;
+    uint16_t frame = packed_len;
+    if (packed_len == 0) {
+        data = z->raw;
+        packed_len = z->block_len;
+        frame = z->block_len | ZFILE_FRAME_RAW;
+    }
+
+    z->block_len = 0;
+    if (z->next_frame_index % z->index_stride == 0 && z->next_frame_index / z->index_stride < ZFILE_INDEX_MAX) {
+        z->index[z->next_frame_index / z->index_stride] = z->next_frame_offset;
+    }
+    z->next_frame_index++;
+    z->next_frame_offset += sizeof(frame) + packed_len;
+    return fwrite(&frame, sizeof(frame), 1, z->f) == 1 &&
+           fwrite(data, 1, packed_len, z->f) == packed_len;
+}
+
+size_t zfileWrite(zfile_t *z, const void *buf, size_t len)
+{
+    const uint8_t *in = buf;
+    size_t done = 0;
+
+    while (done < len) {
+        const size_t chunk = (len - done < ZFILE_BLOCK_SIZE - z->block_len) ? len - done : ZFILE_BLOCK_SIZE - z->block_len;
+        memcpy(z->raw + z->block_len, in + done, chunk);
+        z->block_len += chunk;
+        done += chunk;
+        z->pos += chunk;
+        if (z->block_len == ZFILE_BLOCK_SIZE && !zfileFlushBlock(z)) {
+            return done - chunk;
+        }
+    }
+    return done;
+}
+
+bool zfileFinish(zfile_t *z)
+{
+    if (z->pos != z->logical_size) {
+        ESP_LOGW(TAG, "Wrote %d bytes, header says %d", z->pos, z->logical_size);
+    }
+    if (!zfileFlushBlock(z)) {
+        return false;
+    }
+
+    zfile_footer_t footer = {
+        .stride = z->index_stride,
+        .count = z->next_frame_index == 0 ? 0 : (z->next_frame_index - 1) / z->index_stride + 1,
+        .magic = ZFILE_INDEX_MAGIC,
+    };
+    footer.footer_crc = esp_rom_crc32_le(0, (const uint8_t *)&footer, offsetof(zfile_footer_t, footer_crc));
+    return fwrite(z->index, sizeof(uint32_t), footer.count, z->f) == footer.count &&
+           fwrite(&footer, sizeof(footer), 1, z->f) == 1;
+}
@@ -0,0 +1,9 @@
+#include "tasks.h"
+#include "mtp.h"
+
+void TaskMtpWriter(void *pvParameters)
+{
+    while (true) {
+        mtpWriterWork();
+    }
+}
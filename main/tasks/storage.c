@@ -0,0 +1,9 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "tasks.h"
+
+void TaskStorage(void *pvParameters)
+{
+    init_storage();
+    vTaskDelete(NULL);
+}
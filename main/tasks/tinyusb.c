@@ -2,11 +2,14 @@
 #include <assert.h>
 #include "tasks.h"
 #include "tusb.h"
+#include "mtp.h"
 #include <esp_log.h>
 
 void TaskTinyusb(void *pvParameters)
 {
+    uint32_t wait_ms = MTP_POLL_INTERVAL_MS;
     while (true) {
-        tud_task();
+        tud_task_ext(wait_ms, false);
+        wait_ms = mtpPoll();
     }
 }
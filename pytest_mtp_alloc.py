@@ -0,0 +1,52 @@
+# SPDX-FileCopyrightText: 2025 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: CC0-1.0
+#
+# Allocation check: built with sdkconfig.ci.alloccheck, the responder counts the heap allocations
+# the TinyUSB task makes during each data phase. An upload and a download through libmtp's
+# command line tools (mtp-sendfile, mtp-getfile) must not allocate between their first and last
+# packet. The ESP32-S3 USB OTG port has to be connected to the runner besides the serial console.
+import os
+import re
+import shutil
+import subprocess
+from pathlib import Path
+
+import pytest
+from pytest_embedded_idf.dut import IdfDut
+from pytest_embedded_idf.utils import idf_parametrize
+
+MTP_OP_GET_OBJECT = '1009'
+MTP_OP_SEND_OBJECT = '100D'
+TEST_FILE_SIZE = 256 * 1024
+
+
+def expect_no_mid_transfer_allocations(dut: IdfDut, op_code: str) -> None:
+    match = dut.expect(
+        rf'Data phase of {op_code} done: (\d+) allocations mid-transfer, (\d+) at its ends', timeout=60
+    )
+    assert int(match.group(1)) == 0
+
+
+@pytest.mark.usb_device
+@pytest.mark.parametrize('config', ['alloccheck'], indirect=True)
+@idf_parametrize('target', ['esp32s3'], indirect=['target'])
+def test_mtp_transfer_allocations(dut: IdfDut, tmp_path: Path) -> None:
+    if shutil.which('mtp-sendfile') is None or shutil.which('mtp-getfile') is None:
+        pytest.skip('libmtp command line tools are not installed')
+    dut.expect('Object index took', timeout=60)
+
+    upload = tmp_path / 'alloccheck.bin'
+    upload.write_bytes(os.urandom(TEST_FILE_SIZE))
+    sent = subprocess.run(
+        ['mtp-sendfile', str(upload), 'alloccheck.bin'], capture_output=True, text=True, timeout=120, check=True
+    )
+    expect_no_mid_transfer_allocations(dut, MTP_OP_SEND_OBJECT)
+    file_id = re.search(r'New file ID:\s*(\d+)', sent.stdout + sent.stderr)
+    assert file_id is not None, sent.stdout
+
+    download = tmp_path / 'alloccheck.out'
+    subprocess.run(
+        ['mtp-getfile', file_id.group(1), str(download)], capture_output=True, timeout=120, check=True
+    )
+    expect_no_mid_transfer_allocations(dut, MTP_OP_GET_OBJECT)
+    assert download.read_bytes() == upload.read_bytes()